@@ -0,0 +1,245 @@
+#ifndef DEDUP_ARROW_IPC_H_
+#define DEDUP_ARROW_IPC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Just enough of the Arrow IPC streaming format (columnar format 1.0,
+// metadata version V5) to write record batches of fixed-width, non-null
+// columns, without depending on the Arrow libraries.  A stream is a schema
+// message, any number of record batch messages and an end-of-stream marker;
+// each message is a 0xFFFFFFFF continuation marker, the 8-byte padded length
+// of its flatbuffer metadata, the metadata, and the body of column buffers.
+// pyarrow.ipc.open_stream() and the other Arrow readers load it as a table.
+namespace arrow_ipc {
+
+enum class Type { kUint32, kFloat64 };
+
+struct Column {
+    const char* name;
+    Type type;
+};
+
+inline size_t width(Type type) { return type == Type::kUint32 ? 4 : 8; }
+
+inline size_t align8(size_t x) { return (x + 7) & ~size_t{7}; }
+
+// Flatbuffer written front to back: an object goes after every object that
+// refers to it, since a flatbuffer offset may only point forward.  Offsets
+// are written as placeholders and filled by link() once their target is
+// placed.  Scalars are aligned to their size from the start of the buffer.
+class Builder {
+   public:
+    struct Table {
+        size_t start;     // position of its vtable offset, what references point to
+        size_t field[8];  // position of each field, 0 if absent
+    };
+
+    Builder() { put<uint32_t>(0); }  // the root table, linked by the first table()
+
+    // Table with fields of the given sizes in vtable order, 0 for an absent one
+    Table table(std::initializer_list<size_t> sizes) {
+        Table t{};
+        std::vector<uint16_t> offsets;
+        size_t end = 4;  // after the vtable offset
+        for (const size_t size : sizes) {
+            if (size == 0) {
+                offsets.emplace_back(0);
+                continue;
+            }
+            end = (end + size - 1) / size * size;
+            offsets.emplace_back(static_cast<uint16_t>(end));
+            end += size;
+        }
+        end = (end + 3) & ~size_t{3};
+        pad(2);
+        const size_t vtable = bytes_.size();
+        put<uint16_t>(static_cast<uint16_t>(4 + 2 * offsets.size()));
+        put<uint16_t>(static_cast<uint16_t>(end));
+        for (const uint16_t o : offsets) {
+            put(o);
+        }
+        pad(8);
+        t.start = bytes_.size();
+        put<int32_t>(static_cast<int32_t>(t.start - vtable));
+        bytes_.resize(t.start + end);
+        for (size_t f = 0; f < offsets.size(); ++f) {
+            t.field[f] = offsets[f] == 0 ? 0 : t.start + offsets[f];
+        }
+        if (t.start != 0 && get<uint32_t>(0) == 0) {
+            link(0, t.start);
+        }
+        return t;
+    }
+
+    // Vector of n elements of size bytes each, aligned to align; the position
+    // of its length, what references point to.  Elements start 4 bytes on.
+    size_t vector(size_t n, size_t size, size_t align) {
+        while ((bytes_.size() + 4) % align != 0) {
+            bytes_.push_back('\0');
+        }
+        const size_t at = bytes_.size();
+        put<uint32_t>(static_cast<uint32_t>(n));
+        bytes_.resize(bytes_.size() + n * size);
+        return at;
+    }
+
+    size_t string(std::string_view s) {
+        pad(4);
+        const size_t at = bytes_.size();
+        put<uint32_t>(static_cast<uint32_t>(s.size()));
+        bytes_.append(s.data(), s.size());
+        bytes_.push_back('\0');
+        return at;
+    }
+
+    // Point the offset field at position at to target, which must come later
+    void link(size_t at, size_t target) { set<uint32_t>(at, static_cast<uint32_t>(target - at)); }
+
+    template <typename T>
+    void set(size_t at, T value) {
+        std::memcpy(&bytes_[at], &value, sizeof(T));
+    }
+
+    // The finished buffer, padded to a multiple of 8 bytes
+    const std::string& finish() {
+        pad(8);
+        return bytes_;
+    }
+
+   private:
+    std::string bytes_;
+
+    void pad(size_t align) {
+        while (bytes_.size() % align != 0) {
+            bytes_.push_back('\0');
+        }
+    }
+
+    template <typename T>
+    void put(T value) {
+        const size_t at = bytes_.size();
+        bytes_.resize(at + sizeof(T));
+        set(at, value);
+    }
+
+    template <typename T>
+    T get(size_t at) const {
+        T value;
+        std::memcpy(&value, &bytes_[at], sizeof(T));
+        return value;
+    }
+};
+
+// From Schema.fbs and Message.fbs
+constexpr int16_t kMetadataV5 = 4;
+constexpr uint8_t kHeaderSchema = 1;
+constexpr uint8_t kHeaderRecordBatch = 3;
+constexpr uint8_t kTypeInt = 2;
+constexpr uint8_t kTypeFloatingPoint = 3;
+constexpr int16_t kPrecisionDouble = 2;
+
+// Message table: version, header_type, header, bodyLength.  Returns the
+// position of the header offset.
+inline size_t message(Builder& fb, uint8_t header_type, int64_t body_length) {
+    const auto m = fb.table({2, 1, 4, 8});
+    fb.set(m.field[0], kMetadataV5);
+    fb.set(m.field[1], header_type);
+    fb.set(m.field[3], body_length);
+    return m.field[2];
+}
+
+inline void encapsulate(const std::string& metadata, std::string& out) {
+    const uint32_t continuation = 0xFFFFFFFF;
+    const auto length = static_cast<int32_t>(metadata.size());
+    out.append(reinterpret_cast<const char*>(&continuation), 4);
+    out.append(reinterpret_cast<const char*>(&length), 4);
+    out += metadata;
+}
+
+// Append the schema message of columns to out
+inline void write_schema(const std::vector<Column>& columns, std::string& out) {
+    Builder fb;
+    const size_t header = message(fb, kHeaderSchema, 0);
+    // Schema: endianness (default little), fields
+    const auto schema = fb.table({0, 4});
+    fb.link(header, schema.start);
+    const size_t fields = fb.vector(columns.size(), 4, 4);
+    fb.link(schema.field[1], fields);
+    for (size_t c = 0; c < columns.size(); ++c) {
+        // Field: name, nullable, type_type, type, dictionary, children
+        const auto field = fb.table({4, 1, 1, 4, 0, 4});
+        fb.link(fields + 4 + 4 * c, field.start);
+        fb.link(field.field[0], fb.string(columns[c].name));
+        fb.set<uint8_t>(field.field[1], 0);
+        if (columns[c].type == Type::kUint32) {
+            fb.set(field.field[2], kTypeInt);
+            const auto type = fb.table({4, 1});  // Int: bitWidth, is_signed
+            fb.link(field.field[3], type.start);
+            fb.set<int32_t>(type.field[0], 32);
+            fb.set<uint8_t>(type.field[1], 0);
+        } else {
+            fb.set(field.field[2], kTypeFloatingPoint);
+            const auto type = fb.table({2});  // FloatingPoint: precision
+            fb.link(field.field[3], type.start);
+            fb.set(type.field[0], kPrecisionDouble);
+        }
+        fb.link(field.field[5], fb.vector(0, 4, 4));
+    }
+    encapsulate(fb.finish(), out);
+}
+
+// Append a record batch of rows values per column to out; data[c] holds
+// column c's values, width(type) bytes each
+inline void write_batch(const std::vector<Column>& columns, const std::vector<const void*>& data, size_t rows,
+                        std::string& out) {
+    // Each column is an empty validity buffer (no nulls) and its values;
+    // every buffer starts 8-byte aligned in the body
+    std::vector<size_t> offsets;
+    size_t body = 0;
+    for (const Column& c : columns) {
+        offsets.emplace_back(body);
+        body += align8(rows * width(c.type));
+    }
+
+    Builder fb;
+    const size_t header = message(fb, kHeaderRecordBatch, static_cast<int64_t>(body));
+    // RecordBatch: length, nodes, buffers
+    const auto batch = fb.table({8, 4, 4});
+    fb.link(header, batch.start);
+    fb.set(batch.field[0], static_cast<int64_t>(rows));
+    const size_t nodes = fb.vector(columns.size(), 16, 8);  // FieldNode {length, null_count}
+    fb.link(batch.field[1], nodes);
+    const size_t buffers = fb.vector(2 * columns.size(), 16, 8);  // Buffer {offset, length}
+    fb.link(batch.field[2], buffers);
+    for (size_t c = 0; c < columns.size(); ++c) {
+        fb.set(nodes + 4 + 16 * c, static_cast<int64_t>(rows));
+        fb.set(nodes + 12 + 16 * c, int64_t{0});
+        fb.set(buffers + 4 + 32 * c, static_cast<int64_t>(offsets[c]));
+        fb.set(buffers + 12 + 32 * c, int64_t{0});
+        fb.set(buffers + 20 + 32 * c, static_cast<int64_t>(offsets[c]));
+        fb.set(buffers + 28 + 32 * c, static_cast<int64_t>(rows * width(columns[c].type)));
+    }
+    encapsulate(fb.finish(), out);
+
+    for (size_t c = 0; c < columns.size(); ++c) {
+        const size_t bytes = rows * width(columns[c].type);
+        out.append(static_cast<const char*>(data[c]), bytes);
+        out.append(align8(bytes) - bytes, '\0');
+    }
+}
+
+// Append the end-of-stream marker to out
+inline void write_end(std::string& out) {
+    const uint32_t marker[2] = {0xFFFFFFFF, 0};
+    out.append(reinterpret_cast<const char*>(marker), sizeof(marker));
+}
+
+}  // namespace arrow_ipc
+
+#endif  // DEDUP_ARROW_IPC_H_
@@ -0,0 +1,529 @@
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "./corpus.h"
+#include "./dedup.h"
+#include "./minhash_device.h"
+#include "./numa.h"
+#include "./online.h"
+
+using namespace std;
+
+// Stage benchmarks for the dedup pipeline.  Each stage is repeated until it has
+// run for --min-time seconds and the mean per pass is reported as docs/s and
+// MB/s of input text.
+
+struct Corpus {
+    vector<string> storage;
+    vector<string_view> docs;
+    size_t bytes = 0;
+    vector<pair<size_t, size_t>> edits;  // (copy, original), synthetic only
+};
+
+// Zipf-distributed vocabulary with log-normal document lengths, so a few
+// documents are orders of magnitude longer than the median.  Every tenth
+// document is a lightly edited copy of an earlier one.
+static Corpus synthetic_corpus(size_t n, uint32_t seed) {
+    mt19937 rng(seed);
+    vector<string> vocab(50000);
+    uniform_int_distribution<int> letter('a', 'z');
+    uniform_int_distribution<int> word_len(2, 10);
+    for (auto& w : vocab) {
+        w.resize(word_len(rng));
+        for (auto& c : w) {
+            c = static_cast<char>(letter(rng));
+        }
+    }
+    vector<double> weights(vocab.size());
+    for (size_t i = 0; i < weights.size(); ++i) {
+        weights[i] = 1.0 / (i + 1);
+    }
+    discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+    lognormal_distribution<double> length(4.5, 1.2);
+
+    Corpus corpus;
+    corpus.storage.reserve(n);
+    for (size_t d = 0; d < n; ++d) {
+        string doc;
+        if (d >= 10 && d % 10 == 0) {
+            const size_t original = uniform_int_distribution<size_t>(0, d - 1)(rng);
+            doc = corpus.storage[original];
+            corpus.edits.emplace_back(d, original);
+            const size_t at = uniform_int_distribution<size_t>(0, doc.size())(rng);
+            doc.insert(at, " edited ");
+        } else {
+            const auto words = min<size_t>(100000, 1 + static_cast<size_t>(length(rng)));
+            for (size_t w = 0; w < words; ++w) {
+                doc += vocab[zipf(rng)];
+                doc += (w % 17 == 16) ? ". " : " ";
+            }
+        }
+        corpus.bytes += doc.size();
+        corpus.storage.emplace_back(std::move(doc));
+    }
+    for (const auto& s : corpus.storage) {
+        corpus.docs.emplace_back(s);
+    }
+    return corpus;
+}
+
+// Replay a real corpus; the text is copied once so every pass sees warm pages
+static Corpus file_corpus(const string& path, CorpusFormat format, const string& field, size_t limit) {
+    Corpus corpus;
+    CorpusReader reader(path, format, field);
+    vector<string_view> batch;
+    while (reader.next_batch(batch) && corpus.storage.size() < limit) {
+        for (const auto doc : batch) {
+            if (corpus.storage.size() == limit) {
+                break;
+            }
+            corpus.storage.emplace_back(doc);
+            corpus.bytes += doc.size();
+        }
+    }
+    for (const auto& s : corpus.storage) {
+        corpus.docs.emplace_back(s);
+    }
+    return corpus;
+}
+
+static size_t peak_rss_kib() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss);
+}
+
+// Run pass() until min_seconds have elapsed (at least once) and return the mean
+// seconds per pass
+template <typename F>
+static double measure(double min_seconds, F&& pass) {
+    using clock = chrono::steady_clock;
+    const auto start = clock::now();
+    size_t passes = 0;
+    double elapsed = 0;
+    do {
+        pass();
+        ++passes;
+        elapsed = chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    return elapsed / passes;
+}
+
+static void report(const string& stage, const string& config, double seconds, size_t docs, size_t bytes) {
+    printf("%-12s %-28s %12.0f %10.1f %12.3f\n", stage.c_str(), config.c_str(), docs / seconds,
+           bytes / seconds / 1e6, seconds * 1e3);
+    fflush(stdout);
+}
+
+// Keeps the optimizer from discarding work whose result is otherwise unused
+static volatile size_t sink;
+
+static vector<size_t> parse_list(const string& s) {
+    vector<size_t> out;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) {
+        out.emplace_back(stoul(item));
+    }
+    return out;
+}
+
+static int usage(const char* argv0) {
+    cerr << "usage: " << argv0 << " [--docs N] [--corpus FILE [--jsonl] [--field NAME]] [--min-time SECONDS]\n"
+         << "       [--threads LIST] [--hashes LIST]\n"
+         << "  Benchmarks tokenization, feature extraction, signatures, signature comparison\n"
+         << "  and end-to-end dedup.  LISTs are comma separated, e.g. --threads 1,2,4.  The\n"
+         << "  corpus is synthetic unless --corpus is given, in which case the first N\n"
+         << "  documents of FILE are replayed.\n";
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    size_t num_docs = 20000;
+    string path, field = "text";
+    auto format = CorpusFormat::kText;
+    double min_time = 0.5;
+    const size_t hw = max(1u, thread::hardware_concurrency());
+    vector<size_t> threads = {1};
+    for (size_t t = 2; t <= hw; t *= 2) {
+        threads.emplace_back(t);
+    }
+    if (threads.back() != hw) {
+        threads.emplace_back(hw);
+    }
+    vector<size_t> hashes = {64, 128, 256};
+
+    for (int i = 1; i < argc; ++i) {
+        const string_view arg = argv[i];
+        if (arg == "--docs" && i + 1 < argc) {
+            num_docs = stoul(argv[++i]);
+        } else if (arg == "--corpus" && i + 1 < argc) {
+            path = argv[++i];
+        } else if (arg == "--jsonl") {
+            format = CorpusFormat::kJsonl;
+        } else if (arg == "--field" && i + 1 < argc) {
+            field = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            min_time = stod(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = parse_list(argv[++i]);
+        } else if (arg == "--hashes" && i + 1 < argc) {
+            hashes = parse_list(argv[++i]);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    const Corpus corpus = path.empty() ? synthetic_corpus(num_docs, 1) : file_corpus(path, format, field, num_docs);
+    const auto& docs = corpus.docs;
+    printf("corpus: %zu docs, %.1f MB%s\n", docs.size(), corpus.bytes / 1e6, path.empty() ? " (synthetic)" : "");
+    printf("%-12s %-28s %12s %10s %12s\n", "stage", "config", "docs/s", "MB/s", "ms/pass");
+
+    constexpr size_t kNgrams = 3;
+    constexpr size_t kFeatures = 262144;
+    constexpr double kThreshold = 0.3;
+
+    // A single-threaded instance exposes the per-document stages
+    Deduplicator base(kNgrams, 128, kThreshold, kFeatures, 16, 8, 1);
+
+    double t = measure(min_time, [&] {
+        size_t tokens = 0;
+        for (const auto doc : docs) {
+            TokenGen splitter(doc, base.delimiters());
+            while (splitter) {
+                tokens += !splitter().empty();
+            }
+        }
+        sink = tokens;
+    });
+    report("tokenize", string("TokenGen ") + base.delimiters().kernel_name(), t, docs.size(), corpus.bytes);
+
+    string token;
+    for (const auto& [name, options] : {pair<const char*, Utf8Options>{"Utf8TokenGen", {}},
+                                        pair<const char*, Utf8Options>{"Utf8TokenGen fold+nfkc", {false, true, true}},
+                                        pair<const char*, Utf8Options>{"Utf8TokenGen chars", {true, false, false}}}) {
+        t = measure(min_time, [&] {
+            size_t tokens = 0;
+            for (const auto doc : docs) {
+                Utf8TokenGen splitter(doc, base.delimiters(), options, token);
+                while (splitter) {
+                    tokens += !splitter().empty();
+                }
+            }
+            sink = tokens;
+        });
+        report("tokenize", name, t, docs.size(), corpus.bytes);
+    }
+
+    t = measure(min_time, [&] {
+        uint64_t x = 0;
+        for (const auto doc : docs) {
+            x ^= ExactDuplicateFilter::hash(doc).lo;
+        }
+        sink = x;
+    });
+    report("prefilter", "MurmurHash3_x64_128", t, docs.size(), corpus.bytes);
+
+    FeatureSet features(kFeatures);
+    ShingleScratch shingles;
+    for (const auto mode : {ShingleHash::kRolling, ShingleHash::kConcat}) {
+        base.set_shingle_hash(mode);
+        t = measure(min_time, [&] {
+            size_t total = 0;
+            for (const auto doc : docs) {
+                base.extract_features(doc, features, shingles);
+                total += features.size();
+            }
+            sink = total;
+        });
+        report("features", mode == ShingleHash::kRolling ? "rolling" : "concat", t, docs.size(), corpus.bytes);
+    }
+    base.set_shingle_hash(ShingleHash::kRolling);
+    base.set_tokenizer(Tokenizer::kUtf8Words, true, true);
+    t = measure(min_time, [&] {
+        size_t total = 0;
+        for (const auto doc : docs) {
+            base.extract_features(doc, features, shingles);
+            total += features.size();
+        }
+        sink = total;
+    });
+    report("features", "rolling utf8+fold+nfkc", t, docs.size(), corpus.bytes);
+    base.set_tokenizer(Tokenizer::kBytes);
+
+    for (const auto hash : {FeatureHash::kMurmur128, FeatureHash::kWyhash}) {
+        base.set_feature_hash(hash);
+        t = measure(min_time, [&] {
+            size_t total = 0;
+            for (const auto doc : docs) {
+                base.extract_features(doc, features, shingles);
+                total += features.size();
+            }
+            sink = total;
+        });
+        report("features", hash == FeatureHash::kWyhash ? "rolling wyhash" : "rolling murmur3_x64_128", t, docs.size(),
+               corpus.bytes);
+    }
+    base.set_feature_hash(FeatureHash::kMurmur32);
+
+    // One feature more than a power of two, so indices are reduced by % and
+    // not by a mask
+    {
+        const Deduplicator odd(kNgrams, 128, kThreshold, kFeatures + 1, 16, 8, 1);
+        FeatureSet odd_features(kFeatures + 1);
+        t = measure(min_time, [&] {
+            size_t total = 0;
+            for (const auto doc : docs) {
+                odd.extract_features(doc, odd_features, shingles);
+                total += odd_features.size();
+            }
+            sink = total;
+        });
+        report("features", "rolling % (not power of 2)", t, docs.size(), corpus.bytes);
+    }
+
+    // Feature sets are extracted once so the signature stage is timed alone
+    vector<vector<uint32_t>> feature_sets;
+    feature_sets.reserve(docs.size());
+    for (const auto doc : docs) {
+        base.extract_features(doc, features);
+        feature_sets.emplace_back(features.items());
+    }
+    // The same sets flattened as a CSR batch
+    vector<uint64_t> offsets = {0};
+    vector<uint32_t> flat;
+    for (const auto& f : feature_sets) {
+        flat.insert(flat.end(), f.begin(), f.end());
+        offsets.emplace_back(flat.size());
+    }
+    for (const size_t k : hashes) {
+        MinHasher hasher(k);
+        vector<uint32_t> sig(k);
+        for (const auto& kernel : minhash_kernels::available(k)) {
+            hasher.set_kernel(kernel);
+            t = measure(min_time, [&] {
+                for (const auto& f : feature_sets) {
+                    hasher.compute_signature(f.data(), f.size(), sig.data());
+                }
+                sink = sig[0];
+            });
+            report("signature", "k=" + to_string(k) + " " + kernel.name, t, docs.size(), corpus.bytes);
+        }
+        hasher.set_kernel(minhash_kernels::best(k));
+        vector<uint32_t> sigs(feature_sets.size() * k);
+        t = measure(min_time, [&] {
+            hasher.compute_signatures(offsets.data(), flat.data(), feature_sets.size(), sigs.data());
+            sink = sigs[0];
+        });
+        report("signature", "k=" + to_string(k) + " csr batch", t, docs.size(), corpus.bytes);
+        // The offload backends, double-buffered through the same CSR batch,
+        // must agree with the CPU kernels bit for bit
+        for (const char* name : minhash_device::backends()) {
+            const auto [a, b] = hasher.coefficients();
+            minhash_device::Signer device(minhash_device::make_backend(name, a, b, k), k);
+            vector<uint32_t> device_sigs(sigs.size());
+            t = measure(min_time, [&] {
+                device.compute_signatures(offsets.data(), flat.data(), feature_sets.size(), device_sigs.data());
+                sink = device_sigs[0];
+            });
+            if (device_sigs != sigs) {
+                cerr << "signature k=" << k << ": " << name << " backend differs from the CPU kernels\n";
+                return 1;
+            }
+            report("signature", "k=" + to_string(k) + " device " + name, t, docs.size(), corpus.bytes);
+        }
+        OnePermutationHasher oph(k);
+        t = measure(min_time, [&] {
+            for (const auto& f : feature_sets) {
+                oph.compute_signature(f.data(), f.size(), sig.data());
+            }
+            sink = sig[0];
+        });
+        report("signature", "k=" + to_string(k) + " oph", t, docs.size(), corpus.bytes);
+    }
+
+    // Estimation error of both engines against the exact Jaccard similarity
+    // of the feature sets, on the edited copies and their originals
+    if (!corpus.edits.empty()) {
+        for (const size_t k : hashes) {
+            MinHasher hasher(k);
+            OnePermutationHasher oph(k);
+            double minhash_error = 0, oph_error = 0;
+            for (const auto& [i, j] : corpus.edits) {
+                // Feature sets are in insertion order
+                auto a = feature_sets[i], b = feature_sets[j];
+                sort(a.begin(), a.end());
+                sort(b.begin(), b.end());
+                vector<uint32_t> common;
+                set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(common));
+                const size_t total = a.size() + b.size() - common.size();
+                const double exact = total == 0 ? 1.0 : static_cast<double>(common.size()) / total;
+                minhash_error +=
+                    abs(1.0 - MinHasher::jaccard_distance(hasher.compute_signature(a), hasher.compute_signature(b)) -
+                        exact);
+                oph_error +=
+                    abs(1.0 - MinHasher::jaccard_distance(oph.compute_signature(a), oph.compute_signature(b)) - exact);
+            }
+            printf("quality      k=%-26zu minhash %.4f, oph %.4f mean |error| over %zu pairs\n", k,
+                   minhash_error / corpus.edits.size(), oph_error / corpus.edits.size(), corpus.edits.size());
+        }
+    }
+
+    // Random pairs, the access pattern of candidate verification; also at the
+    // command line's default of 13 hashes, shorter than one kernel block
+    vector<size_t> compare_hashes = hashes;
+    if (find(compare_hashes.begin(), compare_hashes.end(), 13) == compare_hashes.end()) {
+        compare_hashes.insert(compare_hashes.begin(), 13);
+    }
+    for (const size_t k : compare_hashes) {
+        MinHasher hasher(k);
+        vector<vector<uint32_t>> sigs;
+        for (const auto& f : feature_sets) {
+            sigs.emplace_back(hasher.compute_signature(f));
+        }
+        mt19937 rng(7);
+        uniform_int_distribution<size_t> pick(0, sigs.size() - 1);
+        vector<pair<size_t, size_t>> pairs(docs.size());
+        for (auto& p : pairs) {
+            p = {pick(rng), pick(rng)};
+        }
+        t = measure(min_time, [&] {
+            double total = 0;
+            for (const auto& [i, j] : pairs) {
+                total += MinHasher::jaccard_distance(sigs[i], sigs[j]);
+            }
+            sink = static_cast<size_t>(total);
+        });
+        report("compare", "k=" + to_string(k) + " jaccard_distance", t, pairs.size(), 0);
+
+        for (const unsigned bits : {32u, 16u, 8u}) {
+            SignatureStore store(k, bits);
+            store.append(sigs.size());
+            for (size_t i = 0; i < sigs.size(); ++i) {
+                store.set(i, sigs[i].data(), static_cast<uint32_t>(feature_sets[i].size()));
+            }
+            for (const auto& kernel : match_kernels::available(bits)) {
+                store.set_match_kernel(kernel);
+                t = measure(min_time, [&] {
+                    size_t total = 0;
+                    for (const auto& [i, j] : pairs) {
+                        total += store.matches(i, j);
+                    }
+                    sink = total;
+                });
+                report("compare", "k=" + to_string(k) + " store b=" + to_string(bits) + " " + kernel.name, t,
+                       pairs.size(), 0);
+            }
+            store.set_match_kernel(match_kernels::best(bits));
+
+            // Random pairs are almost never similar, so most are cut short
+            const size_t need = store.min_matches(kThreshold);
+            t = measure(min_time, [&] {
+                size_t total = 0;
+                for (const auto& [i, j] : pairs) {
+                    total += store.matches(i, j, need) >= need;
+                }
+                sink = total;
+            });
+            report("compare", "k=" + to_string(k) + " store b=" + to_string(bits) + " pruned", t, pairs.size(), 0);
+        }
+    }
+
+    for (const size_t k : hashes) {
+        for (const size_t n : threads) {
+            Deduplicator dedup(kNgrams, k, kThreshold, kFeatures, k / 8, 8, n);
+            size_t found = 0;
+            t = measure(min_time, [&] {
+                dedup.clear();
+                dedup.add(docs);
+                found = dedup.duplicates().size();
+            });
+            report("end-to-end", "k=" + to_string(k) + " threads=" + to_string(n), t, docs.size(), corpus.bytes);
+
+            // The same corpus streamed through add_stream in slices, as a
+            // reader would deliver it
+            t = measure(min_time, [&] {
+                dedup.clear();
+                size_t at = 0;
+                dedup.add_stream([&](vector<string_view>& slice) {
+                    const size_t end = min(docs.size(), at + 16384);
+                    slice.assign(docs.begin() + at, docs.begin() + end);
+                    at = end;
+                    return !slice.empty();
+                });
+                found = dedup.duplicates().size();
+            });
+            report("end-to-end", "k=" + to_string(k) + " threads=" + to_string(n) + " pipelined", t, docs.size(),
+                   corpus.bytes);
+            sink = found;
+        }
+    }
+
+    // Scaling over NUMA nodes: every CPU of the first n nodes, pinned, with
+    // pages interleaved over those nodes; efficiency is against n times the
+    // one-node rate
+    {
+        const numa::Topology topology = numa::detect();
+        const size_t k = hashes.front();
+        double one_node = 0;
+        for (size_t n = 1; n <= topology.nodes.size(); ++n) {
+            const numa::Topology used = topology.first(n);
+            numa::interleave(used);
+            Deduplicator dedup(kNgrams, k, kThreshold, kFeatures, k / 8, 8, used.cpus());
+            dedup.set_numa_placement(used);
+            size_t found = 0;
+            t = measure(min_time, [&] {
+                dedup.clear();
+                dedup.add(docs);
+                found = dedup.duplicates().size();
+            });
+            sink = found;
+            if (n == 1) {
+                one_node = docs.size() / t;
+            }
+            report("numa", "k=" + to_string(k) + " nodes=" + to_string(n) + " threads=" + to_string(used.cpus()), t,
+                   docs.size(), corpus.bytes);
+            printf("numa         nodes=%-2zu efficiency %.2f\n", n, docs.size() / t / (n * one_node));
+        }
+        numa::interleave(topology.first(1));
+    }
+
+    // Documents inserted one at a time; latency should not grow as the index fills
+    for (const size_t k : hashes) {
+        const Deduplicator config(kNgrams, k, kThreshold, kFeatures, k / 8, 8, 1);
+        OnlineDeduplicator online(config, docs.size());
+        vector<double> latency(docs.size());
+        size_t found = 0;
+        for (size_t i = 0; i < docs.size(); ++i) {
+            const auto start = chrono::steady_clock::now();
+            found += online.insert_or_match(i, docs[i]);
+            latency[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        }
+        sink = found;
+        for (size_t q = 0; q < 4; ++q) {
+            const size_t n = latency.size();
+            vector<double> part(latency.begin() + q * n / 4, latency.begin() + (q + 1) * n / 4);
+            if (part.empty()) {
+                continue;
+            }
+            sort(part.begin(), part.end());
+            printf("online       k=%-3zu fill %3zu-%3zu%%           p50 %.2f us, p99 %.2f us\n", k, 25 * q,
+                   25 * (q + 1), part[part.size() / 2], part[min(part.size() - 1, part.size() * 99 / 100)]);
+        }
+    }
+
+    printf("peak RSS: %.1f MiB\n", peak_rss_kib() / 1024.0);
+    return 0;
+}
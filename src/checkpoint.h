@@ -0,0 +1,247 @@
+#ifndef DEDUP_CHECKPOINT_H_
+#define DEDUP_CHECKPOINT_H_
+
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "./dedup.h"
+#include "./index_file.h"
+
+// Checkpoint directories: what a run over one input file has finished, so
+// that the run restarted after a crash or preemption picks up from there.
+//
+//   sigs-N.idx  the signatures of the documents added since sigs-(N-1), an
+//               index file without buckets (write_signatures())
+//   progress    how many of those files there are and the input offset and
+//               document count they cover
+//   labels      union-find labels of every document after merging the first
+//               so many candidate pairs, with the settings that ordered them
+//
+// Every file is replaced atomically, and progress only after the signatures
+// it counts, so whichever moment a run stops the directory describes a state
+// it passed through; a sigs file beyond progress is overwritten on resume.
+namespace checkpoint {
+
+constexpr char kMagic[8] = {'D', 'E', 'D', 'U', 'P', 'C', 'K', 'P'};
+constexpr char kLabelsMagic[8] = {'D', 'E', 'D', 'U', 'P', 'C', 'K', 'L'};
+constexpr uint32_t kVersion = 1;
+
+struct Progress {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    IndexParams params;
+    uint64_t input_size;    // bytes of the input file
+    uint64_t input_offset;  // bytes of it whose documents are in the sigs files
+    uint64_t docs;          // documents in the sigs files
+    uint64_t shards;        // sigs files
+};
+
+// Followed by DocId[docs]
+struct LabelsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t docs;
+    uint64_t merged;  // candidate pairs the labels include
+    double threshold;
+    uint64_t max_bucket;
+    uint32_t cardinality_pruning;
+    uint32_t external;  // candidates came from the external join, in its order
+};
+
+inline std::string progress_path(const std::string& dir) { return dir + "/progress"; }
+inline std::string labels_path(const std::string& dir) { return dir + "/labels"; }
+
+inline std::string shard_path(const std::string& dir, size_t shard) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/sigs-%05zu.idx", shard);
+    return dir + name;
+}
+
+}  // namespace checkpoint
+
+// Writes checkpoints of one run over an input file to a directory, at most
+// once per interval, and restores the last one.  The resumed run must use
+// the same input and configuration; signature parameters and input size are
+// checked, and the labels are only resumed under the same matching settings
+// (otherwise matching starts over, which gives the same result).  Its output
+// is then exactly that of a run without interruption.
+class Checkpoint {
+   public:
+    using clock = std::chrono::steady_clock;
+
+    // dir is created if missing
+    Checkpoint(std::string dir, double interval_seconds, uint64_t input_size)
+        : dir_(std::move(dir)), interval_(interval_seconds), input_size_(input_size), last_(clock::now()) {
+        if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::generic_category(), "mkdir " + dir_);
+        }
+    }
+
+    // Append the signatures of the last checkpoint to dedup, which must be
+    // empty and configured as the run that wrote it was.  False if dir holds
+    // no checkpoint.
+    bool resume(Deduplicator& dedup) {
+        std::ifstream in(checkpoint::progress_path(dir_), std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        checkpoint::Progress p{};
+        in.read(reinterpret_cast<char*>(&p), sizeof(p));
+        if (!in || std::memcmp(p.magic, checkpoint::kMagic, sizeof(p.magic)) != 0 ||
+            p.version != checkpoint::kVersion || p.byte_order != index_file::kByteOrder) {
+            throw std::runtime_error(dir_ + ": not a dedup checkpoint of this version and byte order");
+        }
+        if (p.params != dedup.params()) {
+            throw std::runtime_error(dir_ + ": checkpoint was made with different parameters");
+        }
+        if (p.input_size != input_size_) {
+            throw std::runtime_error(dir_ + ": checkpoint was made for an input of another size");
+        }
+        if (dedup.size() != 0) {
+            throw std::logic_error("Checkpoint: resume into a non-empty deduplicator");
+        }
+        for (size_t s = 0; s < p.shards; ++s) {
+            dedup.add_signatures(MappedIndex(checkpoint::shard_path(dir_, s)));
+        }
+        if (dedup.size() != p.docs) {
+            throw std::runtime_error(dir_ + ": checkpoint signatures do not add up to its document count");
+        }
+        shards_ = p.shards;
+        docs_ = p.docs;
+        offset_ = p.input_offset;
+        if (offset_ == input_size_) {
+            read_labels(dedup);
+        }
+        return true;
+    }
+
+    // Input bytes and documents the restored or last written checkpoint covers
+    uint64_t input_offset() const { return offset_; }
+    uint64_t docs() const { return docs_; }
+
+    // Labels to resume Deduplicator::clusters() from and the pairs they
+    // include; empty and 0 if there are none for the current settings
+    const std::vector<DocId>& labels() const { return labels_; }
+    uint64_t merged() const { return merged_; }
+
+    // Note that the documents of the input up to offset are in dedup, and
+    // checkpoint those added since the last call if interval has passed or
+    // force is set.  True if a checkpoint was written.
+    bool signed_to(const Deduplicator& dedup, uint64_t offset, bool force = false) {
+        if (offset == offset_ || (!force && !due())) {
+            return false;
+        }
+        write_signatures(checkpoint::shard_path(dir_, shards_), dedup.params(), dedup.signatures(), docs_,
+                         dedup.size());
+        ++shards_;
+        docs_ = dedup.size();
+        offset_ = offset;
+
+        checkpoint::Progress p{};
+        std::memcpy(p.magic, checkpoint::kMagic, sizeof(p.magic));
+        p.version = checkpoint::kVersion;
+        p.byte_order = index_file::kByteOrder;
+        p.params = dedup.params();
+        p.input_size = input_size_;
+        p.input_offset = offset_;
+        p.docs = docs_;
+        p.shards = shards_;
+        index_file::Writer out(checkpoint::progress_path(dir_));
+        out.write(&p, sizeof(p));
+        out.commit();
+        written();
+        return true;
+    }
+
+    // A hook for Deduplicator::clusters() that checkpoints the sets once per
+    // interval
+    Deduplicator::ClusterHook hook(const Deduplicator& dedup) {
+        return [this, &dedup](uint64_t merged, ConcurrentUnionFind& sets) {
+            if (!due()) {
+                return;
+            }
+            checkpoint::LabelsHeader h = settings(dedup);
+            h.merged = merged;
+            std::vector<DocId> labels(sets.size());
+            for (size_t i = 0; i < labels.size(); ++i) {
+                labels[i] = sets.find(static_cast<DocId>(i));
+            }
+            index_file::Writer out(checkpoint::labels_path(dir_));
+            out.write(&h, sizeof(h));
+            out.write(labels.data(), labels.size() * sizeof(DocId));
+            out.commit();
+            written();
+        };
+    }
+
+    // Checkpoints written by this instance
+    size_t count() const { return count_; }
+
+   private:
+    std::string dir_;
+    double interval_;
+    uint64_t input_size_;
+    clock::time_point last_;
+    size_t count_ = 0;
+    uint64_t shards_ = 0;
+    uint64_t docs_ = 0;
+    uint64_t offset_ = 0;
+    std::vector<DocId> labels_;
+    uint64_t merged_ = 0;
+
+    bool due() const { return std::chrono::duration<double>(clock::now() - last_).count() >= interval_; }
+
+    void written() {
+        last_ = clock::now();
+        ++count_;
+    }
+
+    // What orders the candidate pairs and decides which are merged
+    static checkpoint::LabelsHeader settings(const Deduplicator& dedup) {
+        checkpoint::LabelsHeader h{};
+        std::memcpy(h.magic, checkpoint::kLabelsMagic, sizeof(h.magic));
+        h.version = checkpoint::kVersion;
+        h.byte_order = index_file::kByteOrder;
+        h.docs = dedup.size();
+        h.threshold = dedup.threshold();
+        h.max_bucket = dedup.index().max_bucket();
+        h.cardinality_pruning = dedup.cardinality_pruning();
+        h.external = dedup.memory_budget() != 0;
+        return h;
+    }
+
+    void read_labels(const Deduplicator& dedup) {
+        std::ifstream in(checkpoint::labels_path(dir_), std::ios::binary);
+        checkpoint::LabelsHeader h{};
+        if (!in.read(reinterpret_cast<char*>(&h), sizeof(h))) {
+            return;
+        }
+        const checkpoint::LabelsHeader want = settings(dedup);
+        if (std::memcmp(h.magic, want.magic, sizeof(h.magic)) != 0 || h.version != want.version ||
+            h.byte_order != want.byte_order || h.docs != want.docs || h.threshold != want.threshold ||
+            h.max_bucket != want.max_bucket || h.cardinality_pruning != want.cardinality_pruning ||
+            h.external != want.external) {
+            return;
+        }
+        std::vector<DocId> labels(h.docs);
+        if (in.read(reinterpret_cast<char*>(labels.data()), labels.size() * sizeof(DocId))) {
+            labels_ = std::move(labels);
+            merged_ = h.merged;
+        }
+    }
+};
+
+#endif  // DEDUP_CHECKPOINT_H_
@@ -0,0 +1,340 @@
+#ifndef DEDUP_CORPUS_H_
+#define DEDUP_CORPUS_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+enum class CorpusFormat {
+    kText,   // one document per line
+    kJsonl,  // one JSON object per line, document in a string field
+};
+
+namespace corpus_detail {
+
+inline void append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+inline bool parse_hex4(std::string_view s, size_t pos, uint32_t& cp) {
+    if (pos + 4 > s.size()) {
+        return false;
+    }
+    cp = 0;
+    for (size_t i = pos; i < pos + 4; ++i) {
+        const char c = s[i];
+        cp <<= 4;
+        if (c >= '0' && c <= '9') {
+            cp |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            cp |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            cp |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decode the body of a JSON string literal (without the quotes)
+inline void unescape(std::string_view s, std::string& out) {
+    out.clear();
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            out += s[i];
+            continue;
+        }
+        switch (s[++i]) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if (!parse_hex4(s, i + 1, cp)) {
+                    out += 'u';
+                    break;
+                }
+                i += 4;
+                uint32_t lo;
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 2 < s.size() && s[i + 1] == '\\' && s[i + 2] == 'u' &&
+                    parse_hex4(s, i + 3, lo) && lo >= 0xDC00 && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    i += 6;
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default: out += s[i]; break;  // \" \\ \/
+        }
+    }
+}
+
+inline void skip_ws(std::string_view s, size_t& i) {
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n')) {
+        ++i;
+    }
+}
+
+// s[i] is the opening quote; leaves i one past the closing quote.  Returns the
+// raw body and whether it contains escapes.
+inline bool scan_string(std::string_view s, size_t& i, std::string_view& body, bool& escaped) {
+    const size_t start = ++i;
+    escaped = false;
+    while (i < s.size()) {
+        if (s[i] == '\\') {
+            escaped = true;
+            i += 2;
+        } else if (s[i] == '"') {
+            body = s.substr(start, i - start);
+            ++i;
+            return true;
+        } else {
+            ++i;
+        }
+    }
+    return false;
+}
+
+inline bool skip_value(std::string_view s, size_t& i) {
+    std::string_view body;
+    bool escaped;
+    if (i >= s.size()) {
+        return false;
+    }
+    if (s[i] == '"') {
+        return scan_string(s, i, body, escaped);
+    }
+    if (s[i] == '{' || s[i] == '[') {
+        size_t depth = 0;
+        while (i < s.size()) {
+            const char c = s[i];
+            if (c == '"') {
+                if (!scan_string(s, i, body, escaped)) {
+                    return false;
+                }
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    ++i;
+                    return true;
+                }
+            }
+            ++i;
+        }
+        return false;
+    }
+    // number, true, false, null
+    while (i < s.size() && s[i] != ',' && s[i] != '}' && s[i] != ']') {
+        ++i;
+    }
+    return true;
+}
+
+// Find the string value of a top-level key in a single JSON object.  Values
+// without escapes are returned as views into line; escaped ones are decoded
+// into scratch.  Returns an empty view if the key is missing or not a string.
+inline std::string_view json_field(std::string_view line, std::string_view key, std::string& scratch) {
+    size_t i = 0;
+    skip_ws(line, i);
+    if (i >= line.size() || line[i] != '{') {
+        return {};
+    }
+    ++i;
+    while (true) {
+        skip_ws(line, i);
+        if (i >= line.size() || line[i] != '"') {
+            return {};
+        }
+        std::string_view name, value;
+        bool name_escaped, value_escaped;
+        if (!scan_string(line, i, name, name_escaped)) {
+            return {};
+        }
+        skip_ws(line, i);
+        if (i >= line.size() || line[i] != ':') {
+            return {};
+        }
+        ++i;
+        skip_ws(line, i);
+        if (name == key && i < line.size() && line[i] == '"') {
+            if (!scan_string(line, i, value, value_escaped)) {
+                return {};
+            }
+            if (!value_escaped) {
+                return value;
+            }
+            unescape(value, scratch);
+            return scratch;
+        }
+        if (!skip_value(line, i)) {
+            return {};
+        }
+        skip_ws(line, i);
+        if (i >= line.size() || line[i] != ',') {
+            return {};
+        }
+        ++i;
+    }
+}
+
+}  // namespace corpus_detail
+
+// Walks a newline-delimited corpus through a sliding read-only mapping so that
+// inputs larger than RAM never have to be resident at once.  Documents are
+// handed out batch by batch as string_views into the current window; they stay
+// valid until the next call to next_batch.
+class CorpusReader {
+   public:
+    static constexpr size_t kDefaultWindow = size_t{1} << 30;
+
+    CorpusReader(const std::string& path, CorpusFormat format, std::string field = "text",
+                 size_t window = kDefaultWindow)
+        : format_(format), field_(std::move(field)), window_(window) {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd_, &st) != 0) {
+            const int err = errno;
+            ::close(fd_);
+            throw std::system_error(err, std::generic_category(), "fstat " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        page_ = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    }
+
+    CorpusReader(const CorpusReader&) = delete;
+    CorpusReader& operator=(const CorpusReader&) = delete;
+
+    ~CorpusReader() {
+        unmap();
+        ::close(fd_);
+    }
+
+    // Replace docs with the records of the next window, one per line (empty
+    // lines included so that a document's id is its line number).  Returns
+    // false at end of input.
+    bool next_batch(std::vector<std::string_view>& docs) {
+        docs.clear();
+        scratch_.clear();
+        unmap();
+        if (pos_ >= size_) {
+            return false;
+        }
+
+        // Grow the window until it holds at least one complete line
+        size_t len = window_;
+        std::string_view text;
+        while (true) {
+            map(pos_, len);
+            text = std::string_view(map_ + (pos_ - map_offset_), map_len_ - (pos_ - map_offset_));
+            if (pos_ + text.size() >= size_) {
+                break;
+            }
+            const auto nl = text.rfind('\n');
+            if (nl != std::string_view::npos) {
+                text = text.substr(0, nl + 1);
+                break;
+            }
+            unmap();
+            len *= 2;
+        }
+        pos_ += text.size();
+
+        while (!text.empty()) {
+            const auto nl = text.find('\n');
+            std::string_view line = text.substr(0, nl);
+            text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (format_ == CorpusFormat::kJsonl) {
+                std::string decoded;
+                line = corpus_detail::json_field(line, field_, decoded);
+                if (line.data() == decoded.data()) {
+                    line = scratch_.emplace_back(std::move(decoded));
+                }
+            }
+            docs.emplace_back(line);
+        }
+        return true;
+    }
+
+    // Bytes of input, and bytes of it handed out so far; the offset is always
+    // at the start of a line
+    size_t size() const { return size_; }
+    size_t offset() const { return pos_; }
+
+    // Continue from an offset() of an earlier reader of the same file
+    void seek(size_t pos) { pos_ = pos; }
+
+   private:
+    CorpusFormat format_;
+    std::string field_;
+    size_t window_;
+    int fd_ = -1;
+    size_t size_ = 0;
+    size_t page_ = 0;
+    size_t pos_ = 0;
+
+    const char* map_ = nullptr;
+    size_t map_offset_ = 0;
+    size_t map_len_ = 0;
+    // Decoded JSON strings that could not be viewed in place; a deque keeps
+    // their addresses stable while the batch grows
+    std::deque<std::string> scratch_;
+
+    void map(size_t pos, size_t len) {
+        map_offset_ = pos - pos % page_;
+        map_len_ = std::min(size_ - map_offset_, len + (pos - map_offset_));
+        void* p = ::mmap(nullptr, map_len_, PROT_READ, MAP_PRIVATE, fd_, static_cast<off_t>(map_offset_));
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        ::madvise(p, map_len_, MADV_SEQUENTIAL);
+        map_ = static_cast<const char*>(p);
+    }
+
+    void unmap() {
+        if (map_ != nullptr) {
+            ::munmap(const_cast<char*>(map_), map_len_);
+            map_ = nullptr;
+        }
+    }
+};
+
+#endif  // DEDUP_CORPUS_H_
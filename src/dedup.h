@@ -0,0 +1,1038 @@
+#ifndef DEDUP_DEDUP_H_
+#define DEDUP_DEDUP_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "./exact_filter.h"
+#include "./external_join.h"
+#include "./features.h"
+#include "./include/feature_hash.h"
+#include "./include/MurmurHash3.h"
+#include "./index_file.h"
+#include "./instrument.h"
+#include "./lsh.h"
+#include "./minhash_device.h"
+#include "./minhash_kernels.h"
+#include "./oph.h"
+#include "./pipeline.h"
+#include "./result_sink.h"
+#include "./signature_store.h"
+#include "./thread_pool.h"
+#include "./tokenizer.h"
+#include "./unicode.h"
+#include "./union_find.h"
+
+// Implemented based on https://github.com/apache/spark/blob/82e3f0d5d594f544ec4689cb833879c8a95ec849/mllib/src/main/scala/org/apache/spark/ml/feature/MinHashLSH.scala#L163
+class MinHasher {
+   public:
+    MinHasher(size_t num_hashes, uint32_t seed = 1) : num_hashes_(num_hashes), seed_(seed) {
+        std::mt19937 rng_(seed);
+        std::uniform_int_distribution<uint32_t> dist_a_(1, kHashPrime - 1);
+        std::uniform_int_distribution<uint32_t> dist_b_(0, kHashPrime - 1);
+
+        a_.resize(num_hashes_);
+        b_.resize(num_hashes_);
+        for (size_t i = 0; i < num_hashes_; ++i) {
+            a_[i] = dist_a_(rng_);
+            b_[i] = dist_b_(rng_);
+        }
+        pad();
+    }
+
+    size_t num_hashes() const { return num_hashes_; }
+    uint32_t seed() const { return seed_; }
+
+    // Write the MinHash signature of n distinct feature indices, each below
+    // kMaxFeatures, to sig[0, num_hashes())
+    void compute_signature(const uint32_t* features, size_t n, uint32_t* sig) const {
+        if (lanes_ == num_hashes_ || lanes_ > kStackLanes) {
+            kernel_.fn(a_.data(), b_.data(), num_hashes_, features, n, sig);
+            return;
+        }
+        // Whole kernel blocks into a buffer, the padding lanes dropped after
+        uint32_t row[kStackLanes];
+        kernel_.fn(a_.data(), b_.data(), lanes_, features, n, row);
+        std::memcpy(sig, row, num_hashes_ * sizeof(uint32_t));
+    }
+
+    // Signatures of a batch of feature sets in CSR form, set d being
+    // features[offsets[d], offsets[d + 1]), to the docs x num_hashes() matrix
+    // sigs, row d bit-identical to compute_signature() of set d.  This is
+    // the unit an offload backend takes, with coefficients() as its constants.
+    void compute_signatures(const uint64_t* offsets, const uint32_t* features, size_t docs, uint32_t* sigs) const {
+        for (size_t d = 0; d < docs; ++d) {
+            compute_signature(features + offsets[d], offsets[d + 1] - offsets[d], sigs + d * num_hashes_);
+        }
+    }
+
+    std::vector<uint32_t> compute_signature(const std::vector<uint32_t>& features) const {
+        std::vector<uint32_t> sig(num_hashes_);
+        compute_signature(features.data(), features.size(), sig.data());
+        return sig;
+    }
+
+    // Name of the signature kernel picked for this CPU
+    const char* kernel_name() const { return kernel_.name; }
+
+    void set_kernel(const minhash_kernels::Entry& kernel) {
+        kernel_ = kernel;
+        pad();
+    }
+
+    // h_i(x) = ((1 + x) * a[i] + b[i]) % minhash_kernels::kPrime for i < num_hashes()
+    std::pair<const uint32_t*, const uint32_t*> coefficients() const { return {a_.data(), b_.data()}; }
+
+    // Jaccard distance between two MinHash signatures
+    static double jaccard_distance(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+        const size_t match = match_kernels::best(32).fn(reinterpret_cast<const uint8_t*>(a.data()),
+                                                        reinterpret_cast<const uint8_t*>(b.data()), a.size(), 0);
+        return 1.0 - static_cast<double>(match) / a.size();
+    }
+
+    // Feature indices must stay below this so (1 + idx) needs no reduction
+    static constexpr size_t kMaxFeatures = minhash_kernels::kPrime - 1;
+
+   private:
+    static constexpr uint32_t kHashPrime = minhash_kernels::kPrime;
+    // Padded signatures up to this long are computed on the stack
+    static constexpr size_t kStackLanes = 256;
+
+    size_t num_hashes_;
+    uint32_t seed_;
+    std::vector<uint32_t> a_;  // lanes_ coefficients, past num_hashes_ padding
+    std::vector<uint32_t> b_;
+    minhash_kernels::Entry kernel_ = minhash_kernels::best(num_hashes_);
+    size_t lanes_ = num_hashes_;
+
+    // Extend the coefficients to whole blocks of the kernel with a valid
+    // (a, b) = (1, 0), so no lane falls to a scalar tail
+    void pad() {
+        lanes_ = minhash_kernels::padded(num_hashes_, kernel_);
+        a_.resize(num_hashes_);
+        b_.resize(num_hashes_);
+        a_.resize(lanes_, 1);
+        b_.resize(lanes_, 0);
+    }
+};
+
+// How a shingle of n consecutive tokens is turned into a feature index
+enum class ShingleHash {
+    kRolling,  // hash every token once and combine the last n hashes
+    kConcat,   // hash the joined shingle text; reproduces the original indices
+};
+
+// Which byte hash (src/include/feature_hash.h) turns tokens and shingles into
+// feature indices
+enum class FeatureHash {
+    kMurmur32,   // MurmurHash3_x86_32, the original
+    kMurmur128,  // low 64 bits of MurmurHash3_x64_128
+    kWyhash,     // wyhash, fastest on 64-bit CPUs
+};
+
+// How text is split into tokens
+enum class Tokenizer {
+    kBytes,      // runs of ASCII letters and digits; every other byte separates (the original)
+    kUtf8Words,  // Utf8TokenGen words; unspaced scripts give one token per character
+    kUtf8Chars,  // every UTF-8 letter or digit is a token, so shingles are character n-grams
+};
+
+// How a feature set is turned into a signature
+enum class SignatureEngine {
+    kMinHash,  // num_hashes independent hash functions (MinHasher), the reference
+    kOph,      // one hash per feature into num_hashes bins (OnePermutationHasher)
+};
+
+// Buffers reused by extract_features across documents.  Once they have grown
+// to fit the longest shingle seen, extracting a document touches the heap
+// only if the FeatureSet itself has to grow.
+struct ShingleScratch {
+    std::vector<uint64_t> hashes;          // ring of token hashes when n is not fixed at compile time
+    std::vector<std::string_view> tokens;  // ring of tokens for ShingleHash::kConcat
+    std::string combined;                  // joined shingle text for ShingleHash::kConcat
+    std::string token;                     // current token when Utf8TokenGen had to rewrite it
+};
+
+class Deduplicator {
+   public:
+    // bands * rows must not exceed num_hashes; candidate pairs are those that
+    // agree on every row of at least one band.  Signatures are computed on
+    // threads workers (0 for one per hardware thread).
+    Deduplicator(size_t ngrams, size_t num_hashes, double threshold, size_t num_features, size_t bands, size_t rows,
+                 size_t threads = 0)
+        : ngrams_(ngrams),
+          num_features_(num_features),
+          feature_mask_((num_features & (num_features - 1)) == 0 ? num_features - 1 : 0),
+          threshold_(threshold),
+          hasher_(num_hashes),
+          index_(bands, rows),
+          signatures_(num_hashes),
+          pool_(threads),
+          scratch_(pool_.size(), make_scratch()) {
+        if (ngrams == 0) {
+            throw std::invalid_argument("Deduplicator: ngrams must be positive");
+        }
+        if (num_features == 0 || num_features > MinHasher::kMaxFeatures) {
+            throw std::invalid_argument("Deduplicator: num_features out of range");
+        }
+        if (bands * rows > num_hashes) {
+            throw std::invalid_argument("Deduplicator: bands * rows exceeds num_hashes");
+        }
+    }
+
+    // Deduplicate an in-memory batch and print every duplicate pair with the
+    // text of both documents
+    void process(const std::vector<std::string_view>& docs) {
+        clear();
+        add(docs);
+        for (const auto& [i, j, similarity] : duplicates()) {
+            std::cout << "Duplicate pair (Jaccard: " << similarity << "):\n"
+                 << " - " << docs[i] << "\n - " << docs[j] << "\n\n";
+        }
+    }
+
+    // Signature and index a batch of documents.  Ids continue from the previous
+    // batch, and docs need not outlive the call.
+    void add(const std::vector<std::string_view>& docs) {
+        check_room(size(), docs.size());
+        const size_t first = signatures_.append(docs.size());
+        std::vector<DocId> sources(docs.size());
+        // Small chunks so that stealing can even out skewed document lengths
+        const size_t grain = device_ ? std::clamp<size_t>(docs.size() / pool_.size(), 1, kDeviceBatch)
+                                     : std::max<size_t>(1, docs.size() / (pool_.size() * 64));
+        pool_.parallel_for(docs.size(), grain, [&](size_t begin, size_t end, size_t worker) {
+            Scratch& scratch = scratch_[worker];
+            if (device_) {
+                const size_t n = end - begin;
+                for (size_t i = begin; i < end; ++i) {
+                    sources[i] = source(docs[i], static_cast<DocId>(first + i));
+                }
+                scratch.batch_sigs.resize(n * hasher_.num_hashes());
+                scratch.batch_cardinalities.resize(n);
+                sign_batch(docs.data() + begin, n, sources.data() + begin, static_cast<DocId>(first + begin), scratch,
+                           scratch.batch_sigs.data(), scratch.batch_cardinalities.data());
+                for (size_t d = 0; d < n; ++d) {
+                    if (sources[begin + d] == first + begin + d) {
+                        signatures_.set(first + begin + d, scratch.batch_sigs.data() + d * hasher_.num_hashes(),
+                                        scratch.batch_cardinalities[d]);
+                    }
+                }
+                return;
+            }
+            for (size_t i = begin; i < end; ++i) {
+                sources[i] = source(docs[i], static_cast<DocId>(first + i));
+                if (sources[i] == first + i) {
+                    const uint32_t cardinality = sign(docs[i], scratch, scratch.sig.data());
+                    signatures_.set(first + i, scratch.sig.data(), cardinality);
+                }
+            }
+        });
+        copy_exact_duplicates(first, sources);
+        if (memory_budget_ == 0) {
+            index_.insert(signatures_, first, signatures_.size());
+        }
+    }
+
+    // Pipelined add() over a stream: a reader thread pulls documents with
+    // next(docs), which returns false at the end and whose views need only
+    // stay valid until its following call, and copies them into batches of
+    // batch_docs.  One signing thread per pool worker turns batches into
+    // signatures, and the calling thread appends them to the store and index
+    // in input order.  Stages are connected by queues of depth batches, so the
+    // text held in memory is bounded by about (2 * depth + workers) batches
+    // however long the stream is; the signatures themselves still grow.  If
+    // next or a stage throws, the batches indexed so far are kept and the
+    // first exception is rethrown.
+    PipelineStats add_stream(const std::function<bool(std::vector<std::string_view>&)>& next,
+                             size_t batch_docs = 4096, size_t depth = 4) {
+        using clock = std::chrono::steady_clock;
+        const auto since = [](clock::time_point t) {
+            return std::chrono::duration<double>(clock::now() - t).count();
+        };
+        struct Batch {
+            size_t seq = 0;
+            size_t first = 0;  // id of the first document
+            std::string text;
+            std::vector<size_t> ends;  // document i is text[ends[i - 1], ends[i])
+            std::vector<DocId> sources;
+            std::vector<uint32_t> sigs;
+            std::vector<uint32_t> cardinalities;
+        };
+        batch_docs = std::max<size_t>(batch_docs, 1);
+        BoundedQueue<Batch> read_queue(depth), sign_queue(depth);
+        PipelineStats stats;
+        stats.signers = pool_.size();
+        const size_t base = signatures_.size();
+        const auto start = clock::now();
+
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        const auto fail = [&] {
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            read_queue.cancel();
+            sign_queue.cancel();
+        };
+
+        std::thread reader([&] {
+            try {
+                std::vector<std::string_view> docs;
+                size_t seq = 0, read = 0;
+                auto t = clock::now();
+                while (next(docs)) {
+                    for (size_t i = 0; i < docs.size(); i += batch_docs) {
+                        Batch batch;
+                        batch.seq = seq++;
+                        batch.first = base + read;
+                        const size_t end = std::min(docs.size(), i + batch_docs);
+                        check_room(batch.first, end - i);
+                        read += end - i;
+                        size_t bytes = 0;
+                        for (size_t d = i; d < end; ++d) {
+                            bytes += docs[d].size();
+                        }
+                        batch.text.reserve(bytes);
+                        for (size_t d = i; d < end; ++d) {
+                            batch.text += docs[d];
+                            batch.ends.emplace_back(batch.text.size());
+                        }
+                        stats.read_seconds += since(t);
+                        if (!read_queue.push(std::move(batch))) {
+                            return;
+                        }
+                        t = clock::now();
+                    }
+                }
+                stats.read_seconds += since(t);
+                read_queue.close();
+            } catch (...) {
+                fail();
+            }
+        });
+
+        // The last signer to finish closes the queue behind it
+        std::atomic<size_t> running{pool_.size()};
+        std::vector<double> sign_seconds(pool_.size());
+        std::vector<std::thread> signers;
+        for (size_t w = 0; w < pool_.size(); ++w) {
+            signers.emplace_back([&, w] {
+                try {
+                    pool_.place(w);
+                    Scratch& scratch = scratch_[w];
+                    const size_t k = hasher_.num_hashes();
+                    std::vector<std::string_view> docs;  // of the batch, for the device
+                    Batch batch;
+                    while (read_queue.pop(batch)) {
+                        const auto t = clock::now();
+                        if (device_) {
+                            docs.resize(batch.ends.size());
+                        }
+                        batch.sigs.resize(batch.ends.size() * k);
+                        batch.sources.resize(batch.ends.size());
+                        batch.cardinalities.resize(batch.ends.size());
+                        size_t begin = 0;
+                        for (size_t d = 0; d < batch.ends.size(); ++d) {
+                            const std::string_view doc(batch.text.data() + begin, batch.ends[d] - begin);
+                            const auto id = static_cast<DocId>(batch.first + d);
+                            batch.sources[d] = source(doc, id);
+                            if (device_) {
+                                docs[d] = doc;
+                            } else if (batch.sources[d] == id) {
+                                batch.cardinalities[d] = sign(doc, scratch, batch.sigs.data() + d * k);
+                            }
+                            begin = batch.ends[d];
+                        }
+                        if (device_) {
+                            sign_batch(docs.data(), docs.size(), batch.sources.data(),
+                                       static_cast<DocId>(batch.first), scratch, batch.sigs.data(),
+                                       batch.cardinalities.data());
+                        }
+                        batch.text = std::string();
+                        sign_seconds[w] += since(t);
+                        if (!sign_queue.push(std::move(batch))) {
+                            return;
+                        }
+                    }
+                } catch (...) {
+                    fail();
+                }
+                if (running.fetch_sub(1) == 1) {
+                    sign_queue.close();
+                }
+            });
+        }
+
+        // Signers finish out of order; batches wait here until their turn
+        try {
+            std::map<size_t, Batch> pending;
+            size_t expected = 0;
+            Batch batch;
+            while (sign_queue.pop(batch)) {
+                const auto t = clock::now();
+                pending.emplace(batch.seq, std::move(batch));
+                while (!pending.empty() && pending.begin()->first == expected) {
+                    const Batch& b = pending.begin()->second;
+                    const size_t n = b.ends.size();
+                    const size_t first = signatures_.append(n);
+                    for (size_t d = 0; d < n; ++d) {
+                        if (b.sources[d] == first + d) {
+                            signatures_.set(first + d, b.sigs.data() + d * hasher_.num_hashes(), b.cardinalities[d]);
+                        }
+                    }
+                    copy_exact_duplicates(first, b.sources);
+                    if (memory_budget_ == 0) {
+                        index_.insert(signatures_, first, signatures_.size());
+                    }
+                    stats.docs += n;
+                    ++stats.batches;
+                    pending.erase(pending.begin());
+                    ++expected;
+                }
+                stats.index_seconds += since(t);
+            }
+        } catch (...) {
+            fail();
+        }
+
+        reader.join();
+        for (auto& t : signers) {
+            t.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        for (const double t : sign_seconds) {
+            stats.sign_seconds += t;
+        }
+        stats.seconds = since(start);
+        stats.read_queue = read_queue.stats();
+        stats.sign_queue = sign_queue.stats();
+        return stats;
+    }
+
+    // Verified candidate pairs (i < j, j >= since) and their estimated Jaccard
+    // similarity, sorted
+    std::vector<std::tuple<DocId, DocId, double>> duplicates(DocId since = 0) {
+        std::vector<std::tuple<DocId, DocId, double>> result;
+        const auto keep = [&](DocId i, DocId j, size_t matches) {
+            result.emplace_back(i, j, signatures_.estimate(matches));
+        };
+        if (memory_budget_ != 0) {
+            join_stats_ = external::candidates(signatures_, index_, since, memory_budget_, spill_dir_, pool_,
+                                               [&](const std::vector<std::pair<DocId, DocId>>& pairs) {
+                                                   verify(pairs, 0, pairs.size(), keep);
+                                               });
+            // A pair chained in one bucket may come again from another band
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end(),
+                                     [](const auto& a, const auto& b) {
+                                         return std::get<0>(a) == std::get<0>(b) && std::get<1>(a) == std::get<1>(b);
+                                     }),
+                         result.end());
+            return result;
+        }
+        const auto pairs = index_.candidates(since);
+        verify(pairs, 0, pairs.size(), keep);
+        return result;
+    }
+
+    // The same pairs added to sink as they are verified, from the worker that
+    // verified them and in no particular order; sink needs a buffer for each of
+    // threads().  Under a memory budget with a bucket limit, a pair chained in
+    // one bucket may be added again from another band.
+    void duplicates(ResultSink& sink, DocId since = 0) {
+        const auto write = [&](const std::vector<std::pair<DocId, DocId>>& pairs) {
+            pool_.parallel_for(pairs.size(), 4096, [&](size_t begin, size_t end, size_t worker) {
+                ResultSink::Buffer& out = sink.buffer(worker);
+                verify(pairs, begin, end,
+                       [&](DocId i, DocId j, size_t matches) { out.add(i, j, signatures_.estimate(matches)); });
+            });
+        };
+        if (memory_budget_ != 0) {
+            join_stats_ = external::candidates(signatures_, index_, since, memory_budget_, spill_dir_, pool_, write);
+        } else {
+            write(index_.candidates(since));
+        }
+    }
+
+    // Called by clusters() after each batch of candidate pairs with the number
+    // of pairs merged so far and the sets they formed.  Candidates come in an
+    // order fixed by the documents and settings, not by the threads, so a
+    // later clusters() resumed from the labels of those sets after that many
+    // pairs ends where this one would have.
+    using ClusterHook = std::function<void(uint64_t merged, ConcurrentUnionFind& sets)>;
+
+    // Candidate pairs per clusters() batch
+    static constexpr size_t kClusterBatch = size_t{1} << 20;
+
+    // Cluster id of every document: connected components of the duplicate
+    // graph, each labelled by its smallest document id.  Candidates are
+    // verified in parallel and merged into a lock-free union-find.
+    std::vector<DocId> clusters(DocId since = 0) { return clusters(since, {}, 0, {}); }
+
+    // The same, resumed from the labels an earlier run had after merging its
+    // first skip candidate pairs (empty labels and 0 to start afresh), and
+    // calling hook, if set, after every batch
+    std::vector<DocId> clusters(DocId since, const std::vector<DocId>& start, uint64_t skip,
+                                const ClusterHook& hook) {
+        ConcurrentUnionFind sets(signatures_.size());
+        for (size_t i = 0; i < start.size(); ++i) {
+            sets.unite(static_cast<DocId>(i), start[i]);
+        }
+        uint64_t merged = 0;
+        const auto unite = [&](const std::vector<std::pair<DocId, DocId>>& pairs) {
+            for (size_t first = 0; first < pairs.size(); first += kClusterBatch) {
+                const size_t last = std::min(pairs.size(), first + kClusterBatch);
+                const size_t begin = skip > merged ? first + std::min<uint64_t>(skip - merged, last - first) : first;
+                merged += last - first;
+                if (begin == last) {
+                    continue;
+                }
+                pool_.parallel_for(last - begin, 4096, [&](size_t lo, size_t hi, size_t) {
+                    verify(pairs, begin + lo, begin + hi, [&](DocId i, DocId j, size_t) { sets.unite(i, j); });
+                });
+                if (hook) {
+                    hook(merged, sets);
+                }
+            }
+        };
+        if (memory_budget_ != 0) {
+            join_stats_ = external::candidates(signatures_, index_, since, memory_budget_, spill_dir_, pool_, unite);
+        } else {
+            unite(index_.candidates(since));
+        }
+        std::vector<DocId> labels(signatures_.size());
+        for (size_t i = 0; i < labels.size(); ++i) {
+            labels[i] = sets.find(static_cast<DocId>(i));
+        }
+        return labels;
+    }
+
+    void clear() {
+        signatures_.clear();
+        index_.clear();
+        mapped_.reset();
+        exact_.clear();
+        exact_duplicates_ = 0;
+    }
+
+    // Everything a saved index must agree on to be extended by this instance
+    IndexParams params() const {
+        IndexParams p;
+        p.ngrams = static_cast<uint32_t>(ngrams_);
+        p.num_hashes = static_cast<uint32_t>(hasher_.num_hashes());
+        p.num_features = num_features_;
+        p.seed = hasher_.seed();
+        p.bits = signatures_.bits();
+        p.shingle_hash = static_cast<uint32_t>(shingle_hash_);
+        p.tokenizer = static_cast<uint32_t>(tokenizer_) | uint32_t{utf8_.fold_case} << 8 | uint32_t{utf8_.normalize} << 9;
+        p.engine = static_cast<uint32_t>(engine_);
+        p.feature_hash = static_cast<uint32_t>(feature_hash_);
+        p.bands = static_cast<uint32_t>(index_.bands());
+        p.rows = static_cast<uint32_t>(index_.rows());
+        return p;
+    }
+
+    // Write signatures and buckets of every document added so far.  Not
+    // available with a memory budget, which keeps no buckets.
+    void save(const std::string& path) const {
+        if (memory_budget_ != 0) {
+            throw std::logic_error("Deduplicator: cannot save an index built under a memory budget");
+        }
+        write_index(path, params(), signatures_, index_);
+    }
+
+    // Replace the contents with a saved index, mapped in place.  Documents
+    // added afterwards get ids from size() on and are matched against it.
+    void load(const std::string& path) {
+        auto mapped = std::make_shared<MappedIndex>(path);
+        if (mapped->params() != params()) {
+            throw std::runtime_error(path + ": index was built with different parameters");
+        }
+        clear();
+        mapped_ = std::move(mapped);
+        signatures_.attach(mapped_->signatures(), mapped_->cardinalities(), mapped_->num_docs());
+        index_.attach(mapped_->bands());
+    }
+
+    // Append the documents of an index file written by save() or
+    // write_signatures(), with ids from size() on, and bucket them anew.
+    // Unlike load() the rows are copied, so several files can be appended.
+    void add_signatures(const MappedIndex& part) {
+        if (part.params() != params()) {
+            throw std::runtime_error("index was built with different parameters");
+        }
+        const size_t first = signatures_.append(part.num_docs());
+        for (size_t d = 0; d < part.num_docs(); ++d) {
+            signatures_.set_row(first + d, part.signatures() + d * signatures_.row_bytes(), part.cardinalities()[d]);
+        }
+        if (memory_budget_ == 0) {
+            index_.insert(signatures_, first, signatures_.size());
+        }
+    }
+
+    size_t size() const { return signatures_.size(); }
+
+    // Ids are DocIds, and UINT32_MAX is reserved as empty, so a run holds at
+    // most this many documents; add() and add_stream() throw
+    // std::length_error before going past it
+    static constexpr size_t kMaxDocs = UINT32_MAX;
+
+    // Jaccard distance below which a candidate pair is a duplicate
+    double threshold() const { return threshold_; }
+
+    // Workers signatures are computed on
+    size_t threads() const { return pool_.size(); }
+
+    // The same workers, for steps outside this class such as shard::join()
+    WorkStealingPool& pool() { return pool_; }
+
+    // Pin the workers to the CPUs of topology's nodes in contiguous blocks
+    // (see WorkStealingPool::set_placement).  The signature rows and bucket
+    // tables are read by every worker at random, so their pages are best
+    // interleaved over the same nodes with numa::interleave() before this
+    // instance is constructed.
+    void set_numa_placement(const numa::Topology& topology) { pool_.set_placement(topology); }
+
+    // Workers on each node they were placed on, one entry if not placed
+    std::vector<size_t> workers_per_node() const {
+        std::vector<size_t> counts(pool_.nodes());
+        for (size_t w = 0; w < pool_.size(); ++w) {
+            ++counts[pool_.node(w)];
+        }
+        return counts;
+    }
+
+    // Changes feature indices, so set it before adding documents
+    void set_shingle_hash(ShingleHash mode) {
+        if (mode == ShingleHash::kConcat && tokenizer_ != Tokenizer::kBytes) {
+            throw std::logic_error("Deduplicator: concat shingles need the byte tokenizer");
+        }
+        shingle_hash_ = mode;
+    }
+
+    // Changes feature indices, so set it before adding documents.  fold_case
+    // and normalize apply to the UTF-8 tokenizers only.  The concat shingle
+    // hash keeps views of earlier tokens and so only works with kBytes.
+    void set_tokenizer(Tokenizer tokenizer, bool fold_case = false, bool normalize = false) {
+        if (signatures_.size() != 0) {
+            throw std::logic_error("Deduplicator: tokenizer changed after documents were added");
+        }
+        if (tokenizer != Tokenizer::kBytes && shingle_hash_ == ShingleHash::kConcat) {
+            throw std::logic_error("Deduplicator: concat shingles need the byte tokenizer");
+        }
+        if (tokenizer == Tokenizer::kBytes && (fold_case || normalize)) {
+            throw std::invalid_argument("Deduplicator: case folding and normalization need a UTF-8 tokenizer");
+        }
+        tokenizer_ = tokenizer;
+        utf8_.chars = tokenizer == Tokenizer::kUtf8Chars;
+        utf8_.fold_case = fold_case;
+        utf8_.normalize = normalize;
+    }
+
+    Tokenizer tokenizer() const { return tokenizer_; }
+
+    // Changes feature indices, so set it before adding documents
+    void set_feature_hash(FeatureHash hash) {
+        if (signatures_.size() != 0) {
+            throw std::logic_error("Deduplicator: feature hash changed after documents were added");
+        }
+        feature_hash_ = hash;
+    }
+
+    FeatureHash feature_hash() const { return feature_hash_; }
+    const Utf8Options& utf8_options() const { return utf8_; }
+
+    // Keep only the low 8 or 16 bits of each signature value (b-bit MinHash).
+    // Must be called before adding documents.
+    void set_signature_bits(unsigned bits) {
+        if (signatures_.size() != 0) {
+            throw std::logic_error("Deduplicator: signature width changed after documents were added");
+        }
+        signatures_ = SignatureStore(hasher_.num_hashes(), bits);
+    }
+
+    // Must be called before adding documents
+    void set_signature_engine(SignatureEngine engine) {
+        if (signatures_.size() != 0) {
+            throw std::logic_error("Deduplicator: signature engine changed after documents were added");
+        }
+        if (device_ && engine != SignatureEngine::kMinHash) {
+            throw std::logic_error("Deduplicator: a signing device computes MinHash signatures only");
+        }
+        engine_ = engine;
+    }
+
+    SignatureEngine signature_engine() const { return engine_; }
+
+    // Sign MinHash signatures on the device backend name (see
+    // minhash_device::make_backend) instead of the CPU kernels: the workers
+    // extract the feature sets of up to kDeviceBatch documents into a CSR
+    // batch and hand it to the device whole.  Signatures are the same.  Must
+    // be called before adding documents.
+    void set_device(const std::string& name) {
+        if (signatures_.size() != 0) {
+            throw std::logic_error("Deduplicator: signing device changed after documents were added");
+        }
+        if (engine_ != SignatureEngine::kMinHash) {
+            throw std::logic_error("Deduplicator: a signing device computes MinHash signatures only");
+        }
+        const auto [a, b] = hasher_.coefficients();
+        device_ = std::make_unique<minhash_device::Signer>(
+            minhash_device::make_backend(name, a, b, hasher_.num_hashes()), hasher_.num_hashes());
+    }
+
+    // Name of the signing device's backend, nullptr for the CPU kernels
+    const char* device() const { return device_ ? device_->name() : nullptr; }
+
+    // Documents per CSR batch add() hands the device
+    static constexpr size_t kDeviceBatch = 4096;
+
+    // Chain LSH buckets with more than limit members instead of pairing them
+    // all (0 for no limit); see LSHIndex::set_max_bucket
+    void set_max_bucket(size_t limit) { index_.set_max_bucket(limit); }
+
+    // Generate candidates with an external-memory sort of the band entries
+    // (see external_join.h) in about bytes of buffers besides the signatures,
+    // spilling sorted runs to spill_dir, instead of keeping bucket tables in
+    // memory (0, the default).  Must be called before adding documents.
+    void set_memory_budget(size_t bytes, std::string spill_dir = {}) {
+        if (signatures_.size() != 0) {
+            throw std::logic_error("Deduplicator: memory budget changed after documents were added");
+        }
+        memory_budget_ = bytes;
+        spill_dir_ = std::move(spill_dir);
+    }
+
+    size_t memory_budget() const { return memory_budget_; }
+
+    // What the last duplicates() or clusters() call under a memory budget did
+    const external::JoinStats& join_stats() const { return join_stats_; }
+
+    // Buckets the last duplicates() or clusters() call chained
+    const LSHIndex::OversizedBuckets& oversized() const {
+        return memory_budget_ != 0 ? join_stats_.oversized : index_.oversized();
+    }
+
+    // Skip candidate pairs whose feature-set sizes differ too much for the
+    // threshold, |A| / |B| < 1 - threshold for |A| <= |B|, without comparing
+    // signatures (on by default).  Only pairs whose estimate would pass by
+    // sampling error alone are lost.
+    void set_cardinality_pruning(bool on) { cardinality_pruning_ = on; }
+    bool cardinality_pruning() const { return cardinality_pruning_; }
+
+    // Byte-identical documents are detected by a hash of their text and get a
+    // copy of the first one's signature instead of being signed again (on by
+    // default).  Only documents added since the last clear() or load() are
+    // remembered.
+    void set_exact_prefilter(bool on) { exact_prefilter_ = on; }
+
+    // Documents whose signature was copied from an exact duplicate
+    size_t exact_duplicates() const { return exact_duplicates_; }
+
+    const SignatureStore& signatures() const { return signatures_; }
+
+    const LSHIndex& index() const { return index_; }
+    const MinHasher& hasher() const { return hasher_; }
+
+    // Buffers for signing documents one at a time; each thread needs its own
+    struct Scratch {
+        FeatureSet features;
+        std::vector<uint32_t> sig;
+        OnePermutationHasher oph;
+        ShingleScratch shingles;
+        // A CSR batch for the device and its signatures
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> flat;
+        std::vector<uint32_t> batch_sigs;
+        std::vector<uint32_t> batch_cardinalities;
+    };
+
+    Scratch make_scratch() const {
+        return Scratch{FeatureSet(num_features_), std::vector<uint32_t>(hasher_.num_hashes()),
+                       OnePermutationHasher(hasher_.num_hashes(), hasher_.seed()), ShingleScratch{}, {}, {}, {}, {}};
+    }
+
+    // Signature of one document into sig[0, num_hashes); returns the size of
+    // its feature set
+    uint32_t sign(const std::string_view doc, Scratch& scratch, uint32_t* sig) const {
+        {
+            DEDUP_TIME(instrument::kExtract);
+            extract_features(doc, scratch.features, scratch.shingles);
+        }
+        DEDUP_COUNT(instrument::kDocs, 1);
+        DEDUP_COUNT(instrument::kShingles, scratch.features.size());
+        DEDUP_TIME(instrument::kSignature);
+        if (engine_ == SignatureEngine::kOph) {
+            scratch.oph.compute_signature(scratch.features.data(), scratch.features.size(), sig);
+        } else {
+            hasher_.compute_signature(scratch.features.data(), scratch.features.size(), sig);
+        }
+        return static_cast<uint32_t>(scratch.features.size());
+    }
+
+    // As sign() for the n documents docs[d] with ids first + d, to rows d of
+    // sigs and cardinalities[d], as one CSR batch on the device.  Documents
+    // that are not their own source (sources[d]) get empty sets, whose rows
+    // are left for the caller to skip.
+    void sign_batch(const std::string_view* docs, size_t n, const DocId* sources, DocId first, Scratch& scratch,
+                    uint32_t* sigs, uint32_t* cardinalities) const {
+        scratch.offsets.assign(1, 0);
+        scratch.flat.clear();
+        for (size_t d = 0; d < n; ++d) {
+            cardinalities[d] = 0;
+            if (sources[d] == first + d) {
+                DEDUP_TIME(instrument::kExtract);
+                extract_features(docs[d], scratch.features, scratch.shingles);
+                DEDUP_COUNT(instrument::kDocs, 1);
+                DEDUP_COUNT(instrument::kShingles, scratch.features.size());
+                scratch.flat.insert(scratch.flat.end(), scratch.features.data(),
+                                    scratch.features.data() + scratch.features.size());
+                cardinalities[d] = static_cast<uint32_t>(scratch.features.size());
+            }
+            scratch.offsets.emplace_back(scratch.flat.size());
+        }
+        DEDUP_TIME(instrument::kSignature);
+        device_->compute_signatures(scratch.offsets.data(), scratch.flat.data(), n, sigs);
+    }
+
+    // Bytes that separate tokens
+    const CharClass& delimiters() const { return delimiters_; }
+
+    // Replace features with the distinct shingle indices of text, using
+    // scratch for intermediate buffers
+    void extract_features(const std::string_view text, FeatureSet& features, ShingleScratch& scratch) const {
+        features.clear();
+        switch (feature_hash_) {
+            case FeatureHash::kMurmur32: extract<feature_hash::Murmur3x86_32>(text, features, scratch); break;
+            case FeatureHash::kMurmur128: extract<feature_hash::Murmur3x64_128>(text, features, scratch); break;
+            case FeatureHash::kWyhash: extract<feature_hash::Wyhash>(text, features, scratch); break;
+        }
+        features.finish();
+    }
+
+    void extract_features(const std::string_view text, FeatureSet& features) const {
+        ShingleScratch scratch;
+        extract_features(text, features, scratch);
+    }
+
+   private:
+    static void check_room(size_t docs, size_t more) {
+        if (more > kMaxDocs - docs) {
+            throw std::length_error("Deduplicator: more than 2^32 - 1 documents");
+        }
+    }
+
+    size_t ngrams_;
+    size_t num_features_;
+    uint64_t feature_mask_;  // num_features_ - 1 if that is a power of two, else 0
+    double threshold_;
+    CharClass delimiters_ = CharClass::non_alnum();
+    MinHasher hasher_;
+    LSHIndex index_;
+    SignatureStore signatures_;
+    std::shared_ptr<const MappedIndex> mapped_;  // backs the first rows and frozen buckets after load()
+    WorkStealingPool pool_;
+
+    std::vector<Scratch> scratch_;  // one per pool worker
+    ShingleHash shingle_hash_ = ShingleHash::kRolling;
+    Tokenizer tokenizer_ = Tokenizer::kBytes;
+    Utf8Options utf8_;
+    FeatureHash feature_hash_ = FeatureHash::kMurmur32;
+    SignatureEngine engine_ = SignatureEngine::kMinHash;
+    std::unique_ptr<minhash_device::Signer> device_;  // shared by the workers, if set
+    ExactDuplicateFilter exact_;
+    bool exact_prefilter_ = true;
+    bool cardinality_pruning_ = true;
+    size_t exact_duplicates_ = 0;
+    size_t memory_budget_ = 0;
+    std::string spill_dir_;
+    external::JoinStats join_stats_;
+
+    // Features of text with Hash as the byte hash
+    template <typename Hash>
+    void extract(const std::string_view text, FeatureSet& features, ShingleScratch& scratch) const {
+        if (shingle_hash_ == ShingleHash::kConcat) {
+            extract_concat<Hash>(text, features, scratch);
+            return;
+        }
+        switch (ngrams_) {
+            case 2: extract_rolling<2, Hash>(text, features, scratch); break;
+            case 3: extract_rolling<3, Hash>(text, features, scratch); break;
+            case 4: extract_rolling<4, Hash>(text, features, scratch); break;
+            case 5: extract_rolling<5, Hash>(text, features, scratch); break;
+            default: extract_rolling<0, Hash>(text, features, scratch); break;
+        }
+    }
+
+    // Each token is hashed once into a ring of the last n token hashes, and
+    // the shingle hash H = t_1 B^(n-1) + ... + t_n (mod 2^64) is updated in
+    // O(1) as the window slides.  N > 0 fixes n = N at compile time, so the
+    // ring is a std::array and the weights fold to constants; N = 0 reads
+    // ngrams_ and keeps the ring in scratch.
+    template <size_t N, typename Hash>
+    void extract_rolling(const std::string_view text, FeatureSet& features, ShingleScratch& scratch) const {
+        if (tokenizer_ == Tokenizer::kBytes) {
+            TokenGen tokens(text, delimiters_);
+            shingle_rolling<N, Hash>(tokens, features, scratch);
+        } else {
+            Utf8TokenGen tokens(text, delimiters_, utf8_, scratch.token);
+            shingle_rolling<N, Hash>(tokens, features, scratch);
+        }
+    }
+
+    template <size_t N, typename Hash, typename Tokens>
+    void shingle_rolling(Tokens& splitter, FeatureSet& features, ShingleScratch& scratch) const {
+        constexpr uint64_t kBase = 0x9E3779B97F4A7C15ULL;
+        const size_t n = N != 0 ? N : ngrams_;
+        uint64_t top = 1;  // kBase^(n - 1), the weight of the oldest token
+        for (size_t i = 1; i < n; ++i) {
+            top *= kBase;
+        }
+
+        std::array<uint64_t, N> fixed{};
+        uint64_t* ring = fixed.data();
+        if constexpr (N == 0) {
+            scratch.hashes.assign(n, 0);
+            ring = scratch.hashes.data();
+        }
+        size_t pos = 0, filled = 0;
+        uint64_t h = 0;
+        while (splitter) {
+            const auto token = splitter();
+            const uint64_t t = Hash::hash(token.data(), token.size());
+
+            if (filled == n) {
+                h -= ring[pos] * top;
+            } else {
+                ++filled;
+            }
+            h = h * kBase + t;
+            ring[pos] = t;
+            pos = pos + 1 == n ? 0 : pos + 1;
+
+            if (filled == n) {
+                features.insert(feature_index(mix64(h)));
+            }
+        }
+    }
+
+    // Original scheme: the hash of the tokens joined as "a_b_c_", which with
+    // MurmurHash3_x86_32 gives the original indices
+    template <typename Hash>
+    void extract_concat(const std::string_view text, FeatureSet& features, ShingleScratch& scratch) const {
+        auto& ring = scratch.tokens;
+        ring.assign(ngrams_, {});
+        size_t pos = 0, filled = 0;
+        std::string& combined = scratch.combined;
+        TokenGen splitter(text, delimiters_);
+        while (splitter) {
+            ring[pos] = splitter();
+            pos = pos + 1 == ngrams_ ? 0 : pos + 1;
+            filled = std::min(filled + 1, ngrams_);
+
+            if (filled == ngrams_) {
+                combined.clear();
+                for (size_t i = 0; i < ngrams_; ++i) {
+                    combined += ring[(pos + i) % ngrams_];
+                    combined += "_";
+                }
+
+                features.insert(feature_index(Hash::hash(combined.data(), combined.size())));
+            }
+        }
+    }
+
+    // Call f(i, j, matches) for every pair in pairs[begin, end) whose
+    // estimated distance is below threshold_.  Candidates come sorted by i, so
+    // each run of pairs sharing i is checked one-vs-many, and hopeless pairs
+    // are abandoned as soon as they cannot reach the threshold.  Pairs whose
+    // feature-set sizes alone rule the threshold out are dropped before any
+    // signature is read.
+    template <typename F>
+    void verify(const std::vector<std::pair<DocId, DocId>>& pairs, size_t begin, size_t end, F&& f) const {
+        DEDUP_TIME(instrument::kVerify);
+        const size_t need = signatures_.min_matches(threshold_);
+        const double similarity = cardinality_pruning_ ? 1.0 - threshold_ : 0.0;
+        std::vector<DocId> js;
+        std::vector<size_t> counts;
+        while (begin < end) {
+            const DocId i = pairs[begin].first;
+            js.clear();
+            for (; begin < end && pairs[begin].first == i; ++begin) {
+                const DocId j = pairs[begin].second;
+                if (signatures_.may_reach(i, j, similarity)) {
+                    js.emplace_back(j);
+                } else {
+                    DEDUP_COUNT(instrument::kCardinalityPruned, 1);
+                }
+            }
+            counts.resize(js.size());
+            signatures_.matches(i, js.data(), js.size(), need, counts.data());
+            for (size_t t = 0; t < js.size(); ++t) {
+                if (counts[t] >= need) {
+                    f(i, js[t], counts[t]);
+                }
+            }
+        }
+    }
+
+    // The document whose signature id should share: id itself, or the first
+    // earlier document with the same text
+    DocId source(const std::string_view doc, DocId id) {
+        if (!exact_prefilter_) {
+            return id;
+        }
+        DEDUP_TIME(instrument::kPrefilter);
+        return exact_.claim(ExactDuplicateFilter::hash(doc), id);
+    }
+
+    // Fill the rows of documents [first, first + sources.size()) that source()
+    // mapped to another document.  Sources are smaller ids, so their rows are
+    // complete by now.
+    void copy_exact_duplicates(size_t first, const std::vector<DocId>& sources) {
+        for (size_t i = 0; i < sources.size(); ++i) {
+            if (sources[i] != first + i) {
+                signatures_.copy(first + i, sources[i]);
+                ++exact_duplicates_;
+            }
+        }
+    }
+
+    // h reduced to a feature index, by a mask when num_features_ is a power of
+    // two; the same index % would give, without the division
+    uint32_t feature_index(uint64_t h) const {
+        return static_cast<uint32_t>(feature_mask_ != 0 ? h & feature_mask_ : h % num_features_);
+    }
+
+    // splitmix64 finalizer, so that the low bits used by % depend on every token
+    static uint64_t mix64(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+};
+
+#endif  // DEDUP_DEDUP_H_
@@ -0,0 +1,110 @@
+#ifndef DEDUP_EXACT_FILTER_H_
+#define DEDUP_EXACT_FILTER_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "./include/MurmurHash3.h"
+
+// Groups byte-identical documents by a 128-bit MurmurHash3 of their text, so
+// that only one document per group needs to be shingled and signed.  Two
+// different texts would have to collide in all 128 bits to be merged, which
+// the prefilter accepts.
+//
+// claim() may be called from any number of threads.  The representative of a
+// group is always its smallest id, whatever the order of the claims.
+class ExactDuplicateFilter {
+   public:
+    struct Hash {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+
+        bool operator==(const Hash& o) const { return lo == o.lo && hi == o.hi; }
+    };
+
+    ExactDuplicateFilter() : shards_(new Shard[kShards]) {}
+
+    static Hash hash(const std::string_view text) {
+        uint64_t out[2];
+        MurmurHash3_x64_128(text.data(), static_cast<int>(text.size()), 0, out);
+        return {out[0], out[1]};
+    }
+
+    // Record that document id has content hash h and return the smallest id
+    // recorded for h so far (id itself if it is the smallest).  When the
+    // result is another id, that document's own claim returned itself.
+    uint32_t claim(const Hash& h, uint32_t id) {
+        Shard& shard = shards_[h.hi % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (2 * (shard.size + 1) > shard.slots.size()) {
+            grow(shard);
+        }
+        Slot& slot = find(shard, h);
+        if (slot.id == kEmpty) {
+            slot = {h, id};
+            ++shard.size;
+        } else if (id < slot.id) {
+            slot.id = id;
+        }
+        return slot.id;
+    }
+
+    void clear() {
+        for (size_t s = 0; s < kShards; ++s) {
+            std::lock_guard<std::mutex> lock(shards_[s].mutex);
+            for (Slot& slot : shards_[s].slots) {
+                slot.id = kEmpty;
+            }
+            shards_[s].size = 0;
+        }
+    }
+
+   private:
+    static constexpr size_t kShards = 64;
+    static constexpr size_t kInitialSlots = 1024;
+    static constexpr uint32_t kEmpty = UINT32_MAX;
+
+    struct Slot {
+        Hash hash;
+        uint32_t id = kEmpty;  // smallest id with this content hash
+    };
+
+    // Open addressing with linear probing, kept at most half full.  Slots are
+    // plain values, so a claim copies into a slot instead of allocating a
+    // node the way a std::unordered_map would.
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Slot> slots;  // power-of-two size
+        size_t size = 0;
+    };
+
+    // The slot holding h, or the empty slot where it belongs
+    static Slot& find(Shard& shard, const Hash& h) {
+        const size_t mask = shard.slots.size() - 1;
+        for (size_t i = static_cast<size_t>(h.lo) & mask;; i = (i + 1) & mask) {
+            Slot& slot = shard.slots[i];
+            if (slot.id == kEmpty || slot.hash == h) {
+                return slot;
+            }
+        }
+    }
+
+    static void grow(Shard& shard) {
+        std::vector<Slot> old(std::max(kInitialSlots, 2 * shard.slots.size()));
+        old.swap(shard.slots);
+        for (const Slot& slot : old) {
+            if (slot.id != kEmpty) {
+                find(shard, slot.hash) = slot;
+            }
+        }
+    }
+
+    std::unique_ptr<Shard[]> shards_;
+};
+
+#endif  // DEDUP_EXACT_FILTER_H_
@@ -0,0 +1,329 @@
+#ifndef DEDUP_EXTERNAL_JOIN_H_
+#define DEDUP_EXTERNAL_JOIN_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "./instrument.h"
+#include "./lsh.h"
+#include "./signature_store.h"
+#include "./thread_pool.h"
+
+// Candidate generation for corpora whose band tables do not fit in memory.
+// Each band's (hash, doc) entries are computed from the signature store in
+// chunks that fit the budget, sorted in parallel, and spilled as sorted runs
+// to an unlinked temporary file.  The runs, together with the band's table
+// of a mapped index if there is one, are then k-way merged, and every group
+// of equal hashes is a bucket.  Besides the signatures only about the budget
+// is held in memory: half for the chunk being sorted, a quarter for the merge
+// read buffers and a quarter for the candidate batch.
+//
+// A pair that collides in several bands is passed on for the first of them
+// only: the merge compares the rows of a pair's earlier bands and drops the
+// pair if one of them is equal, since the pair was paired there already.
+// Buckets chained for exceeding the bucket limit do not pair all members, so
+// an earlier band whose bucket was chained does not count.  The stream thus
+// holds the pairs of LSHIndex::candidates(), each once, save a pair that
+// collided in an earlier band by 64-bit hash alone or was chained there.
+namespace external {
+
+struct Entry {
+    uint64_t hash;
+    DocId doc;
+
+    bool operator<(const Entry& o) const { return hash != o.hash ? hash < o.hash : doc < o.doc; }
+};
+
+struct JoinStats {
+    uint64_t entries = 0;        // (hash, doc) entries over all bands
+    size_t runs = 0;             // sorted runs merged, spilled or not
+    uint64_t spilled_bytes = 0;  // written to temporary files
+    uint64_t candidates = 0;     // pairs passed on
+    LSHIndex::OversizedBuckets oversized;
+};
+
+// An unlinked temporary file of entries, deleted by the system once closed
+class SpillFile {
+   public:
+    // In dir, or in $TMPDIR (/tmp if unset) when dir is empty
+    explicit SpillFile(const std::string& dir) {
+        std::string path = dir;
+        if (path.empty()) {
+            const char* tmp = std::getenv("TMPDIR");
+            path = tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+        }
+        path += "/dedup-spill-XXXXXX";
+        fd_ = ::mkstemp(path.data());
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "create " + path);
+        }
+        ::unlink(path.c_str());
+    }
+
+    ~SpillFile() { ::close(fd_); }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    // Entries written so far
+    uint64_t size() const { return size_; }
+
+    void append(const Entry* entries, size_t n) {
+        const char* p = reinterpret_cast<const char*>(entries);
+        size_t left = n * sizeof(Entry);
+        while (left != 0) {
+            const ssize_t w = ::write(fd_, p, left);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                throw std::system_error(errno, std::generic_category(), "write spill file");
+            }
+            p += w;
+            left -= static_cast<size_t>(w);
+        }
+        size_ += n;
+    }
+
+    // Entries [first, first + n)
+    void read(uint64_t first, Entry* entries, size_t n) const {
+        char* p = reinterpret_cast<char*>(entries);
+        size_t left = n * sizeof(Entry);
+        auto offset = static_cast<off_t>(first * sizeof(Entry));
+        while (left != 0) {
+            const ssize_t r = ::pread(fd_, p, left, offset);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                throw std::system_error(r == 0 ? EIO : errno, std::generic_category(), "read spill file");
+            }
+            p += r;
+            offset += r;
+            left -= static_cast<size_t>(r);
+        }
+    }
+
+   private:
+    int fd_ = -1;
+    uint64_t size_ = 0;
+};
+
+// One sorted source of the merge: a run in memory, a run in a spill file
+// read a buffer at a time, or a frozen band table
+class Cursor {
+   public:
+    Cursor(const Entry* entries, size_t n) : count_(n), entries_(entries) {}
+
+    Cursor(const SpillFile& file, uint64_t first, uint64_t n, size_t buffer)
+        : count_(n), file_(&file), first_(first), buffer_(static_cast<size_t>(std::min<uint64_t>(buffer, n))) {
+        fill();
+    }
+
+    explicit Cursor(const LSHIndex::FrozenBand& frozen) : count_(frozen.size), frozen_(frozen) {}
+
+    bool done() const { return at_ == count_; }
+
+    Entry head() const {
+        if (frozen_.hashes != nullptr) {
+            return {frozen_.hashes[at_], frozen_.docs[at_]};
+        }
+        return entries_[at_ - window_];
+    }
+
+    void advance() {
+        ++at_;
+        if (file_ != nullptr && at_ - window_ == buffer_.size() && !done()) {
+            window_ = at_;
+            fill();
+        }
+    }
+
+   private:
+    uint64_t count_;
+    uint64_t at_ = 0;
+    const Entry* entries_ = nullptr;
+    uint64_t window_ = 0;  // index of entries_[0] in the run
+    const SpillFile* file_ = nullptr;
+    uint64_t first_ = 0;  // offset of the run in file_
+    std::vector<Entry> buffer_;
+    LSHIndex::FrozenBand frozen_;
+
+    void fill() {
+        buffer_.resize(static_cast<size_t>(std::min<uint64_t>(buffer_.capacity(), count_ - at_)));
+        file_->read(first_ + at_, buffer_.data(), buffer_.size());
+        entries_ = buffer_.data();
+    }
+};
+
+// Smallest chunk, merge buffer and batch, however small the budget
+constexpr size_t kMinChunk = size_t{1} << 16;
+constexpr size_t kMinBuffer = size_t{1} << 12;
+constexpr size_t kMinBatch = size_t{1} << 12;
+
+// Call emit(pairs) with every LSH candidate pair (i < j, j >= since) of store
+// under the banding and bucket limit of index, in batches of at most a quarter
+// of memory.  A batch is grouped by bucket, not sorted.  Rows [0, n) of store
+// are bucketed by a band's frozen table of n entries when index has one, and
+// by hashing the rows otherwise.  Spill files go to dir (see SpillFile).
+template <typename F>
+JoinStats candidates(const SignatureStore& store, const LSHIndex& index, DocId since, size_t memory,
+                     const std::string& dir, WorkStealingPool& pool, F&& emit) {
+    DEDUP_TIME(instrument::kCandidates);
+    using Pair = std::pair<DocId, DocId>;
+    const size_t rows = index.rows();
+    const size_t bytes = rows * store.value_bytes();
+    const size_t chunk = std::max(kMinChunk, memory / 2 / sizeof(Entry));
+    const size_t batch = std::max(kMinBatch, memory / 4 / sizeof(Pair));
+    JoinStats stats;
+    std::vector<Pair> pairs;
+    pairs.reserve(batch);
+    std::vector<DocId> members;
+    std::vector<std::vector<uint64_t>> chained(index.bands());  // per band, sorted hashes of chained buckets
+
+    // True if docs i and j were paired by a band before band: they share its
+    // rows and its bucket was not chained
+    const auto paired = [&](size_t band, DocId i, DocId j) {
+        const uint8_t* a = store.row(i);
+        const uint8_t* b = store.row(j);
+        for (size_t e = 0; e < band; ++e) {
+            if (std::memcmp(a + e * bytes, b + e * bytes, bytes) == 0 &&
+                (chained[e].empty() ||
+                 !std::binary_search(chained[e].begin(), chained[e].end(), index.band_hash(e, a + e * bytes, bytes)))) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (size_t band = 0; band < index.bands(); ++band) {
+        const auto view = store.band(band, rows);
+        const LSHIndex::FrozenBand frozen = index.frozen(band);
+        std::unique_ptr<SpillFile> file;
+        std::vector<std::pair<uint64_t, uint64_t>> spilled;  // (first, count) of each run in file
+        std::vector<Entry> entries;
+        std::vector<std::pair<size_t, size_t>> resident;  // [begin, end) of each run left in entries
+
+        // Sort every chunk as one run per worker; all but the last chunk are
+        // spilled, and the last stays in memory for the merge
+        for (size_t begin = frozen.size; begin < store.size(); begin += chunk) {
+            const size_t n = std::min(chunk, store.size() - begin);
+            entries.resize(n);
+            pool.parallel_for(n, 4096, [&](size_t lo, size_t hi, size_t) {
+                for (size_t i = lo; i < hi; ++i) {
+                    entries[i] = {index.band_hash(band, view[begin + i], bytes), static_cast<DocId>(begin + i)};
+                }
+            });
+            const size_t slices = std::min(pool.size(), (n + kMinChunk - 1) / kMinChunk);
+            resident.clear();
+            for (size_t s = 0; s < slices; ++s) {
+                resident.emplace_back(n * s / slices, n * (s + 1) / slices);
+            }
+            pool.parallel_for(slices, 1, [&](size_t lo, size_t hi, size_t) {
+                for (size_t s = lo; s < hi; ++s) {
+                    std::sort(entries.begin() + resident[s].first, entries.begin() + resident[s].second);
+                }
+            });
+            stats.entries += n;
+            if (begin + n == store.size()) {
+                break;
+            }
+            if (!file) {
+                file = std::make_unique<SpillFile>(dir);
+            }
+            for (const auto& [lo, hi] : resident) {
+                spilled.emplace_back(file->size(), hi - lo);
+                file->append(entries.data() + lo, hi - lo);
+            }
+            stats.spilled_bytes += n * sizeof(Entry);
+            resident.clear();
+        }
+        stats.entries += frozen.size;
+
+        std::vector<Cursor> cursors;
+        cursors.reserve(1 + resident.size() + spilled.size());
+        if (frozen.size != 0) {
+            cursors.emplace_back(frozen);
+        }
+        for (const auto& [lo, hi] : resident) {
+            cursors.emplace_back(entries.data() + lo, hi - lo);
+        }
+        const size_t buffer = std::max(kMinBuffer, memory / 4 / sizeof(Entry) / std::max<size_t>(1, spilled.size()));
+        for (const auto& [first, n] : spilled) {
+            cursors.emplace_back(*file, first, n, buffer);
+        }
+        stats.runs += cursors.size();
+
+        // Min-heap of the cursors by head entry
+        const auto later = [&](size_t a, size_t b) { return cursors[b].head() < cursors[a].head(); };
+        std::vector<size_t> heap;
+        for (size_t c = 0; c < cursors.size(); ++c) {
+            if (!cursors[c].done()) {
+                heap.emplace_back(c);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+
+        uint64_t hash = 0;
+        const auto flush = [&] {
+            if (members.size() < 2) {
+                return;
+            }
+            if (index.max_bucket() != 0 && members.size() > index.max_bucket()) {
+                chained[band].emplace_back(hash);
+            }
+            LSHIndex::bucket_pairs(members, since, index.max_bucket(), stats.oversized, [&](DocId i, DocId j) {
+                if (paired(band, i, j)) {
+                    return;
+                }
+                pairs.emplace_back(i, j);
+                if (pairs.size() == batch) {
+                    stats.candidates += pairs.size();
+                    emit(pairs);
+                    pairs.clear();
+                }
+            });
+        };
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Cursor& cursor = cursors[heap.back()];
+            const Entry e = cursor.head();
+            cursor.advance();
+            if (cursor.done()) {
+                heap.pop_back();
+            } else {
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+            if (!members.empty() && e.hash != hash) {
+                flush();
+                members.clear();
+            }
+            hash = e.hash;
+            members.emplace_back(e.doc);
+        }
+        flush();
+        members.clear();
+    }
+    if (!pairs.empty()) {
+        stats.candidates += pairs.size();
+        emit(pairs);
+    }
+    DEDUP_COUNT(instrument::kCandidatePairs, stats.candidates);
+    return stats;
+}
+
+}  // namespace external
+
+#endif  // DEDUP_EXTERNAL_JOIN_H_
@@ -0,0 +1,65 @@
+#ifndef DEDUP_FEATURES_H_
+#define DEDUP_FEATURES_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Reusable scratch holding the distinct feature indices of one document as a
+// flat array.  With a small feature space a dense bitmap filters repeats on
+// insert; otherwise the indices are sorted and deduplicated in finish().
+// Either way the buffers are kept across documents, so once warmed up a
+// worker's memory is bounded by its longest document plus the bitmap.
+class FeatureSet {
+   public:
+    // 2^20 bits is 128 KiB, about the size of a per-core L2 slice
+    static constexpr size_t kMaxBitmapFeatures = size_t{1} << 20;
+
+    explicit FeatureSet(size_t num_features) {
+        if (num_features <= kMaxBitmapFeatures) {
+            bits_.resize((num_features + 63) / 64);
+        }
+    }
+
+    void clear() {
+        if (!bits_.empty()) {
+            for (const uint32_t idx : items_) {
+                bits_[idx / 64] = 0;
+            }
+        }
+        items_.clear();
+    }
+
+    void insert(uint32_t idx) {
+        if (bits_.empty()) {
+            items_.emplace_back(idx);
+            return;
+        }
+        uint64_t& word = bits_[idx / 64];
+        const uint64_t bit = uint64_t{1} << (idx % 64);
+        if (!(word & bit)) {
+            word |= bit;
+            items_.emplace_back(idx);
+        }
+    }
+
+    // Make the contents distinct; call once after the last insert
+    void finish() {
+        if (bits_.empty()) {
+            std::sort(items_.begin(), items_.end());
+            items_.erase(std::unique(items_.begin(), items_.end()), items_.end());
+        }
+    }
+
+    const uint32_t* data() const { return items_.data(); }
+    size_t size() const { return items_.size(); }
+    bool empty() const { return items_.empty(); }
+    const std::vector<uint32_t>& items() const { return items_; }
+
+   private:
+    std::vector<uint32_t> items_;
+    std::vector<uint64_t> bits_;
+};
+
+#endif  // DEDUP_FEATURES_H_
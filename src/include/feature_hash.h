@@ -0,0 +1,120 @@
+#ifndef DEDUP_INCLUDE_FEATURE_HASH_H_
+#define DEDUP_INCLUDE_FEATURE_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "./MurmurHash3.h"
+
+// Byte-string hashes for tokens and shingles, as policies with one static
+// hash(data, len) so the shingling loops can be instantiated per hash with
+// the call inlined.  Each returns 64 bits; murmur3_x86_32 fills only the low 32.
+namespace feature_hash {
+
+// The original token hash
+struct Murmur3x86_32 {
+    static constexpr const char* kName = "murmur3_x86_32";
+
+    static uint64_t hash(const void* data, size_t len) {
+        uint32_t h;
+        MurmurHash3_x86_32(data, static_cast<int>(len), 0, &h);
+        return h;
+    }
+};
+
+// Low half of MurmurHash3_x64_128
+struct Murmur3x64_128 {
+    static constexpr const char* kName = "murmur3_x64_128";
+
+    static uint64_t hash(const void* data, size_t len) {
+        uint64_t h[2];
+        MurmurHash3_x64_128(data, static_cast<int>(len), 0, h);
+        return h[0];
+    }
+};
+
+// wyhash final4 by Wang Yi (public domain, https://github.com/wangyi-fudan/wyhash)
+// with the default secret; it reproduces the upstream test vectors when given
+// their seeds.  A few 64x64->128 multiplies per 16 bytes, and for the short
+// inputs that tokens are, no loop at all.
+struct Wyhash {
+    static constexpr const char* kName = "wyhash";
+
+    static uint64_t hash(const void* data, size_t len, uint64_t seed = 0) {
+        const auto* p = static_cast<const uint8_t*>(data);
+        seed ^= mix(seed ^ kSecret[0], kSecret[1]);
+        uint64_t a, b;
+        if (len <= 16) {
+            if (len >= 4) {
+                a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+                b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+            } else if (len > 0) {
+                a = r3(p, len);
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if (i >= 48) {
+                uint64_t see1 = seed, see2 = seed;
+                do {
+                    seed = mix(r8(p) ^ kSecret[1], r8(p + 8) ^ seed);
+                    see1 = mix(r8(p + 16) ^ kSecret[2], r8(p + 24) ^ see1);
+                    see2 = mix(r8(p + 32) ^ kSecret[3], r8(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i >= 48);
+                seed ^= see1 ^ see2;
+            }
+            while (i > 16) {
+                seed = mix(r8(p) ^ kSecret[1], r8(p + 8) ^ seed);
+                i -= 16;
+                p += 16;
+            }
+            a = r8(p + i - 16);
+            b = r8(p + i - 8);
+        }
+        a ^= kSecret[1];
+        b ^= seed;
+        mum(a, b);
+        return mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+    }
+
+   private:
+    // _wyp, the default secret
+    static constexpr uint64_t kSecret[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL,
+                                            0x589965cc75374cc3ULL};
+
+    static void mum(uint64_t& a, uint64_t& b) {
+        const __uint128_t r = static_cast<__uint128_t>(a) * b;
+        a = static_cast<uint64_t>(r);
+        b = static_cast<uint64_t>(r >> 64);
+    }
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        mum(a, b);
+        return a ^ b;
+    }
+
+    static uint64_t r8(const uint8_t* p) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    }
+
+    static uint64_t r4(const uint8_t* p) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    static uint64_t r3(const uint8_t* p, size_t k) {
+        return (uint64_t{p[0]} << 16) | (uint64_t{p[k >> 1]} << 8) | p[k - 1];
+    }
+};
+
+}  // namespace feature_hash
+
+#endif  // DEDUP_INCLUDE_FEATURE_HASH_H_
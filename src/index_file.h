@@ -0,0 +1,294 @@
+#ifndef DEDUP_INDEX_FILE_H_
+#define DEDUP_INDEX_FILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "./lsh.h"
+#include "./signature_store.h"
+
+// On-disk signature store plus LSH buckets, laid out so that a reload is one
+// mmap and a few pointer fixups.  All integers are little-endian host order.
+//
+//   Header                     fixed size, see below
+//   uint64 band_sizes[bands]   entries per band
+//   signatures                 num_docs * num_hashes * (bits / 8) bytes, row-major
+//   4-byte aligned:            uint32 cardinality[num_docs], each feature-set size
+//   per band, 8-byte aligned:  uint64 hashes[n], then DocId docs[n]
+//                              sorted by (hash, doc)
+//
+// Everything that changes the signatures or their bucketing is recorded so a
+// file is never silently combined with a differently configured run.
+struct IndexParams {
+    uint32_t ngrams = 0;
+    uint32_t num_hashes = 0;
+    uint64_t num_features = 0;
+    uint32_t seed = 0;
+    uint32_t bits = 0;
+    uint32_t shingle_hash = 0;
+    uint32_t engine = 0;
+    uint32_t tokenizer = 0;  // Tokenizer, | 1 << 8 for case folding, | 1 << 9 for normalization
+    uint32_t feature_hash = 0;
+    uint32_t bands = 0;
+    uint32_t rows = 0;
+
+    bool operator==(const IndexParams& o) const {
+        return ngrams == o.ngrams && num_hashes == o.num_hashes && num_features == o.num_features &&
+               seed == o.seed && bits == o.bits && shingle_hash == o.shingle_hash && engine == o.engine &&
+               tokenizer == o.tokenizer && feature_hash == o.feature_hash && bands == o.bands && rows == o.rows;
+    }
+    bool operator!=(const IndexParams& o) const { return !(*this == o); }
+};
+
+namespace index_file {
+
+constexpr char kMagic[8] = {'D', 'E', 'D', 'U', 'P', 'I', 'D', 'X'};
+// 2 added IndexParams::engine, 3 IndexParams::tokenizer, 4 IndexParams::feature_hash,
+// 5 the cardinality array
+constexpr uint32_t kVersion = 5;
+constexpr uint32_t kByteOrder = 0x01020304;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    IndexParams params;
+    uint64_t num_docs;
+};
+
+inline uint64_t align_up(uint64_t x, uint64_t align) { return (x + align - 1) & ~(align - 1); }
+
+class Writer {
+   public:
+    explicit Writer(const std::string& path) : path_(path), tmp_(path + ".tmp") {
+        f_ = std::fopen(tmp_.c_str(), "wb");
+        if (f_ == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "open " + tmp_);
+        }
+    }
+
+    ~Writer() {
+        if (f_ != nullptr) {
+            std::fclose(f_);
+            std::remove(tmp_.c_str());
+        }
+    }
+
+    void write(const void* p, size_t n) {
+        if (n != 0 && std::fwrite(p, 1, n, f_) != n) {
+            throw std::system_error(errno, std::generic_category(), "write " + tmp_);
+        }
+        pos_ += n;
+    }
+
+    // Zeros up to the next multiple of align, at most 8
+    void pad(uint64_t align) {
+        static const char zeros[8] = {};
+        write(zeros, align_up(pos_, align) - pos_);
+    }
+
+    // Flush and atomically replace path, so readers never see a partial file
+    void commit() {
+        const bool ok = std::fflush(f_) == 0 && ::fsync(::fileno(f_)) == 0;
+        const int err = errno;
+        std::fclose(f_);
+        f_ = nullptr;
+        if (!ok || std::rename(tmp_.c_str(), path_.c_str()) != 0) {
+            const int rename_err = ok ? errno : err;
+            std::remove(tmp_.c_str());
+            throw std::system_error(rename_err, std::generic_category(), "commit " + path_);
+        }
+    }
+
+   private:
+    std::string path_;
+    std::string tmp_;
+    std::FILE* f_ = nullptr;
+    uint64_t pos_ = 0;
+};
+
+// Signature rows [first, last) of store, then their cardinalities
+inline void write_rows(Writer& out, const SignatureStore& store, size_t first, size_t last) {
+    for (size_t i = first; i < last; ++i) {
+        out.write(store.row(i), store.row_bytes());
+    }
+    out.pad(4);
+    std::vector<uint32_t> cardinality(last - first);
+    for (size_t i = first; i < last; ++i) {
+        cardinality[i - first] = store.cardinality(i);
+    }
+    out.write(cardinality.data(), cardinality.size() * sizeof(uint32_t));
+}
+
+}  // namespace index_file
+
+inline void write_index(const std::string& path, const IndexParams& params, const SignatureStore& store,
+                        const LSHIndex& index) {
+    index_file::Header header{};
+    std::memcpy(header.magic, index_file::kMagic, sizeof(header.magic));
+    header.version = index_file::kVersion;
+    header.byte_order = index_file::kByteOrder;
+    header.params = params;
+    header.num_docs = store.size();
+
+    std::vector<std::vector<std::pair<uint64_t, DocId>>> bands(index.bands());
+    std::vector<uint64_t> band_sizes(index.bands());
+    for (size_t b = 0; b < index.bands(); ++b) {
+        bands[b] = index.band_entries(b);
+        band_sizes[b] = bands[b].size();
+    }
+
+    index_file::Writer out(path);
+    out.write(&header, sizeof(header));
+    out.write(band_sizes.data(), band_sizes.size() * sizeof(uint64_t));
+    index_file::write_rows(out, store, 0, store.size());
+    std::vector<uint64_t> hashes;
+    std::vector<DocId> docs;
+    for (const auto& entries : bands) {
+        hashes.clear();
+        docs.clear();
+        for (const auto& [h, d] : entries) {
+            hashes.emplace_back(h);
+            docs.emplace_back(d);
+        }
+        out.pad(8);
+        out.write(hashes.data(), hashes.size() * sizeof(uint64_t));
+        out.write(docs.data(), docs.size() * sizeof(DocId));
+    }
+    out.commit();
+}
+
+// An index file of documents [first, last) of store, renumbered from 0,
+// with every band table empty.  Smaller and quicker to write than
+// write_index(); Deduplicator::add_signatures() buckets the rows again.
+inline void write_signatures(const std::string& path, const IndexParams& params, const SignatureStore& store,
+                             size_t first, size_t last) {
+    index_file::Header header{};
+    std::memcpy(header.magic, index_file::kMagic, sizeof(header.magic));
+    header.version = index_file::kVersion;
+    header.byte_order = index_file::kByteOrder;
+    header.params = params;
+    header.num_docs = last - first;
+
+    const std::vector<uint64_t> band_sizes(params.bands);
+    index_file::Writer out(path);
+    out.write(&header, sizeof(header));
+    out.write(band_sizes.data(), band_sizes.size() * sizeof(uint64_t));
+    index_file::write_rows(out, store, first, last);
+    out.commit();
+}
+
+// A read-only mapping of an index file.  Signature rows and bucket arrays are
+// used in place, so the object must outlive every store and index attached to
+// it.
+class MappedIndex {
+   public:
+    explicit MappedIndex(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            const int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), "fstat " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ < sizeof(index_file::Header)) {
+            ::close(fd);
+            throw std::runtime_error(path + ": not a dedup index (too short)");
+        }
+        void* p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        const int err = errno;
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            throw std::system_error(err, std::generic_category(), "mmap " + path);
+        }
+        base_ = static_cast<const uint8_t*>(p);
+
+        std::memcpy(&header_, base_, sizeof(header_));
+        if (std::memcmp(header_.magic, index_file::kMagic, sizeof(header_.magic)) != 0 ||
+            header_.byte_order != index_file::kByteOrder) {
+            unmap();
+            throw std::runtime_error(path + ": not a dedup index for this byte order");
+        }
+        if (header_.version != index_file::kVersion) {
+            unmap();
+            throw std::runtime_error(path + ": unsupported index version " + std::to_string(header_.version));
+        }
+
+        const auto& prm = header_.params;
+        uint64_t pos = sizeof(header_);
+        if (pos + prm.bands * sizeof(uint64_t) > size_) {
+            unmap();
+            throw std::runtime_error(path + ": truncated index");
+        }
+        const uint64_t* band_sizes = reinterpret_cast<const uint64_t*>(base_ + pos);
+        pos += prm.bands * sizeof(uint64_t);
+        signatures_ = base_ + pos;
+        pos += header_.num_docs * prm.num_hashes * (prm.bits / 8);
+        pos = index_file::align_up(pos, 4);
+        cardinalities_ = reinterpret_cast<const uint32_t*>(base_ + pos);
+        pos += header_.num_docs * sizeof(uint32_t);
+        if (pos > size_) {
+            unmap();
+            throw std::runtime_error(path + ": truncated index");
+        }
+        for (uint32_t b = 0; b < prm.bands; ++b) {
+            pos = index_file::align_up(pos, 8);
+            LSHIndex::FrozenBand band;
+            band.size = band_sizes[b];
+            band.hashes = reinterpret_cast<const uint64_t*>(base_ + pos);
+            pos += band.size * sizeof(uint64_t);
+            band.docs = reinterpret_cast<const DocId*>(base_ + pos);
+            pos += band.size * sizeof(DocId);
+            if (pos > size_) {
+                unmap();
+                throw std::runtime_error(path + ": truncated index");
+            }
+            bands_.emplace_back(band);
+        }
+    }
+
+    MappedIndex(const MappedIndex&) = delete;
+    MappedIndex& operator=(const MappedIndex&) = delete;
+
+    ~MappedIndex() { unmap(); }
+
+    const IndexParams& params() const { return header_.params; }
+    size_t num_docs() const { return header_.num_docs; }
+    const uint8_t* signatures() const { return signatures_; }
+    const uint32_t* cardinalities() const { return cardinalities_; }
+    const std::vector<LSHIndex::FrozenBand>& bands() const { return bands_; }
+
+   private:
+    const uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    index_file::Header header_{};
+    const uint8_t* signatures_ = nullptr;
+    const uint32_t* cardinalities_ = nullptr;
+    std::vector<LSHIndex::FrozenBand> bands_;
+
+    void unmap() {
+        if (base_ != nullptr) {
+            ::munmap(const_cast<uint8_t*>(base_), size_);
+            base_ = nullptr;
+        }
+    }
+};
+
+#endif  // DEDUP_INDEX_FILE_H_
@@ -0,0 +1,185 @@
+#ifndef DEDUP_INSTRUMENT_H_
+#define DEDUP_INSTRUMENT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef DEDUP_INSTRUMENT
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// Hot-path timers and counters, compiled in only with -DDEDUP_INSTRUMENT.
+// Without it DEDUP_TIME / DEDUP_COUNT / DEDUP_MAX expand to nothing, their
+// arguments are not evaluated, and totals() is all zeros.
+//
+// Every thread writes its own block, so recording is a plain add with no
+// sharing; totals() sums the blocks and should be called once the threads are
+// done.  Time is read from the TSC where there is one and converted to seconds
+// against the steady clock.
+namespace instrument {
+
+enum Stage {
+    kPrefilter,   // exact-duplicate hashing
+    kExtract,     // extract_features
+    kSignature,   // compute_signature
+    kInsert,      // LSH bucket insertion
+    kCandidates,  // candidate pair generation
+    kVerify,      // signature comparison of candidates
+    kNumStages,
+};
+
+enum Counter {
+    kDocs,               // documents signed
+    kShingles,           // distinct features over all signed documents
+    kCandidatePairs,     // pairs produced by candidate generation
+    kBuckets,            // buckets holding two or more documents
+    kBucketEntries,      // documents in those buckets
+    kCardinalityPruned,  // candidate pairs dropped on feature-set sizes
+    kNumCounters,
+};
+
+enum Maximum {
+    kLargestBucket,  // documents in the fullest bucket
+    kNumMaxima,
+};
+
+constexpr const char* kStageNames[kNumStages] = {"prefilter", "extract_features", "compute_signature",
+                                                 "lsh_insert", "candidates", "verify"};
+constexpr const char* kCounterNames[kNumCounters] = {"docs", "shingles", "candidate_pairs", "buckets",
+                                                     "bucket_entries", "cardinality_pruned"};
+constexpr const char* kMaximumNames[kNumMaxima] = {"largest_bucket"};
+
+struct Totals {
+    uint64_t calls[kNumStages] = {};
+    double seconds[kNumStages] = {};
+    uint64_t counters[kNumCounters] = {};
+    uint64_t maxima[kNumMaxima] = {};
+};
+
+#ifdef DEDUP_INSTRUMENT
+
+constexpr bool kEnabled = true;
+
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+struct Block {
+    uint64_t calls[kNumStages] = {};
+    uint64_t ticks[kNumStages] = {};
+    uint64_t counters[kNumCounters] = {};
+    uint64_t maxima[kNumMaxima] = {};
+};
+
+// Owns every thread's block, so counts survive the threads that made them
+class Registry {
+   public:
+    static Registry& get() {
+        static Registry registry;
+        return registry;
+    }
+
+    Block& local() {
+        thread_local Block* block = nullptr;
+        if (block == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            blocks_.emplace_back(std::make_unique<Block>());
+            block = blocks_.back().get();
+        }
+        return *block;
+    }
+
+    Totals totals() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        const uint64_t spent = ticks() - start_ticks_;
+        const double seconds_per_tick = spent == 0 ? 0.0 : elapsed / static_cast<double>(spent);
+        Totals t;
+        for (const auto& b : blocks_) {
+            for (size_t s = 0; s < kNumStages; ++s) {
+                t.calls[s] += b->calls[s];
+                t.seconds[s] += static_cast<double>(b->ticks[s]) * seconds_per_tick;
+            }
+            for (size_t c = 0; c < kNumCounters; ++c) {
+                t.counters[c] += b->counters[c];
+            }
+            for (size_t m = 0; m < kNumMaxima; ++m) {
+                t.maxima[m] = std::max(t.maxima[m], b->maxima[m]);
+            }
+        }
+        return t;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& b : blocks_) {
+            *b = Block{};
+        }
+    }
+
+   private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Block>> blocks_;
+    const std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    const uint64_t start_ticks_ = ticks();
+};
+
+inline Block& local() { return Registry::get().local(); }
+
+class ScopedTimer {
+   public:
+    explicit ScopedTimer(Stage stage) : block_(local()), stage_(stage), start_(ticks()) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+    ~ScopedTimer() {
+        block_.ticks[stage_] += ticks() - start_;
+        ++block_.calls[stage_];
+    }
+
+   private:
+    Block& block_;
+    Stage stage_;
+    uint64_t start_;
+};
+
+inline Totals totals() { return Registry::get().totals(); }
+inline void reset() { Registry::get().reset(); }
+
+#define DEDUP_INSTRUMENT_CAT2(a, b) a##b
+#define DEDUP_INSTRUMENT_CAT(a, b) DEDUP_INSTRUMENT_CAT2(a, b)
+// Time the rest of the enclosing scope as stage
+#define DEDUP_TIME(stage) ::instrument::ScopedTimer DEDUP_INSTRUMENT_CAT(dedup_timer_, __LINE__)(stage)
+#define DEDUP_COUNT(counter, n) (::instrument::local().counters[counter] += (n))
+#define DEDUP_MAX(maximum, v)                                                   \
+    do {                                                                        \
+        uint64_t& dedup_max_ = ::instrument::local().maxima[maximum];           \
+        dedup_max_ = std::max<uint64_t>(dedup_max_, static_cast<uint64_t>(v)); \
+    } while (0)
+
+#else
+
+constexpr bool kEnabled = false;
+
+inline Totals totals() { return {}; }
+inline void reset() {}
+
+#define DEDUP_TIME(stage) ((void)0)
+#define DEDUP_COUNT(counter, n) ((void)0)
+#define DEDUP_MAX(maximum, v) ((void)0)
+
+#endif  // DEDUP_INSTRUMENT
+
+}  // namespace instrument
+
+#endif  // DEDUP_INSTRUMENT_H_
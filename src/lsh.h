@@ -0,0 +1,288 @@
+#ifndef DEDUP_LSH_H_
+#define DEDUP_LSH_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "./include/MurmurHash3.h"
+#include "./instrument.h"
+#include "./signature_store.h"
+
+using DocId = uint32_t;
+
+// Banded locality sensitive hashing over MinHash signatures.  Each signature is
+// cut into bands_ bands of rows_ rows each and every band is hashed into its own
+// bucket table.  Two documents become a candidate pair if they collide in at
+// least one band, which happens with probability 1 - (1 - s^r)^b for Jaccard
+// similarity s.  See chapter 3.4 of "Mining of Massive Datasets".
+class LSHIndex {
+   public:
+    LSHIndex(size_t bands, size_t rows) : bands_(bands), rows_(rows), entries_(bands) {
+        if (bands_ == 0 || rows_ == 0) {
+            throw std::invalid_argument("LSHIndex: bands and rows must be positive");
+        }
+    }
+
+    size_t bands() const { return bands_; }
+    size_t rows() const { return rows_; }
+
+    // Hash of one band of a signature, given as the band's bytes
+    uint64_t band_hash(size_t band, const uint8_t* values, size_t bytes) const {
+        uint64_t h[2];
+        MurmurHash3_x64_128(values, static_cast<int>(bytes), static_cast<uint32_t>(band), h);
+        return h[0];
+    }
+
+    // Bucket rows [first, last) of store, one band table at a time so that
+    // only a single table is hot in cache.  A table is a flat array of
+    // (hash, doc) entries in insertion order, so inserting never allocates
+    // beyond the array's amortized growth; entries are grouped into buckets by
+    // sorting when candidates are generated.
+    void insert(const SignatureStore& store, size_t first, size_t last) {
+        if (bands_ * rows_ > store.num_hashes()) {
+            throw std::invalid_argument("LSHIndex: bands * rows exceeds signature length");
+        }
+        DEDUP_TIME(instrument::kInsert);
+        for (size_t band = 0; band < bands_; ++band) {
+            const auto view = store.band(band, rows_);
+            auto& table = entries_[band];
+            for (size_t i = first; i < last; ++i) {
+                table.emplace_back(band_hash(band, view[i], view.bytes()), static_cast<DocId>(i));
+            }
+        }
+    }
+
+    // A read-only band table, typically mapped from an index file: entries
+    // sorted by (hash, doc), split into parallel arrays
+    struct FrozenBand {
+        const uint64_t* hashes = nullptr;
+        const DocId* docs = nullptr;
+        size_t size = 0;
+    };
+
+    // Use previously built tables as the base of the index.  New documents are
+    // bucketed in memory on top of them; the arrays must stay valid.
+    void attach(std::vector<FrozenBand> frozen) {
+        if (frozen.size() != bands_) {
+            throw std::invalid_argument("LSHIndex: frozen tables do not match band count");
+        }
+        frozen_ = std::move(frozen);
+    }
+
+    // Buckets that candidates() chained instead of expanding to all pairs
+    struct OversizedBuckets {
+        size_t buckets = 0;
+        size_t members = 0;
+        size_t largest = 0;
+        uint64_t pairs_skipped = 0;  // all-pairs count minus the chained pairs emitted
+    };
+
+    // Buckets with more than limit members (0, the default, for no limit)
+    // are chained: each member is paired only with the bucket's smallest id
+    // and with the member before it, so the bucket costs O(n) pairs instead of
+    // O(n^2).  Boilerplate that lands a whole corpus in one bucket is then
+    // still clustered through the chain, at the price of missing members
+    // that resemble neither neighbour.
+    void set_max_bucket(size_t limit) { max_bucket_ = limit; }
+    size_t max_bucket() const { return max_bucket_; }
+
+    // What the last candidates() call did with oversized buckets
+    const OversizedBuckets& oversized() const { return oversized_; }
+
+    // Every pair (i < j) sharing a bucket in some band, with j >= since,
+    // sorted and without duplicates
+    std::vector<std::pair<DocId, DocId>> candidates(DocId since = 0) const {
+        DEDUP_TIME(instrument::kCandidates);
+        std::vector<std::pair<DocId, DocId>> pairs;
+        oversized_ = {};
+        for (size_t band = 0; band < bands_; ++band) {
+            for_each_bucket(band, since, [&](uint64_t, const std::vector<DocId>& members) {
+                note_bucket(members.size());
+                bucket_pairs(members, since, max_bucket_, pairs, oversized_);
+            });
+        }
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+        DEDUP_COUNT(instrument::kCandidatePairs, pairs.size());
+        return pairs;
+    }
+
+    // Append the candidate pairs of one bucket, members sorted, to pairs:
+    // all (i < j) with j >= since, or the chain if the bucket has more than
+    // limit members
+    template <typename Id>
+    static void bucket_pairs(const std::vector<Id>& members, Id since, size_t limit,
+                             std::vector<std::pair<Id, Id>>& pairs, OversizedBuckets& oversized) {
+        bucket_pairs(members, since, limit, oversized, [&](Id i, Id j) { pairs.emplace_back(i, j); });
+    }
+
+    // The same pairs passed to f(i, j) one at a time, for callers that cannot
+    // hold an oversized bucket's pairs at once
+    template <typename Id, typename F>
+    static void bucket_pairs(const std::vector<Id>& members, Id since, size_t limit, OversizedBuckets& oversized,
+                             F&& f) {
+        const size_t n = members.size();
+        const size_t first = std::lower_bound(members.begin(), members.end(), since) - members.begin();
+        if (limit == 0 || n <= limit) {
+            // Pairs come out in order, so the final sort mostly merges
+            // presorted runs
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = std::max(i + 1, first); j < n; ++j) {
+                    f(members[i], members[j]);
+                }
+            }
+            return;
+        }
+        uint64_t all = 0, chained = 0;
+        for (size_t j = std::max<size_t>(first, 1); j < n; ++j) {
+            all += j;
+            f(members[0], members[j]);
+            ++chained;
+            if (j > 1) {
+                f(members[j - 1], members[j]);
+                ++chained;
+            }
+        }
+        ++oversized.buckets;
+        oversized.members += n;
+        oversized.largest = std::max(oversized.largest, n);
+        oversized.pairs_skipped += all - chained;
+    }
+
+    // Frozen and in-memory entries of one band merged and sorted by (hash, doc)
+    std::vector<std::pair<uint64_t, DocId>> band_entries(size_t band) const {
+        std::vector<std::pair<uint64_t, DocId>> entries = entries_[band];
+        if (!frozen_.empty()) {
+            const auto& frozen = frozen_[band];
+            entries.reserve(entries.size() + frozen.size);
+            for (size_t i = 0; i < frozen.size; ++i) {
+                entries.emplace_back(frozen.hashes[i], frozen.docs[i]);
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        return entries;
+    }
+
+    // The attached table of band, empty if none.  It holds one entry for
+    // each of documents [0, size).
+    FrozenBand frozen(size_t band) const { return frozen_.empty() ? FrozenBand{} : frozen_[band]; }
+
+    void clear() {
+        for (auto& table : entries_) {
+            table.clear();
+        }
+        frozen_.clear();
+    }
+
+    // Probability that two documents with Jaccard similarity s become candidates
+    static double collision_probability(double s, size_t bands, size_t rows) {
+        return 1.0 - std::pow(1.0 - std::pow(s, static_cast<double>(rows)), static_cast<double>(bands));
+    }
+
+    // Area under the S-curve below the threshold (pairs we verify for nothing)
+    // and above it (pairs we miss), integrated with the midpoint rule
+    static std::pair<double, double> error_rates(double threshold, size_t bands, size_t rows) {
+        constexpr int kSteps = 1000;
+        double fp = 0, fn = 0;
+        for (int i = 0; i < kSteps; ++i) {
+            const double s = (i + 0.5) / kSteps;
+            const double p = collision_probability(s, bands, rows);
+            if (s < threshold) {
+                fp += p / kSteps;
+            } else {
+                fn += (1.0 - p) / kSteps;
+            }
+        }
+        return {fp, fn};
+    }
+
+    // Print the expected recall (candidate probability above the threshold) and
+    // false positive rate (candidate probability below it) for this banding
+    void describe(std::ostream& os, double threshold) const {
+        const auto [fp, fn] = error_rates(threshold, bands_, rows_);
+        os << "LSH: " << bands_ << " bands x " << rows_ << " rows, similarity threshold " << threshold
+           << " (S-curve midpoint " << std::pow(1.0 / bands_, 1.0 / rows_) << ")\n"
+           << "  false positive area " << fp << ", false negative area " << fn << "\n";
+        for (int i = 1; i <= 10; ++i) {
+            const double s = i / 10.0;
+            os << "  P(candidate | s=" << s << ") = " << collision_probability(s, bands_, rows_) << "\n";
+        }
+    }
+
+   private:
+    size_t bands_;
+    size_t rows_;
+    std::vector<std::vector<std::pair<uint64_t, DocId>>> entries_;  // per band, in insertion order
+    std::vector<FrozenBand> frozen_;                                // empty, or one per band
+    size_t max_bucket_ = 0;
+    mutable OversizedBuckets oversized_;
+
+    // Bucket-size counters for the run report; nothing without instrumentation
+    static void note_bucket(size_t n) {
+        if (n >= 2) {
+            DEDUP_COUNT(instrument::kBuckets, 1);
+            DEDUP_COUNT(instrument::kBucketEntries, n);
+            DEDUP_MAX(instrument::kLargestBucket, n);
+        }
+    }
+
+    // Call f(hash, members) for every bucket of band that can hold a pair
+    // (i < j, j >= since), frozen and in-memory entries together, in hash
+    // order with members sorted by id.  The in-memory entries are sorted in a
+    // copy.  When since is past the frozen documents, as for a batch added
+    // after load(), only buckets with an in-memory entry qualify, and each is
+    // completed by a binary search of the frozen table, so the cost follows
+    // the new batch rather than the history; otherwise the band is walked as
+    // a merge join against the frozen table.
+    template <typename F>
+    void for_each_bucket(size_t band, DocId since, F f) const {
+        std::vector<std::pair<uint64_t, DocId>> sorted = entries_[band];
+        std::sort(sorted.begin(), sorted.end());
+        const FrozenBand frozen = frozen_.empty() ? FrozenBand{} : frozen_[band];
+        std::vector<DocId> members;
+        if (frozen.size != 0 && since >= frozen.size) {
+            for (size_t m = 0; m < sorted.size();) {
+                const uint64_t hash = sorted[m].first;
+                const auto range = std::equal_range(frozen.hashes, frozen.hashes + frozen.size, hash);
+                const DocId* docs = frozen.docs + (range.first - frozen.hashes);
+                members.assign(docs, docs + (range.second - range.first));
+                // Every in-memory id is above every frozen one
+                for (; m < sorted.size() && sorted[m].first == hash; ++m) {
+                    members.push_back(sorted[m].second);
+                }
+                f(hash, members);
+            }
+            return;
+        }
+        size_t m = 0, k = 0;
+        while (m < sorted.size() || k < frozen.size) {
+            uint64_t hash;
+            if (k == frozen.size) {
+                hash = sorted[m].first;
+            } else if (m == sorted.size()) {
+                hash = frozen.hashes[k];
+            } else {
+                hash = std::min(sorted[m].first, frozen.hashes[k]);
+            }
+            members.clear();
+            for (; k < frozen.size && frozen.hashes[k] == hash; ++k) {
+                members.push_back(frozen.docs[k]);
+            }
+            const size_t from_frozen = members.size();
+            for (; m < sorted.size() && sorted[m].first == hash; ++m) {
+                members.push_back(sorted[m].second);
+            }
+            if (from_frozen != 0 && from_frozen != members.size()) {
+                std::inplace_merge(members.begin(), members.begin() + from_frozen, members.end());
+            }
+            f(hash, members);
+        }
+    }
+};
+
+#endif  // DEDUP_LSH_H_
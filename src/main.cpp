@@ -1,170 +1,629 @@
 #include <algorithm>
+#include <chrono>
 #include <bitset>
 #include <cmath>
 #include <cstring>
-#include <deque>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <random>
 #include <set>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
-#include "./include/MurmurHash3.h"
+#include "./checkpoint.h"
+#include "./corpus.h"
+#include "./dedup.h"
+#include "./numa.h"
+#include "./online.h"
+#include "./report.h"
+#include "./shard.h"
+#include "./tuner.h"
 
 using namespace std;
 
-class TokenGen {
-   public:
-    TokenGen(const string_view sv, const string_view del) : sv_(sv), del_(del) {}
-
-    operator bool() const { return !sv_.empty(); }
-
-    string_view operator()() {
-        while (true) {
-            auto r = sv_;
-            const auto it = sv_.find_first_of(del_);
-            if (it == string_view::npos) {
-                sv_ = {};
-            } else {
-                r.remove_suffix(r.size() - it);
-                sv_.remove_prefix(it + 1);
-            }
-            if (!r.empty()) {
-                return r;
-            }
-            if (sv_.empty()) {
-                return {};
-            }
+// One "doc<TAB>cluster" line per document, or with binary the cluster ids as
+// a little-endian array indexed by document.  Documents are numbered from
+// first, which is non-zero for one shard of a sharded run.
+template <typename Id>
+static void write_clusters(const string& path, const vector<Id>& labels, bool binary, Id first = 0) {
+    ofstream out(path, binary ? ios::binary : ios::out);
+    if (binary) {
+        out.write(reinterpret_cast<const char*>(labels.data()), labels.size() * sizeof(Id));
+    } else {
+        for (size_t i = 0; i < labels.size(); ++i) {
+            out << first + i << '\t' << labels[i] << '\n';
         }
     }
+    if (!out.flush()) {
+        throw runtime_error("failed to write " + path);
+    }
+}
 
-   private:
-    string_view sv_;
-    string_view del_;
+// Ids of the documents to keep, one representative (the smallest id) per
+// cluster; one per line, or a little-endian array with binary
+template <typename Id>
+static void write_keep(const string& path, const vector<Id>& labels, bool binary, Id first = 0) {
+    ofstream out(path, binary ? ios::binary : ios::out);
+    for (size_t i = 0; i < labels.size(); ++i) {
+        if (labels[i] != first + i) {
+            continue;
+        }
+        if (binary) {
+            const auto id = static_cast<Id>(first + i);
+            out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+        } else {
+            out << first + i << '\n';
+        }
+    }
+    if (!out.flush()) {
+        throw runtime_error("failed to write " + path);
+    }
+}
+
+// What main() did, for the run report
+struct RunInfo {
+    string input;
+    CorpusFormat format = CorpusFormat::kText;
+    string loaded_index;
+    DocId since = 0;
+    bool clusters = false;
+    size_t pairs = 0;
+    size_t representatives = 0;
+    bool pipelined = false;
+    PipelineStats pipeline;
+    LSHIndex::OversizedBuckets oversized;
+    numa::Topology numa;  // nodes the workers were placed on, if --numa
+    bool interleaved = false;
+    double add_seconds = 0;
+    double match_seconds = 0;
+    double total_seconds = 0;
 };
 
-// Implemented based on https://github.com/apache/spark/blob/82e3f0d5d594f544ec4689cb833879c8a95ec849/mllib/src/main/scala/org/apache/spark/ml/feature/MinHashLSH.scala#L163
-class MinHasher {
-   public:
-    MinHasher(size_t num_hashes, uint32_t seed = 1) : num_hashes_(num_hashes) {
-        mt19937 rng_(seed);
-        uniform_int_distribution<uint32_t> dist_a_(1, kHashPrime - 1);
-        uniform_int_distribution<uint32_t> dist_b_(0, kHashPrime - 1);
-
-        a_.resize(num_hashes_);
-        b_.resize(num_hashes_);
-        for (size_t i = 0; i < num_hashes_; ++i) {
-            a_[i] = dist_a_(rng_);
-            b_[i] = dist_b_(rng_);
-        }
-    }
-
-    // Compute MinHash signature for a set of feature indices
-    vector<uint32_t> compute_signature(const unordered_set<size_t>& feature_indices) const {
-        vector<uint32_t> sig(num_hashes_, kHashPrime);
-        for (const auto& idx : feature_indices) {
-            for (size_t i = 0; i < num_hashes_; ++i) {
-                uint32_t hash = static_cast<uint32_t>(
-                    ((1ULL + idx) * a_[i] + b_[i]) % kHashPrime);
-                sig[i] = min(sig[i], hash);
-            }
-        }
-        return sig;
+// "bytes", "utf8" or "utf8-chars", with "+fold" and "+nfkc" as recorded in
+// IndexParams::tokenizer
+static string tokenizer_name(uint32_t t) {
+    const auto mode = static_cast<Tokenizer>(t & 0xFF);
+    string name = mode == Tokenizer::kBytes ? "bytes" : mode == Tokenizer::kUtf8Words ? "utf8" : "utf8-chars";
+    if (t & 1u << 8) {
+        name += "+fold";
+    }
+    if (t & 1u << 9) {
+        name += "+nfkc";
     }
+    return name;
+}
 
-    // Jaccard distance between two MinHash signatures
-    static double jaccard_distance(const vector<uint32_t>& a, const vector<uint32_t>& b) {
-        size_t match = 0;
-        for (size_t i = 0; i < a.size(); ++i) {
-            if (a[i] == b[i]) {
-                match++;
-            }
+static const char* feature_hash_name(uint32_t h) {
+    switch (static_cast<FeatureHash>(h)) {
+        case FeatureHash::kMurmur128: return feature_hash::Murmur3x64_128::kName;
+        case FeatureHash::kWyhash: return feature_hash::Wyhash::kName;
+        default: return feature_hash::Murmur3x86_32::kName;
+    }
+}
+
+static FeatureHash parse_feature_hash(string_view name) {
+    for (const auto h : {FeatureHash::kMurmur32, FeatureHash::kMurmur128, FeatureHash::kWyhash}) {
+        if (name == feature_hash_name(static_cast<uint32_t>(h))) {
+            return h;
         }
-        return 1.0 - static_cast<double>(match) / a.size();
     }
+    throw invalid_argument("unknown feature hash " + string(name));
+}
+
+static ResultFormat parse_result_format(string_view name) {
+    if (name == "text") {
+        return ResultFormat::kText;
+    }
+    if (name == "tsv") {
+        return ResultFormat::kTsv;
+    }
+    if (name == "binary") {
+        return ResultFormat::kBinary;
+    }
+    if (name == "arrow") {
+        return ResultFormat::kArrow;
+    }
+    throw invalid_argument("unknown pairs format " + string(name));
+}
 
-   private:
-    static constexpr uint32_t kHashPrime = 2038074743;
+static void write_queue(JsonWriter& json, const char* key, const QueueStats& q) {
+    json.begin(key)
+        .field("capacity", q.capacity)
+        .field("pushes", q.pushes)
+        .field("mean_occupancy", q.mean_occupancy)
+        .field("max_occupancy", q.max_occupancy)
+        .field("push_wait_seconds", q.push_wait_seconds)
+        .field("pop_wait_seconds", q.pop_wait_seconds)
+        .end();
+}
 
-    size_t num_hashes_;
-    vector<uint32_t> a_;
-    vector<uint32_t> b_;
-};
+// Machine-readable summary of the run.  Stage timings and counters are only
+// present in builds with -DDEDUP_INSTRUMENT.
+static void write_report(const string& path, const Deduplicator& dedup, const RunInfo& info) {
+    ofstream out(path);
+    {
+        JsonWriter json(out);
+        json.begin().field("report_version", 1).field("instrumented", instrument::kEnabled);
+
+        json.begin("input")
+            .field("path", info.input)
+            .field("format", info.format == CorpusFormat::kJsonl ? "jsonl" : "text")
+            .field("loaded_index", info.loaded_index)
+            .end();
 
-class Deduplicator {
-   public:
-    Deduplicator(size_t ngrams, size_t num_hashes, double threshold, size_t num_features) : ngrams_(ngrams),
-                                                                                            num_features_(num_features),
-                                                                                            threshold_(threshold),
-                                                                                            hasher_(num_hashes) {
-        for (int c = 0; c <= numeric_limits<unsigned char>::max(); ++c) {
-            if (!isalnum(c)) {
-                nonalnum_ += static_cast<char>(c);
+        const auto p = dedup.params();
+        json.begin("params")
+            .field("ngrams", p.ngrams)
+            .field("num_hashes", p.num_hashes)
+            .field("num_features", p.num_features)
+            .field("seed", p.seed)
+            .field("bits", p.bits)
+            .field("shingle_hash", p.shingle_hash == static_cast<uint32_t>(ShingleHash::kConcat) ? "concat" : "rolling")
+            .field("tokenizer", tokenizer_name(p.tokenizer))
+            .field("feature_hash", feature_hash_name(p.feature_hash))
+            .field("engine", p.engine == static_cast<uint32_t>(SignatureEngine::kOph) ? "oph" : "minhash")
+            .field("bands", p.bands)
+            .field("rows", p.rows)
+            .end();
+        json.field("device", dedup.device() != nullptr ? dedup.device() : "cpu");
+        json.field("threads", dedup.threads()).field("cardinality_pruning", dedup.cardinality_pruning());
+
+        if (!info.numa.nodes.empty()) {
+            const auto workers = dedup.workers_per_node();
+            json.begin("numa").field("nodes", workers.size()).field("interleaved", info.interleaved);
+            for (size_t n = 0; n < workers.size(); ++n) {
+                json.begin("node" + to_string(info.numa.nodes[n].id))
+                    .field("cpus", info.numa.nodes[n].cpus.size())
+                    .field("workers", workers[n])
+                    .end();
             }
+            json.end();
         }
-    }
 
-    void process(const vector<string_view>& docs) {
-        vector<vector<uint32_t>> signatures;
-        signatures.reserve(docs.size());
-        for (const string_view doc : docs) {
-            const auto& ngrams = extract_features(doc);
-            signatures.emplace_back(hasher_.compute_signature(ngrams));
+        json.begin("lsh_guard")
+            .field("max_bucket", dedup.index().max_bucket())
+            .field("oversized_buckets", info.oversized.buckets)
+            .field("oversized_members", info.oversized.members)
+            .field("largest_oversized", info.oversized.largest)
+            .field("pairs_skipped", info.oversized.pairs_skipped)
+            .end();
+
+        if (dedup.memory_budget() != 0) {
+            const auto& js = dedup.join_stats();
+            json.begin("external_join")
+                .field("memory_budget", dedup.memory_budget())
+                .field("entries", js.entries)
+                .field("runs", js.runs)
+                .field("spilled_bytes", js.spilled_bytes)
+                .field("candidates", js.candidates)
+                .end();
+        }
+
+        json.begin("documents")
+            .field("total", dedup.size())
+            .field("new", dedup.size() - info.since)
+            .field("exact_duplicates", dedup.exact_duplicates())
+            .end();
+
+        json.begin("output");
+        if (info.clusters) {
+            json.field("representatives", info.representatives)
+                .field("duplicates", dedup.size() - info.representatives);
+        } else {
+            json.field("pairs", info.pairs);
         }
+        json.end();
 
-        for (size_t i = 0; i < docs.size(); ++i) {
-            for (size_t j = i + 1; j < docs.size(); ++j) {
-                const auto dist = MinHasher::jaccard_distance(signatures[i], signatures[j]);
-                if (dist < threshold_) {
-                    cout << "Duplicate pair (Jaccard: " << 1.0 - dist << "):\n"
-                         << " - " << docs[i] << "\n - " << docs[j] << "\n\n";
-                }
+        json.begin("seconds")
+            .field("add", info.add_seconds)
+            .field("match", info.match_seconds)
+            .field("total", info.total_seconds)
+            .end();
+
+        if (info.pipelined) {
+            const auto& ps = info.pipeline;
+            json.begin("pipeline")
+                .field("batches", ps.batches)
+                .field("signers", ps.signers)
+                .field("read_seconds", ps.read_seconds)
+                .field("sign_seconds", ps.sign_seconds)
+                .field("index_seconds", ps.index_seconds);
+            write_queue(json, "read_queue", ps.read_queue);
+            write_queue(json, "sign_queue", ps.sign_queue);
+            json.end();
+        }
+
+        if (instrument::kEnabled) {
+            const auto totals = instrument::totals();
+            json.begin("stages");
+            for (size_t s = 0; s < instrument::kNumStages; ++s) {
+                json.begin(instrument::kStageNames[s])
+                    .field("calls", totals.calls[s])
+                    .field("seconds", totals.seconds[s])
+                    .end();
+            }
+            json.end();
+            json.begin("counters");
+            for (size_t c = 0; c < instrument::kNumCounters; ++c) {
+                json.field(instrument::kCounterNames[c], totals.counters[c]);
             }
+            for (size_t m = 0; m < instrument::kNumMaxima; ++m) {
+                json.field(instrument::kMaximumNames[m], totals.maxima[m]);
+            }
+            json.end();
         }
     }
+    if (!out.flush()) {
+        throw runtime_error("failed to write " + path);
+    }
+}
 
-   private:
-    size_t ngrams_;
-    size_t num_features_;
-    double threshold_;
-    string nonalnum_;
-    MinHasher hasher_;
+// Bytes from a count with an optional K, M or G suffix (powers of 1024)
+static size_t parse_size(const string& s) {
+    size_t pos = 0;
+    const size_t n = stoul(s, &pos);
+    const string suffix = s.substr(pos);
+    if (suffix.empty()) {
+        return n;
+    }
+    if (suffix.size() == 1) {
+        switch (suffix[0]) {
+            case 'K': case 'k': return n << 10;
+            case 'M': case 'm': return n << 20;
+            case 'G': case 'g': return n << 30;
+        }
+    }
+    throw invalid_argument("bad size " + s);
+}
 
-    unordered_set<size_t> extract_features(const string_view text) {
-        deque<string_view> window;
-        unordered_set<size_t> indices;
+static void describe_oversized(const LSHIndex::OversizedBuckets& o) {
+    if (o.buckets != 0) {
+        cerr << "oversized buckets: " << o.buckets << " chained (" << o.members << " members, largest " << o.largest
+             << "), " << o.pairs_skipped << " pairs skipped\n";
+    }
+}
+
+// Read every document of path into dedup, through the pipeline if asked.
+// With a checkpoint, reading starts where it left off and the signatures are
+// checkpointed between windows and at the end.
+static void add_file(Deduplicator& dedup, const string& path, CorpusFormat format, const string& field, bool pipeline,
+                     RunInfo& info, Checkpoint* checkpoint = nullptr) {
+    CorpusReader reader(path, format, field);
+    if (checkpoint != nullptr) {
+        reader.seek(checkpoint->input_offset());
+        vector<string_view> docs;
+        while (reader.next_batch(docs)) {
+            dedup.add(docs);
+            checkpoint->signed_to(dedup, reader.offset());
+        }
+        checkpoint->signed_to(dedup, reader.offset(), true);
+    } else if (pipeline) {
+        info.pipelined = true;
+        info.pipeline = dedup.add_stream([&](vector<string_view>& docs) { return reader.next_batch(docs); });
+        info.pipeline.describe(cerr);
+    } else {
+        vector<string_view> docs;
+        while (reader.next_batch(docs)) {
+            dedup.add(docs);
+        }
+    }
+}
 
-        TokenGen splitter(text, nonalnum_);
-        while (splitter) {
-            const auto token = splitter();
-            window.emplace_back(token);
+struct ShardOptions {
+    string step;  // sign, join, merge or label; empty for an ordinary run
+    string dir;
+    size_t shards = 0;
+    size_t index = 0;
+};
 
-            if (window.size() > ngrams_) {
-                window.pop_front();
-            }
-            if (window.size() == ngrams_) {
-                string combined;
-                for (const auto& w : window) {
-                    combined += w;
-                    combined += "_";
-                }
-
-                uint32_t h{};
-                MurmurHash3_x86_32(combined.data(), combined.size(), 0, &h);
-                indices.insert(h % num_features_);
+// One step of a sharded run (see shard.h).  Each node passes the same
+// --shards, --shard-dir and signature options; --shard is its partition for
+// sign and label and its hash slice for join.
+static int run_shard(const ShardOptions& opt, Deduplicator& dedup, const string& path, CorpusFormat format,
+                     const string& field, bool pipeline, const string& clusters_path, const string& keep_path,
+                     bool binary) {
+    if (opt.dir.empty() || opt.shards == 0 || opt.index >= opt.shards) {
+        throw invalid_argument("sharded run needs --shard-dir, --shards N and --shard I < N");
+    }
+    if (opt.step == "sign") {
+        if (path.empty()) {
+            throw invalid_argument("--step sign needs the partition FILE");
+        }
+        RunInfo info;
+        add_file(dedup, path, format, field, pipeline, info);
+        const string part = shard::part_path(opt.dir, opt.index);
+        dedup.save(part);
+        cerr << "shard " << opt.index << ": " << dedup.size() << " documents signed into " << part << "\n";
+    } else if (opt.step == "join") {
+        const shard::Parts parts(opt.dir, opt.shards);
+        if (parts.params() != dedup.params()) {
+            throw runtime_error(opt.dir + ": parts were built with different parameters");
+        }
+        const auto stats =
+            shard::join(parts, opt.dir, opt.index, opt.shards, dedup.threshold(), dedup.pool(),
+                        dedup.index().max_bucket(), dedup.cardinality_pruning());
+        cerr << "slice " << opt.index << " of " << opt.shards << ": " << stats.candidates << " candidate pairs, "
+             << stats.duplicates << " duplicates, " << stats.edges << " forest edges\n";
+        describe_oversized(stats.oversized);
+    } else if (opt.step == "merge") {
+        const size_t merged = shard::merge(opt.dir, opt.shards);
+        cerr << "merge: " << merged << " documents have an earlier duplicate\n";
+    } else if (opt.step == "label") {
+        if (clusters_path.empty() && keep_path.empty()) {
+            throw invalid_argument("--step label needs --clusters or --keep");
+        }
+        const shard::Parts parts(opt.dir, opt.shards);
+        const shard::MappedForest roots(shard::roots_path(opt.dir));
+        const auto labels = shard::labels(parts, roots, opt.index);
+        const shard::GlobalId first = parts.offset(opt.index);
+        if (!clusters_path.empty()) {
+            write_clusters(clusters_path, labels, binary, first);
+        }
+        if (!keep_path.empty()) {
+            write_keep(keep_path, labels, binary, first);
+        }
+    } else {
+        throw invalid_argument("unknown --step " + opt.step);
+    }
+    return 0;
+}
+
+// Feed documents one at a time through an OnlineDeduplicator with room for
+// capacity of them, printing each one that matches an earlier document and the
+// per-document latency to stderr
+static int run_online(const Deduplicator& dedup, size_t capacity, const string& path, CorpusFormat format,
+                      const string& field, const vector<string_view>& sample) {
+    using clock = chrono::steady_clock;
+    OnlineDeduplicator online(dedup, capacity);
+    vector<double> latency;
+    uint64_t id = 0;
+    const auto feed = [&](const vector<string_view>& docs) {
+        for (const auto doc : docs) {
+            const auto start = clock::now();
+            uint64_t match = 0;
+            const bool found = online.insert_or_match(id, doc, &match);
+            latency.emplace_back(chrono::duration<double, micro>(clock::now() - start).count());
+            if (found) {
+                cout << "Duplicate of earlier document: " << match << " " << id << "\n";
             }
+            ++id;
         }
+    };
+    if (path.empty()) {
+        feed(sample);
+    } else {
+        CorpusReader reader(path, format, field);
+        vector<string_view> docs;
+        while (reader.next_batch(docs)) {
+            feed(docs);
+        }
+    }
+    sort(latency.begin(), latency.end());
+    const auto percentile = [&](double p) {
+        return latency.empty() ? 0.0 : latency[min(latency.size() - 1, static_cast<size_t>(p * latency.size()))];
+    };
+    cerr << "online: " << online.size() << " of " << id << " documents inserted, latency p50 " << percentile(0.5)
+         << " us, p99 " << percentile(0.99) << " us\n";
+    return 0;
+}
+
+static int usage(const char* argv0) {
+    cerr << "usage: " << argv0 << " [--jsonl] [--field NAME] [--threads N] [--concat-shingles]\n"
+         << "       [--ngrams N] [--num-hashes N] [--threshold D] [--num-features N]\n"
+         << "       [--bands B] [--rows R] [--auto-tune [--max-fn A] [--max-fp A] [--tune-sample N]]\n"
+         << "       [--utf8 | --utf8-chars] [--fold-case] [--nfkc] [--feature-hash NAME]\n"
+         << "       [--oph] [--device NAME] [--bits 32|16|8] [--load INDEX] [--save INDEX] [--clusters OUT]\n"
+         << "       [--output OUT] [--keep OUT] [--binary] [--pipeline] [--no-exact] [--no-size-prune] [--max-bucket N]\n"
+         << "       [--report OUT] [--mem SIZE [--spill-dir DIR]] [--pairs OUT]\n"
+         << "       [--pairs-format text|tsv|binary|arrow] [--numa]\n"
+         << "       [--step sign|join|merge|label --shard-dir DIR --shards N --shard I]\n"
+         << "       [--checkpoint DIR [--checkpoint-interval SECONDS]] [--online N] [FILE]\n"
+         << "  Deduplicates FILE, one document per line (or one JSON object per line with\n"
+         << "  --jsonl, reading the string field NAME, default \"text\").  Prints the\n"
+         << "  0-based line numbers of duplicate pairs.  Without FILE a built-in sample is used.\n"
+         << "  --ngrams (default 3) tokens make a shingle, hashed into --num-features (default\n"
+         << "  262144) features; signatures have --num-hashes values (default 13, or B * R).\n"
+         << "  Pairs whose estimated Jaccard distance is below --threshold (default 0.3) are\n"
+         << "  duplicates, and candidates have equal values in one of --bands (default all) bands\n"
+         << "  of --rows (default 1) values.  --output writes the pairs to OUT instead of stdout.\n"
+         << "  --auto-tune picks the fewest hashes and their banding whose S-curve areas of\n"
+         << "  missed duplicates and needless candidates are within --max-fn (default 0.01) and\n"
+         << "  --max-fp (default 0.1), trying up to --num-hashes (default 128) hashes; with\n"
+         << "  --tune-sample it instead times each such banding on N random documents of FILE\n"
+         << "  and picks the quickest for the whole corpus.  It prints the options and choice.\n"
+         << "  --threads defaults to one worker per hardware thread.  --concat-shingles hashes\n"
+         << "  shingles the original (slower) way, reproducing older feature indices.\n"
+         << "  --utf8 splits UTF-8 words instead of ASCII alphanumeric runs, with one token per\n"
+         << "  character for scripts written without spaces; --utf8-chars makes every character\n"
+         << "  a token (character shingles).  --fold-case and --nfkc lower-case and normalize\n"
+         << "  compatibility forms (fullwidth, ligatures) of UTF-8 tokens.\n"
+         << "  --feature-hash hashes tokens with murmur3_x86_32 (the default), murmur3_x64_128\n"
+         << "  or wyhash, the fastest on 64-bit CPUs.\n"
+         << "  --oph computes signatures by one permutation hashing, one hash per feature\n"
+         << "  instead of one per signature value.\n"
+         << "  --device signs the workers' feature sets in CSR batches on backend NAME instead of\n"
+         << "  on the CPU kernels, with the same signatures; \"host\" runs the device kernel on\n"
+         << "  the CPU and is the only backend in this build.\n"
+         << "  --bits truncates stored signature values (b-bit MinHash) to save memory.\n"
+         << "  --load starts from a saved index and only reports pairs involving new documents,\n"
+         << "  whose ids continue after the indexed ones; --save writes the index at the end.\n"
+         << "  --clusters writes \"doc<TAB>cluster\" for every document and --keep the ids of one\n"
+         << "  representative per cluster, instead of printing pairs; --binary writes both as\n"
+         << "  little-endian uint32 arrays.\n"
+         << "  --pipeline overlaps reading, signing and indexing FILE in bounded queues and\n"
+         << "  prints per-stage timings and queue occupancy to stderr.\n"
+         << "  --numa pins workers to the CPUs of the NUMA nodes in contiguous blocks, steals\n"
+         << "  work within a node first, and interleaves memory pages over the nodes used.\n"
+         << "  --no-exact signs byte-identical documents separately instead of copying the\n"
+         << "  signature of the first one.\n"
+         << "  --no-size-prune compares the signatures of every candidate pair, including\n"
+         << "  those whose feature-set sizes alone put them below the similarity threshold.\n"
+         << "  --max-bucket pairs each member of an LSH bucket with more than N documents only\n"
+         << "  with the bucket's first member and its predecessor, instead of with every other.\n"
+         << "  --mem generates candidates by sorting LSH band entries in runs on disk within\n"
+         << "  about SIZE bytes (K, M or G suffix) besides the signatures, instead of keeping\n"
+         << "  bucket tables in memory; runs go to DIR, default $TMPDIR or /tmp.\n"
+         << "  --pairs writes duplicate pairs to OUT (- for stdout) from every worker as they are\n"
+         << "  verified, in no particular order, instead of printing them sorted at the end.\n"
+         << "  --pairs-format encodes them as the printed lines (text), \"id_a<TAB>id_b<TAB>score\"\n"
+         << "  lines (tsv), 16-byte records after a header (binary), or an Arrow IPC stream.\n"
+         << "  --checkpoint saves the signatures of FILE and the clustering progress to DIR at\n"
+         << "  most every SECONDS (default 300), and a rerun with the same DIR, FILE and options\n"
+         << "  resumes from the last checkpoint with the same output as an uninterrupted run.\n"
+         << "  --report writes a JSON summary of the run: parameters, document and output\n"
+         << "  counts, phase timings, and (in -DDEDUP_INSTRUMENT builds) per-stage timers and\n"
+         << "  LSH bucket counters.\n"
+         << "  --step runs one step of a sharded run over N partitions whose files share DIR:\n"
+         << "  every node I runs sign on partition FILE, then join on hash slice I, one node\n"
+         << "  runs merge, and every node runs label to write --clusters / --keep for its\n"
+         << "  partition.  Documents are numbered across partitions in shard order; --binary\n"
+         << "  writes uint64 ids.\n"
+         << "  --online inserts documents one at a time into an index with room for N of them,\n"
+         << "  printing each that matches an earlier one, and the p50 / p99 latency per document.\n";
+    return 2;
+}
 
-        return indices;
+static int run(int argc, char** argv) {
+    CorpusFormat format = CorpusFormat::kText;
+    string field = "text";
+    string path;
+    size_t threads = 0;
+    auto shingle_hash = ShingleHash::kRolling;
+    auto engine = SignatureEngine::kMinHash;
+    string device;
+    auto tokenizer = Tokenizer::kBytes;
+    auto feature_hash = FeatureHash::kMurmur32;
+    bool fold_case = false, normalize = false;
+    unsigned bits = 32;
+    size_t ngrams = 3, num_hashes = 0, num_features = 262144, bands = 0, rows = 0;
+    double threshold = 0.3;
+    bool auto_tune = false;
+    tuner::Targets targets;
+    size_t tune_sample = 0;
+    string load_path, save_path, clusters_path, keep_path, report_path, pairs_path, output_path;
+    auto pairs_format = ResultFormat::kText;
+    bool binary = false;
+    bool pipeline = false;
+    bool exact = true;
+    bool numa_placement = false;
+    bool cardinality_pruning = true;
+    size_t max_bucket = 0;
+    size_t online = 0;
+    size_t memory = 0;
+    string spill_dir;
+    string checkpoint_dir;
+    double checkpoint_interval = 300;
+    ShardOptions shard_opt;
+    for (int i = 1; i < argc; ++i) {
+        const string_view arg = argv[i];
+        if (arg == "--jsonl") {
+            format = CorpusFormat::kJsonl;
+        } else if (arg == "--field" && i + 1 < argc) {
+            field = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--ngrams" && i + 1 < argc) {
+            ngrams = stoul(argv[++i]);
+        } else if (arg == "--num-hashes" && i + 1 < argc) {
+            num_hashes = stoul(argv[++i]);
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            threshold = stod(argv[++i]);
+        } else if (arg == "--num-features" && i + 1 < argc) {
+            num_features = stoul(argv[++i]);
+        } else if (arg == "--bands" && i + 1 < argc) {
+            bands = stoul(argv[++i]);
+        } else if (arg == "--rows" && i + 1 < argc) {
+            rows = stoul(argv[++i]);
+        } else if (arg == "--auto-tune") {
+            auto_tune = true;
+        } else if (arg == "--max-fn" && i + 1 < argc) {
+            targets.max_fn = stod(argv[++i]);
+        } else if (arg == "--max-fp" && i + 1 < argc) {
+            targets.max_fp = stod(argv[++i]);
+        } else if (arg == "--tune-sample" && i + 1 < argc) {
+            tune_sample = stoul(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--bits" && i + 1 < argc) {
+            bits = static_cast<unsigned>(stoul(argv[++i]));
+        } else if (arg == "--load" && i + 1 < argc) {
+            load_path = argv[++i];
+        } else if (arg == "--save" && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (arg == "--clusters" && i + 1 < argc) {
+            clusters_path = argv[++i];
+        } else if (arg == "--keep" && i + 1 < argc) {
+            keep_path = argv[++i];
+        } else if (arg == "--pairs" && i + 1 < argc) {
+            pairs_path = argv[++i];
+        } else if (arg == "--pairs-format" && i + 1 < argc) {
+            pairs_format = parse_result_format(argv[++i]);
+        } else if (arg == "--report" && i + 1 < argc) {
+            report_path = argv[++i];
+        } else if (arg == "--max-bucket" && i + 1 < argc) {
+            max_bucket = stoul(argv[++i]);
+        } else if (arg == "--feature-hash" && i + 1 < argc) {
+            feature_hash = parse_feature_hash(argv[++i]);
+        } else if (arg == "--mem" && i + 1 < argc) {
+            memory = parse_size(argv[++i]);
+        } else if (arg.substr(0, 6) == "--mem=") {
+            memory = parse_size(string(arg.substr(6)));
+        } else if (arg == "--spill-dir" && i + 1 < argc) {
+            spill_dir = argv[++i];
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint_dir = argv[++i];
+        } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            checkpoint_interval = stod(argv[++i]);
+        } else if (arg == "--online" && i + 1 < argc) {
+            online = stoul(argv[++i]);
+        } else if (arg == "--step" && i + 1 < argc) {
+            shard_opt.step = argv[++i];
+        } else if (arg == "--shard-dir" && i + 1 < argc) {
+            shard_opt.dir = argv[++i];
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shard_opt.shards = stoul(argv[++i]);
+        } else if (arg == "--shard" && i + 1 < argc) {
+            shard_opt.index = stoul(argv[++i]);
+        } else if (arg == "--binary") {
+            binary = true;
+        } else if (arg == "--pipeline") {
+            pipeline = true;
+        } else if (arg == "--no-size-prune") {
+            cardinality_pruning = false;
+        } else if (arg == "--numa") {
+            numa_placement = true;
+        } else if (arg == "--no-exact") {
+            exact = false;
+        } else if (arg == "--concat-shingles") {
+            shingle_hash = ShingleHash::kConcat;
+        } else if (arg == "--utf8") {
+            tokenizer = Tokenizer::kUtf8Words;
+        } else if (arg == "--utf8-chars") {
+            tokenizer = Tokenizer::kUtf8Chars;
+        } else if (arg == "--fold-case") {
+            fold_case = true;
+        } else if (arg == "--nfkc") {
+            normalize = true;
+        } else if (arg == "--oph") {
+            engine = SignatureEngine::kOph;
+        } else if (arg == "--device" && i + 1 < argc) {
+            device = argv[++i];
+        } else if (!arg.empty() && arg[0] != '-' && path.empty()) {
+            path = arg;
+        } else {
+            return usage(argv[0]);
+        }
     }
-};
 
-int main() {
     const vector<string_view> data = {
         "Since 2000, the Vatreni have qualified for every major tournament except UEFA Euro 2000 and the 2010 FIFA World Cup. At the World Cup, Croatia has finished second once (2018) and third on two occasions (1998, 2022), securing three World Cup medals. Davor Šuker won the Golden Shoe and the Silver Ball in 1998, while Luka Modrić won the Golden Ball in 2018 and the Bronze Ball in 2022. The team has reached the quarter-finals of the UEFA European Championship twice (1996, 2008). They finished second in the UEFA Nations League in 2023.",
         "Since 2000, the Vatreni have not qualified for every minor tournament except for the 2010 FIFA World Cup. At the World Cup, Croatia has finished second once (2018) and third on two occasions (1998, 2022), securing three World Cup medals. Davor Šuker won the Golden Shoe and the Silver Ball in 1998, while Luka Modrić won the Golden Ball in 2018 and the Bronze Ball in 2022. The team has not reached the quarter-finals of the UEFA European Championship twice (1996, 2008). They finished third in the UEFA Nations League in 2023.",
@@ -182,10 +641,206 @@ int main() {
         // "AAAA,,,,,,|| ||",
     };
 
+    if (!(threshold > 0 && threshold < 1)) {
+        throw invalid_argument("--threshold must be a Jaccard distance between 0 and 1");
+    }
+    if (!device.empty() && (engine == SignatureEngine::kOph || online != 0)) {
+        throw invalid_argument("--device signs MinHash batches and cannot be combined with --oph or --online");
+    }
+    // Everything but the sizes, shared by the run's deduplicator and the
+    // tuner's trial ones
+    const auto configure = [&](Deduplicator& d) {
+        d.set_tokenizer(tokenizer, fold_case, normalize);
+        d.set_shingle_hash(shingle_hash);
+        d.set_feature_hash(feature_hash);
+        d.set_signature_engine(engine);
+        if (!device.empty()) {
+            d.set_device(device);
+        }
+        d.set_signature_bits(bits);
+        d.set_exact_prefilter(exact);
+        d.set_cardinality_pruning(cardinality_pruning);
+        d.set_max_bucket(max_bucket);
+    };
+    if (auto_tune) {
+        if (bands != 0 || rows != 0) {
+            throw invalid_argument("--auto-tune chooses --bands and --rows itself");
+        }
+        targets.similarity = 1.0 - threshold;
+        if (num_hashes != 0) {
+            targets.max_hashes = num_hashes;
+        }
+        auto options = tuner::frontier(targets);
+        if (options.empty()) {
+            options = {tuner::closest(targets)};
+            cerr << "auto-tune: no banding of at most " << targets.max_hashes << " hashes has fn <= " << targets.max_fn
+                 << " and fp <= " << targets.max_fp << ", using the closest\n";
+        } else if (tune_sample != 0 && !path.empty()) {
+            const auto sample = tuner::sample(path, format, field, tune_sample);
+            cerr << "auto-tune: timing " << options.size() << " bandings on " << sample.docs.size() << " of "
+                 << sample.corpus_docs << " documents\n";
+            tuner::estimate(options, sample, [&](size_t hashes, size_t b, size_t r) {
+                auto d = make_unique<Deduplicator>(ngrams, hashes, threshold, num_features, b, r, threads);
+                configure(*d);
+                return d;
+            });
+        }
+        tuner::describe(cerr, options);
+        const auto chosen = tuner::choose(options);
+        bands = chosen.bands;
+        rows = chosen.rows;
+        num_hashes = chosen.hashes();
+        cerr << "auto-tune: --num-hashes " << num_hashes << " --bands " << bands << " --rows " << rows << "\n";
+    }
     // 262144 is default in https://spark.apache.org/docs/latest/api/python/reference/api/pyspark.ml.feature.HashingTF.html
     // Should be a power of 2
-    Deduplicator dedup(3, 13, 0.3, 262144);
-    dedup.process(data);
+    // 13 hashes only split evenly into 13 bands of 1 row, which favours recall
+    if (rows == 0) {
+        rows = 1;
+    }
+    if (num_hashes == 0) {
+        num_hashes = bands != 0 ? bands * rows : 13;
+    }
+    if (bands == 0) {
+        bands = num_hashes / rows;
+    }
+
+    // The memory policy is inherited by threads started afterwards, so it is
+    // set before the workers are
+    RunInfo info;
+    if (numa_placement) {
+        const size_t workers = threads != 0 ? threads : max(1u, thread::hardware_concurrency());
+        info.numa = numa::detect().first(workers);
+        info.interleaved = info.numa.nodes.size() > 1 && numa::interleave(info.numa);
+    }
+    Deduplicator dedup(ngrams, num_hashes, threshold, num_features, bands, rows, threads);
+    if (numa_placement) {
+        dedup.set_numa_placement(info.numa);
+        const auto workers = dedup.workers_per_node();
+        cerr << "numa: " << workers.size() << " node(s), workers";
+        for (size_t n = 0; n < workers.size(); ++n) {
+            cerr << (n == 0 ? " " : " + ") << workers[n];
+        }
+        cerr << (info.interleaved ? ", pages interleaved\n" : "\n");
+    }
+    configure(dedup);
+    if (memory != 0 && !save_path.empty()) {
+        throw invalid_argument("--save keeps bucket tables in memory and cannot be combined with --mem");
+    }
+    dedup.set_memory_budget(memory, spill_dir);
+    if (!checkpoint_dir.empty() && (path.empty() || !load_path.empty() || pipeline || !shard_opt.step.empty() ||
+                                    online != 0)) {
+        throw invalid_argument("--checkpoint needs FILE and cannot be combined with --load, --pipeline, --step or "
+                               "--online");
+    }
+    dedup.index().describe(cerr, 1.0 - threshold);
+
+    using clock = chrono::steady_clock;
+    const auto seconds_since = [](clock::time_point t) { return chrono::duration<double>(clock::now() - t).count(); };
+    const auto start = clock::now();
 
+    if (!shard_opt.step.empty()) {
+        return run_shard(shard_opt, dedup, path, format, field, pipeline, clusters_path, keep_path, binary);
+    }
+    if (online != 0) {
+        return run_online(dedup, online, path, format, field, data);
+    }
+
+    const bool cluster_output = !clusters_path.empty() || !keep_path.empty();
+    if (path.empty() && load_path.empty() && !cluster_output && report_path.empty()) {
+        dedup.process(data);
+        if (!save_path.empty()) {
+            dedup.save(save_path);
+        }
+        return 0;
+    }
+
+    info.input = path;
+    info.format = format;
+    info.loaded_index = load_path;
+    info.clusters = cluster_output;
+    if (!load_path.empty()) {
+        dedup.load(load_path);
+    }
+    info.since = static_cast<DocId>(dedup.size());
+    const auto since = info.since;
+    auto phase = clock::now();
+    unique_ptr<Checkpoint> checkpoint;
+    if (!checkpoint_dir.empty()) {
+        checkpoint = make_unique<Checkpoint>(checkpoint_dir, checkpoint_interval, CorpusReader(path, format).size());
+        if (checkpoint->resume(dedup)) {
+            cerr << "checkpoint: resuming at byte " << checkpoint->input_offset() << " with " << checkpoint->docs()
+                 << " documents signed";
+            if (!checkpoint->labels().empty()) {
+                cerr << " and " << checkpoint->merged() << " candidate pairs merged";
+            }
+            cerr << "\n";
+        }
+    }
+    if (!path.empty()) {
+        add_file(dedup, path, format, field, pipeline, info, checkpoint.get());
+    } else if (load_path.empty()) {
+        dedup.add(data);
+    }
+    info.add_seconds = seconds_since(phase);
+    cerr << "exact duplicates: " << dedup.exact_duplicates() << " of " << dedup.size() - since
+         << " documents copied a signature\n";
+
+    phase = clock::now();
+    if (cluster_output) {
+        const auto labels = checkpoint ? dedup.clusters(since, checkpoint->labels(), checkpoint->merged(),
+                                                        checkpoint->hook(dedup))
+                                       : dedup.clusters(since);
+        for (size_t i = 0; i < labels.size(); ++i) {
+            info.representatives += labels[i] == i;
+        }
+        if (!clusters_path.empty()) {
+            write_clusters(clusters_path, labels, binary);
+        }
+        if (!keep_path.empty()) {
+            write_keep(keep_path, labels, binary);
+        }
+    } else if (!pairs_path.empty()) {
+        // Written by the workers as they verify, unsorted
+        auto sink = pairs_path == "-" ? make_unique<ResultSink>(STDOUT_FILENO, pairs_format, dedup.threads())
+                                      : make_unique<ResultSink>(pairs_path, pairs_format, dedup.threads());
+        dedup.duplicates(*sink, since);
+        sink->close();
+        info.pairs = sink->results();
+    } else {
+        const auto pairs = dedup.duplicates(since);
+        info.pairs = pairs.size();
+        auto sink = output_path.empty() ? make_unique<ResultSink>(STDOUT_FILENO, pairs_format, 1)
+                                        : make_unique<ResultSink>(output_path, pairs_format, 1);
+        ResultSink::Buffer& out = sink->buffer(0);
+        for (const auto& [i, j, similarity] : pairs) {
+            out.add(i, j, similarity);
+        }
+        sink->close();
+    }
+    info.match_seconds = seconds_since(phase);
+    info.oversized = dedup.oversized();
+    if (dedup.memory_budget() != 0) {
+        const auto& js = dedup.join_stats();
+        cerr << "external join: " << js.entries << " band entries in " << js.runs << " runs, "
+             << js.spilled_bytes / (1 << 20) << " MiB spilled, " << js.candidates << " candidate pairs\n";
+    }
+    describe_oversized(info.oversized);
+    if (!save_path.empty()) {
+        dedup.save(save_path);
+    }
+    if (!report_path.empty()) {
+        info.total_seconds = seconds_since(start);
+        write_report(report_path, dedup, info);
+    }
     return 0;
 }
+
+int main(int argc, char** argv) {
+    try {
+        return run(argc, argv);
+    } catch (const exception& e) {
+        cerr << argv[0] << ": " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,188 @@
+#ifndef DEDUP_MATCH_KERNELS_H_
+#define DEDUP_MATCH_KERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEDUP_X86_MATCH_KERNELS 1
+#endif
+
+// Signature comparison kernels: the number of lanes in which two rows of n
+// values of type T (uint8_t, uint16_t or uint32_t) agree.
+//
+// With need > 0 a kernel may stop once fewer than need matches are still
+// possible, i.e. once matches so far + lanes left < need.  The result is then
+// some count below need; any result >= need is exact.  Checks happen after
+// every vector of at most kCheckBytes (8 lanes at 32 bits), and in the scalar
+// kernel every kCheckBytes of lanes, so even a 13-hash signature can stop
+// after its first vector.
+namespace match_kernels {
+
+constexpr size_t kCheckBytes = 32;
+
+using Kernel = size_t (*)(const uint8_t* a, const uint8_t* b, size_t n, size_t need);
+
+template <typename T>
+size_t scalar(const uint8_t* a, const uint8_t* b, size_t n, size_t need) {
+    constexpr size_t step = kCheckBytes / sizeof(T);
+    const auto equal = [&](size_t i) {
+        T x, y;
+        std::memcpy(&x, a + i * sizeof(T), sizeof(T));
+        std::memcpy(&y, b + i * sizeof(T), sizeof(T));
+        return x == y;
+    };
+    size_t match = 0, done = 0;
+    // No check can stop the pair while the lanes left alone could reach need
+    for (const size_t free = need < n ? n - need : 0; done < free; ++done) {
+        match += equal(done);
+    }
+    while (done < n) {
+        for (const size_t end = done + step < n ? done + step : n; done < end; ++done) {
+            match += equal(done);
+        }
+        if (match + (n - done) < need) {
+            return match;
+        }
+    }
+    return match;
+}
+
+#ifdef DEDUP_X86_MATCH_KERNELS
+
+template <typename T>
+__attribute__((target("avx2"))) inline __m256i eq256(__m256i x, __m256i y) {
+    if constexpr (sizeof(T) == 1) {
+        return _mm256_cmpeq_epi8(x, y);
+    } else if constexpr (sizeof(T) == 2) {
+        return _mm256_cmpeq_epi16(x, y);
+    } else {
+        return _mm256_cmpeq_epi32(x, y);
+    }
+}
+
+template <typename T>
+__attribute__((target("avx2"))) inline __m128i eq128(__m128i x, __m128i y) {
+    if constexpr (sizeof(T) == 1) {
+        return _mm_cmpeq_epi8(x, y);
+    } else if constexpr (sizeof(T) == 2) {
+        return _mm_cmpeq_epi16(x, y);
+    } else {
+        return _mm_cmpeq_epi32(x, y);
+    }
+}
+
+// The n lanes after the last 32-byte vector (n * sizeof(T) < 32), in 16- and
+// 8-byte vectors, so that short signatures (13 hashes are 52 bytes at 32
+// bits) are compared with at most one lane left to the scalar loop
+template <typename T, bool kPrune>
+__attribute__((target("avx2,popcnt"))) inline size_t avx2_tail(const uint8_t* a, const uint8_t* b, size_t n,
+                                                              size_t need) {
+    const size_t bytes = n * sizeof(T), need_bits = kPrune ? need * sizeof(T) : 0;
+    size_t bits = 0, v = 0;
+    if (v + 16 <= bytes) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + v));
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + v));
+        bits += _mm_popcnt_u32(static_cast<uint32_t>(_mm_movemask_epi8(eq128<T>(x, y))));
+        v += 16;
+        if (kPrune && bits + (bytes - v) < need_bits) {
+            return bits / sizeof(T);
+        }
+    }
+    if (v + 8 <= bytes) {
+        // Only the low 8 bytes are loaded, and the zeroed upper ones masked off
+        const __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + v));
+        const __m128i y = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + v));
+        bits += _mm_popcnt_u32(static_cast<uint32_t>(_mm_movemask_epi8(eq128<T>(x, y))) & 0xFF);
+        v += 8;
+        if (kPrune && bits + (bytes - v) < need_bits) {
+            return bits / sizeof(T);
+        }
+    }
+    const size_t match = bits / sizeof(T);
+    return match + scalar<T>(a + v, b + v, (bytes - v) / sizeof(T), kPrune && need > match ? need - match : 0);
+}
+
+// Equal lanes set sizeof(T) bytes of the byte mask, so its popcount, the
+// bytes left and need * sizeof(T) all count lanes times sizeof(T).  Without
+// kPrune the checks are compiled out; both are inlined into avx2(), since an
+// out-of-line call costs as much as the checks save on short rows.
+template <typename T, bool kPrune>
+__attribute__((target("avx2,popcnt"), always_inline)) inline size_t avx2_count(const uint8_t* a, const uint8_t* b,
+                                                                              size_t n, size_t need) {
+    const size_t bytes = n * sizeof(T), need_bits = kPrune ? need * sizeof(T) : 0;
+    size_t bits = 0, v = 0;
+    // While the lanes left alone could reach need no check can stop the pair,
+    // so those vectors go two at a time with one popcount for both masks
+    for (; v + 64 + need_bits <= bytes; v += 64) {
+        const __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + v));
+        const __m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + v));
+        const __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + v + 32));
+        const __m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + v + 32));
+        const uint64_t lo = static_cast<uint32_t>(_mm256_movemask_epi8(eq256<T>(x0, y0)));
+        const uint64_t hi = static_cast<uint32_t>(_mm256_movemask_epi8(eq256<T>(x1, y1)));
+        bits += static_cast<size_t>(_mm_popcnt_u64(lo | hi << 32));
+    }
+    if (kPrune && v + 32 + need_bits <= bytes) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + v));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + v));
+        bits += _mm_popcnt_u32(static_cast<uint32_t>(_mm256_movemask_epi8(eq256<T>(x, y))));
+        v += 32;
+    }
+    for (; v + 32 <= bytes; v += 32) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + v));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + v));
+        bits += _mm_popcnt_u32(static_cast<uint32_t>(_mm256_movemask_epi8(eq256<T>(x, y))));
+        if (kPrune && bits + (bytes - v - 32) < need_bits) {
+            return bits / sizeof(T);
+        }
+    }
+    const size_t match = bits / sizeof(T);
+    return match + avx2_tail<T, kPrune>(a + v, b + v, (bytes - v) / sizeof(T), need > match ? need - match : 0);
+}
+
+template <typename T>
+__attribute__((target("avx2,popcnt"))) size_t avx2(const uint8_t* a, const uint8_t* b, size_t n, size_t need) {
+    return need == 0 ? avx2_count<T, false>(a, b, n, 0) : avx2_count<T, true>(a, b, n, need);
+}
+
+#endif  // DEDUP_X86_MATCH_KERNELS
+
+struct Entry {
+    const char* name;
+    Kernel fn;
+};
+
+// Kernels for values of bits width usable on this machine, best first
+inline std::vector<Entry> available(unsigned bits) {
+    std::vector<Entry> kernels;
+#ifdef DEDUP_X86_MATCH_KERNELS
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        switch (bits) {
+            case 32: kernels.push_back({"avx2", avx2<uint32_t>}); break;
+            case 16: kernels.push_back({"avx2", avx2<uint16_t>}); break;
+            default: kernels.push_back({"avx2", avx2<uint8_t>}); break;
+        }
+    }
+#endif
+    switch (bits) {
+        case 32: kernels.push_back({"scalar", scalar<uint32_t>}); break;
+        case 16: kernels.push_back({"scalar", scalar<uint16_t>}); break;
+        default: kernels.push_back({"scalar", scalar<uint8_t>}); break;
+    }
+    return kernels;
+}
+
+inline const Entry& best(unsigned bits) {
+    static const Entry e32 = available(32).front();
+    static const Entry e16 = available(16).front();
+    static const Entry e8 = available(8).front();
+    return bits == 32 ? e32 : bits == 16 ? e16 : e8;
+}
+
+}  // namespace match_kernels
+
+#endif  // DEDUP_MATCH_KERNELS_H_
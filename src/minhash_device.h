@@ -0,0 +1,181 @@
+#ifndef DEDUP_MINHASH_DEVICE_H_
+#define DEDUP_MINHASH_DEVICE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./minhash_family.h"
+
+// MinHash signatures of CSR batches on an offload device.  A batch is cut
+// into chunks, and chunks alternate between two slots, each with its own
+// staging buffers: while the device hashes one chunk, the host stages the
+// next and collects the one before, so transfers in both directions overlap
+// the kernel.
+//
+// The device kernel is minhash_kernels::signature_lane() (minhash_family.h,
+// free of CPU intrinsics), whose exact Barrett reduction makes its signatures
+// bit-identical to MinHasher's.  A device backend implements Backend around
+// it and is added to make_backend() once it can be built and checked here;
+// HostBackend runs the lane function on the CPU through the same chunking and
+// slots, and is what such a backend is checked against.
+namespace minhash_device {
+
+// Two slots of staging buffers on the host and the device.  submit() may
+// return before the work is done; wait() returns once the signatures of the
+// slot's last submit() are in host_sigs().
+class Backend {
+   public:
+    virtual ~Backend() = default;
+
+    virtual const char* name() const = 0;
+
+    // Make room in slot for a chunk of docs documents and features features
+    virtual void reserve(int slot, size_t docs, size_t features) = 0;
+
+    // offsets of the chunk's docs + 1 boundaries from 0, its features, and
+    // docs x num_hashes signatures after wait()
+    virtual uint64_t* host_offsets(int slot) = 0;
+    virtual uint32_t* host_features(int slot) = 0;
+    virtual const uint32_t* host_sigs(int slot) const = 0;
+
+    // Copy the staged chunk over, sign it and copy the signatures back
+    virtual void submit(int slot, size_t docs, size_t features) = 0;
+    virtual void wait(int slot) = 0;
+};
+
+// The device kernel run in place on the host
+class HostBackend final : public Backend {
+   public:
+    // num_hashes coefficients of each of a and b, copied
+    HostBackend(const uint32_t* a, const uint32_t* b, size_t num_hashes)
+        : a_(a, a + num_hashes), b_(b, b + num_hashes) {}
+
+    const char* name() const override { return "host"; }
+
+    void reserve(int slot, size_t docs, size_t features) override {
+        Slot& s = slots_[slot];
+        s.offsets.resize(docs + 1);
+        s.features.resize(features);
+        s.sigs.resize(docs * a_.size());
+    }
+
+    uint64_t* host_offsets(int slot) override { return slots_[slot].offsets.data(); }
+    uint32_t* host_features(int slot) override { return slots_[slot].features.data(); }
+    const uint32_t* host_sigs(int slot) const override { return slots_[slot].sigs.data(); }
+
+    void submit(int slot, size_t docs, size_t) override {
+        Slot& s = slots_[slot];
+        const size_t k = a_.size();
+        for (size_t d = 0; d < docs; ++d) {
+            const uint32_t* f = s.features.data() + s.offsets[d];
+            const uint64_t n = s.offsets[d + 1] - s.offsets[d];
+            for (size_t i = 0; i < k; ++i) {
+                s.sigs[d * k + i] = minhash_kernels::signature_lane(a_[i], b_[i], f, n);
+            }
+        }
+    }
+
+    void wait(int) override {}
+
+   private:
+    struct Slot {
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> features;
+        std::vector<uint32_t> sigs;
+    };
+    std::vector<uint32_t> a_;
+    std::vector<uint32_t> b_;
+    Slot slots_[2];
+};
+
+// Names make_backend() takes
+inline std::vector<const char*> backends() { return {"host"}; }
+
+// Backend name with num_hashes coefficients of each of a and b
+inline std::unique_ptr<Backend> make_backend(const std::string& name, const uint32_t* a, const uint32_t* b,
+                                             size_t num_hashes) {
+    if (name == "host") {
+        return std::make_unique<HostBackend>(a, b, num_hashes);
+    }
+    throw std::invalid_argument("unknown signing device: " + name);
+}
+
+// One device shared by threads: calls to compute_signatures() are serialized,
+// so each thread hands over whole batches and extracts the next meanwhile
+class Signer {
+   public:
+    // A chunk holds up to this many documents, and this many features
+    // unless a single document has more
+    static constexpr size_t kChunkDocs = size_t{1} << 14;
+    static constexpr size_t kChunkFeatures = size_t{1} << 24;
+
+    Signer(std::unique_ptr<Backend> backend, size_t num_hashes)
+        : backend_(std::move(backend)), num_hashes_(num_hashes) {
+        if (!backend_) {
+            throw std::invalid_argument("minhash_device::Signer: no backend");
+        }
+    }
+
+    const char* name() const { return backend_->name(); }
+
+    // As MinHasher::compute_signatures(): set d is features[offsets[d],
+    // offsets[d + 1]), and row d of the docs x num_hashes matrix sigs its
+    // signature
+    void compute_signatures(const uint64_t* offsets, const uint32_t* features, size_t docs, uint32_t* sigs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Pending pending[2];
+        int slot = 0;
+        for (size_t d = 0; d < docs;) {
+            size_t end = d + 1;
+            while (end < docs && end - d < kChunkDocs && offsets[end + 1] - offsets[d] <= kChunkFeatures) {
+                ++end;
+            }
+            const size_t n = offsets[end] - offsets[d];
+            // The slot's previous chunk must be collected before its buffers
+            // are staged again; the other slot's stays in flight meanwhile
+            collect(slot, pending[slot]);
+            backend_->reserve(slot, end - d, n);
+            uint64_t* staged = backend_->host_offsets(slot);
+            for (size_t i = d; i <= end; ++i) {
+                staged[i - d] = offsets[i] - offsets[d];
+            }
+            std::memcpy(backend_->host_features(slot), features + offsets[d], n * sizeof(uint32_t));
+            backend_->submit(slot, end - d, n);
+            pending[slot] = {sigs + d * num_hashes_, end - d};
+            slot ^= 1;
+            d = end;
+        }
+        // The older chunk first
+        collect(slot, pending[slot]);
+        collect(slot ^ 1, pending[slot ^ 1]);
+    }
+
+   private:
+    struct Pending {
+        uint32_t* out = nullptr;
+        size_t docs = 0;
+    };
+
+    std::unique_ptr<Backend> backend_;
+    size_t num_hashes_;
+    std::mutex mutex_;
+
+    void collect(int slot, Pending& p) {
+        if (p.docs == 0) {
+            return;
+        }
+        backend_->wait(slot);
+        std::memcpy(p.out, backend_->host_sigs(slot), p.docs * num_hashes_ * sizeof(uint32_t));
+        p = {};
+    }
+};
+
+}  // namespace minhash_device
+
+#endif  // DEDUP_MINHASH_DEVICE_H_
@@ -0,0 +1,53 @@
+#ifndef DEDUP_MINHASH_FAMILY_H_
+#define DEDUP_MINHASH_FAMILY_H_
+
+#include <cstdint>
+
+#if defined(__CUDACC__) || defined(__HIPCC__)
+#define DEDUP_HOST_DEVICE __host__ __device__
+#else
+#define DEDUP_HOST_DEVICE
+#endif
+
+// The Spark MinHash family h_i(x) = ((1 + x) * a_i + b_i) % p, without
+// intrinsics or target attributes, so that device compilers can take it; the
+// CPU kernels are in minhash_kernels.h.
+namespace minhash_kernels {
+
+constexpr uint32_t kPrime = 2038074743;
+
+// floor(2^64 / kPrime), for reduce()
+constexpr uint64_t kBarrett = ~uint64_t{0} / kPrime;
+
+// High 64 bits of x * y
+DEDUP_HOST_DEVICE inline uint64_t mulhi(uint64_t x, uint64_t y) {
+#if defined(__CUDA_ARCH__) || defined(__HIP_DEVICE_COMPILE__)
+    return __umul64hi(x, y);
+#else
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(x) * y) >> 64);
+#endif
+}
+
+// x % kPrime by Barrett reduction, exactly: the quotient estimated from
+// kBarrett is at most one short, so one conditional subtraction fixes it.
+// On GPUs this is a few 32-bit multiplies where % is a long emulated division.
+DEDUP_HOST_DEVICE inline uint32_t reduce(uint64_t x) {
+    uint64_t r = x - mulhi(x, kBarrett) * kPrime;
+    r = r >= kPrime ? r - kPrime : r;
+    return static_cast<uint32_t>(r);
+}
+
+// Lane i of a signature: min over the n features of ((1 + f) * a + b) % p,
+// bit-identical to the CPU kernels
+DEDUP_HOST_DEVICE inline uint32_t signature_lane(uint32_t a, uint32_t b, const uint32_t* features, uint64_t n) {
+    uint32_t m = kPrime;
+    for (uint64_t j = 0; j < n; ++j) {
+        const uint32_t h = reduce((features[j] + uint64_t{1}) * a + b);
+        m = h < m ? h : m;
+    }
+    return m;
+}
+
+}  // namespace minhash_kernels
+
+#endif  // DEDUP_MINHASH_FAMILY_H_
@@ -0,0 +1,333 @@
+#ifndef DEDUP_MINHASH_KERNELS_H_
+#define DEDUP_MINHASH_KERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "./minhash_family.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEDUP_X86_KERNELS 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define DEDUP_NEON_KERNEL 1
+#endif
+
+// Signature kernels for the Spark MinHash family h_i(x) = ((1 + x) * a_i + b_i) % p.
+//
+// A kernel fills sig[i] = min over f in features of ((1 + f) * a[i] + b[i]) % p
+// for every lane i < k.  Features must be below p - 1, so that with a and b
+// also below p < 2^31 the product fits in 62 bits.  The
+// vector kernels form it exactly with 32x32->64 multiplies, estimate the
+// quotient in double precision (off by at most one) and fix the remainder up
+// with a compare, so they are bit-exact with the scalar `%`.
+namespace minhash_kernels {
+
+using Kernel = void (*)(const uint32_t* a, const uint32_t* b, size_t k, const uint32_t* features, size_t n,
+                        uint32_t* sig);
+
+inline void scalar(const uint32_t* a, const uint32_t* b, size_t k, const uint32_t* features, size_t n,
+                   uint32_t* sig) {
+    for (size_t i = 0; i < k; ++i) {
+        uint32_t m = kPrime;
+        for (size_t j = 0; j < n; ++j) {
+            const uint32_t h = static_cast<uint32_t>(((features[j] + uint64_t{1}) * a[i] + b[i]) % kPrime);
+            m = h < m ? h : m;
+        }
+        sig[i] = m;
+    }
+}
+
+#ifdef DEDUP_X86_KERNELS
+
+// One lane block: hash u under four (a, b) pairs and fold into the running min
+__attribute__((target("avx2,fma"))) inline __m256i avx2_step(__m256i m, __m256i u, __m256d fu, __m256i va,
+                                                             __m256i vb, __m256d fa, __m256d fb) {
+    const __m256i p = _mm256_set1_epi64x(kPrime);
+    const __m256i x = _mm256_add_epi64(_mm256_mul_epu32(u, va), vb);
+    const __m256d qd = _mm256_mul_pd(_mm256_fmadd_pd(fu, fa, fb), _mm256_set1_pd(1.0 / kPrime));
+    const __m256i q = _mm256_cvtepu32_epi64(_mm256_cvttpd_epi32(qd));
+    __m256i r = _mm256_sub_epi64(x, _mm256_mul_epu32(q, p));
+    r = _mm256_add_epi64(r, _mm256_and_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), r), p));
+    r = _mm256_sub_epi64(r, _mm256_andnot_si256(_mm256_cmpgt_epi64(p, r), p));
+    return _mm256_blendv_epi8(m, r, _mm256_cmpgt_epi64(m, r));
+}
+
+__attribute__((target("avx2,fma"))) inline void avx2(const uint32_t* a, const uint32_t* b, size_t k,
+                                                      const uint32_t* features, size_t n, uint32_t* sig) {
+    // Gathers the low dword of each qword into the bottom 128 bits
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    // Two independent blocks per pass to hide the multiply latency
+    size_t i = 0;
+    for (; i + 8 <= k; i += 8) {
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 4));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 4));
+        const __m256i va0 = _mm256_cvtepu32_epi64(a0), va1 = _mm256_cvtepu32_epi64(a1);
+        const __m256i vb0 = _mm256_cvtepu32_epi64(b0), vb1 = _mm256_cvtepu32_epi64(b1);
+        const __m256d fa0 = _mm256_cvtepi32_pd(a0), fa1 = _mm256_cvtepi32_pd(a1);
+        const __m256d fb0 = _mm256_cvtepi32_pd(b0), fb1 = _mm256_cvtepi32_pd(b1);
+        __m256i m0 = _mm256_set1_epi64x(kPrime), m1 = m0;
+        for (size_t j = 0; j < n; ++j) {
+            const __m256i u = _mm256_set1_epi64x(features[j] + uint64_t{1});
+            const __m256d fu = _mm256_set1_pd(features[j] + 1.0);
+            m0 = avx2_step(m0, u, fu, va0, vb0, fa0, fb0);
+            m1 = avx2_step(m1, u, fu, va1, vb1, fa1, fb1);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(sig + i),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(m0, pack)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(sig + i + 4),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(m1, pack)));
+    }
+    for (; i + 4 <= k; i += 4) {
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m256i va0 = _mm256_cvtepu32_epi64(a0), vb0 = _mm256_cvtepu32_epi64(b0);
+        const __m256d fa0 = _mm256_cvtepi32_pd(a0), fb0 = _mm256_cvtepi32_pd(b0);
+        __m256i m0 = _mm256_set1_epi64x(kPrime);
+        for (size_t j = 0; j < n; ++j) {
+            const __m256i u = _mm256_set1_epi64x(features[j] + uint64_t{1});
+            m0 = avx2_step(m0, u, _mm256_set1_pd(features[j] + 1.0), va0, vb0, fa0, fb0);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(sig + i),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(m0, pack)));
+    }
+    scalar(a + i, b + i, k - i, features, n, sig + i);
+}
+
+// k fixed at compile time: C independent 4-lane blocks per pass over the
+// features and no tail handling.  Fewer passes re-broadcast each feature fewer
+// times.
+template <size_t K, size_t C = 4>
+__attribute__((target("avx2,fma"))) void avx2_fixed(const uint32_t* a, const uint32_t* b, size_t,
+                                                     const uint32_t* features, size_t n, uint32_t* sig) {
+    static_assert(K % (4 * C) == 0, "K must be a multiple of the lanes per pass");
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    for (size_t i = 0; i < K; i += 4 * C) {
+        __m256i va[C], vb[C], m[C];
+        __m256d fa[C], fb[C];
+        for (size_t c = 0; c < C; ++c) {
+            const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 4 * c));
+            const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 4 * c));
+            va[c] = _mm256_cvtepu32_epi64(a0);
+            vb[c] = _mm256_cvtepu32_epi64(b0);
+            fa[c] = _mm256_cvtepi32_pd(a0);
+            fb[c] = _mm256_cvtepi32_pd(b0);
+            m[c] = _mm256_set1_epi64x(kPrime);
+        }
+        for (size_t j = 0; j < n; ++j) {
+            const __m256i u = _mm256_set1_epi64x(features[j] + uint64_t{1});
+            const __m256d fu = _mm256_set1_pd(features[j] + 1.0);
+            for (size_t c = 0; c < C; ++c) {
+                m[c] = avx2_step(m[c], u, fu, va[c], vb[c], fa[c], fb[c]);
+            }
+        }
+        for (size_t c = 0; c < C; ++c) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(sig + i + 4 * c),
+                             _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(m[c], pack)));
+        }
+    }
+}
+
+// GCC 12 reports the _mm512_undefined_* placeholders inside the intrinsic
+// headers as (maybe-)uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+
+__attribute__((target("avx512f"))) inline __m512i avx512_step(__m512i m, __m512i u, __m512d fu, __m512i va,
+                                                              __m512i vb, __m512d fa, __m512d fb) {
+    const __m512i p = _mm512_set1_epi64(kPrime);
+    const __m512i x = _mm512_add_epi64(_mm512_mul_epu32(u, va), vb);
+    const __m512d qd = _mm512_mul_pd(_mm512_fmadd_pd(fu, fa, fb), _mm512_set1_pd(1.0 / kPrime));
+    const __m512i q = _mm512_cvtepu32_epi64(_mm512_cvttpd_epu32(qd));
+    __m512i r = _mm512_sub_epi64(x, _mm512_mul_epu32(q, p));
+    r = _mm512_mask_add_epi64(r, _mm512_cmplt_epi64_mask(r, _mm512_setzero_si512()), r, p);
+    r = _mm512_mask_sub_epi64(r, _mm512_cmpge_epi64_mask(r, p), r, p);
+    return _mm512_min_epi64(m, r);
+}
+
+__attribute__((target("avx512f"))) inline void avx512(const uint32_t* a, const uint32_t* b, size_t k,
+                                                       const uint32_t* features, size_t n, uint32_t* sig) {
+    size_t i = 0;
+    for (; i + 16 <= k; i += 16) {
+        const __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i + 8));
+        const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i + 8));
+        const __m512i va0 = _mm512_cvtepu32_epi64(a0), va1 = _mm512_cvtepu32_epi64(a1);
+        const __m512i vb0 = _mm512_cvtepu32_epi64(b0), vb1 = _mm512_cvtepu32_epi64(b1);
+        const __m512d fa0 = _mm512_cvtepi32_pd(a0), fa1 = _mm512_cvtepi32_pd(a1);
+        const __m512d fb0 = _mm512_cvtepi32_pd(b0), fb1 = _mm512_cvtepi32_pd(b1);
+        __m512i m0 = _mm512_set1_epi64(kPrime), m1 = m0;
+        for (size_t j = 0; j < n; ++j) {
+            const __m512i u = _mm512_set1_epi64(features[j] + uint64_t{1});
+            const __m512d fu = _mm512_set1_pd(features[j] + 1.0);
+            m0 = avx512_step(m0, u, fu, va0, vb0, fa0, fb0);
+            m1 = avx512_step(m1, u, fu, va1, vb1, fa1, fb1);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(sig + i), _mm512_cvtepi64_epi32(m0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(sig + i + 8), _mm512_cvtepi64_epi32(m1));
+    }
+    for (; i + 8 <= k; i += 8) {
+        const __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const __m512i va0 = _mm512_cvtepu32_epi64(a0), vb0 = _mm512_cvtepu32_epi64(b0);
+        const __m512d fa0 = _mm512_cvtepi32_pd(a0), fb0 = _mm512_cvtepi32_pd(b0);
+        __m512i m0 = _mm512_set1_epi64(kPrime);
+        for (size_t j = 0; j < n; ++j) {
+            const __m512i u = _mm512_set1_epi64(features[j] + uint64_t{1});
+            m0 = avx512_step(m0, u, _mm512_set1_pd(features[j] + 1.0), va0, vb0, fa0, fb0);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(sig + i), _mm512_cvtepi64_epi32(m0));
+    }
+    // The tail lanes could be masked, but k is almost always a multiple of 8
+    avx2(a + i, b + i, k - i, features, n, sig + i);
+}
+
+// As avx2_fixed, with C 8-lane blocks per pass.  C = 8 leaves some
+// spills but still beats two blocks per pass on k >= 64.
+template <size_t K, size_t C = 8>
+__attribute__((target("avx512f"))) void avx512_fixed(const uint32_t* a, const uint32_t* b, size_t,
+                                                      const uint32_t* features, size_t n, uint32_t* sig) {
+    static_assert(K % (8 * C) == 0, "K must be a multiple of the lanes per pass");
+    for (size_t i = 0; i < K; i += 8 * C) {
+        __m512i va[C], vb[C], m[C];
+        __m512d fa[C], fb[C];
+        for (size_t c = 0; c < C; ++c) {
+            const __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i + 8 * c));
+            const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i + 8 * c));
+            va[c] = _mm512_cvtepu32_epi64(a0);
+            vb[c] = _mm512_cvtepu32_epi64(b0);
+            fa[c] = _mm512_cvtepi32_pd(a0);
+            fb[c] = _mm512_cvtepi32_pd(b0);
+            m[c] = _mm512_set1_epi64(kPrime);
+        }
+        for (size_t j = 0; j < n; ++j) {
+            const __m512i u = _mm512_set1_epi64(features[j] + uint64_t{1});
+            const __m512d fu = _mm512_set1_pd(features[j] + 1.0);
+            for (size_t c = 0; c < C; ++c) {
+                m[c] = avx512_step(m[c], u, fu, va[c], vb[c], fa[c], fb[c]);
+            }
+        }
+        for (size_t c = 0; c < C; ++c) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(sig + i + 8 * c), _mm512_cvtepi64_epi32(m[c]));
+        }
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif  // DEDUP_X86_KERNELS
+
+#ifdef DEDUP_NEON_KERNEL
+
+inline void neon(const uint32_t* a, const uint32_t* b, size_t k, const uint32_t* features, size_t n, uint32_t* sig) {
+    const int64x2_t p = vdupq_n_s64(kPrime);
+    const uint32x2_t p32 = vdup_n_u32(kPrime);
+    const float64x2_t inv_p = vdupq_n_f64(1.0 / kPrime);
+
+    size_t i = 0;
+    for (; i + 2 <= k; i += 2) {
+        const uint32x2_t a32 = vld1_u32(a + i);
+        const uint32x2_t b32 = vld1_u32(b + i);
+        const uint64x2_t vb = vmovl_u32(b32);
+        const float64x2_t fa = vcvtq_f64_u64(vmovl_u32(a32));
+        const float64x2_t fb = vcvtq_f64_u64(vb);
+        int64x2_t m = p;
+        for (size_t j = 0; j < n; ++j) {
+            const int64x2_t x = vreinterpretq_s64_u64(vmlal_u32(vb, vdup_n_u32(features[j] + 1), a32));
+            const float64x2_t qd = vmulq_f64(vfmaq_n_f64(fb, fa, features[j] + 1.0), inv_p);
+            const uint32x2_t q = vmovn_u64(vcvtq_u64_f64(qd));
+            int64x2_t r = vsubq_s64(x, vreinterpretq_s64_u64(vmull_u32(q, p32)));
+            r = vaddq_s64(r, vandq_s64(vreinterpretq_s64_u64(vcltzq_s64(r)), p));
+            r = vsubq_s64(r, vandq_s64(vreinterpretq_s64_u64(vcgeq_s64(r, p)), p));
+            m = vbslq_s64(vcgtq_s64(m, r), r, m);
+        }
+        vst1_u32(sig + i, vmovn_u64(vreinterpretq_u64_s64(m)));
+    }
+    scalar(a + i, b + i, k - i, features, n, sig + i);
+}
+
+#endif  // DEDUP_NEON_KERNEL
+
+struct Entry {
+    const char* name;
+    Kernel fn;
+    // Lanes per vector pass; other lane counts leave a slower tail, so
+    // callers pad k to a multiple (a kernel specialized for k takes only k)
+    size_t block = 1;
+};
+
+// k rounded up to whole blocks of kernel
+inline size_t padded(size_t k, const Entry& kernel) { return (k + kernel.block - 1) / kernel.block * kernel.block; }
+
+// Kernels usable on this machine, best first
+inline std::vector<Entry> available() {
+    std::vector<Entry> kernels;
+#ifdef DEDUP_X86_KERNELS
+    // The AVX-512 kernel finishes odd tail lanes with the AVX2 one, which
+    // costs more than padding them to a block of 8 (k = 13: 1.5x).  The AVX2
+    // kernel's own 4-lane and scalar tail is cheaper than padding.
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.push_back({"avx512", avx512, 8});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.push_back({"avx2", avx2});
+    }
+#endif
+#ifdef DEDUP_NEON_KERNEL
+    kernels.push_back({"neon", neon});
+#endif
+    kernels.push_back({"scalar", scalar});
+    return kernels;
+}
+
+#ifdef DEDUP_X86_KERNELS
+template <size_t K>
+inline void push_fixed(std::vector<Entry>& kernels, const char* avx512_name, const char* avx2_name) {
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back({avx512_name, avx512_fixed<K>, K});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.push_back({avx2_name, avx2_fixed<K>, K});
+    }
+}
+#endif
+
+// Kernels usable for signatures of k values, best first: the ones specialized
+// for k (64, 128 or 256) ahead of the general ones
+inline std::vector<Entry> available(size_t k) {
+    std::vector<Entry> kernels;
+#ifdef DEDUP_X86_KERNELS
+    switch (k) {
+        case 64: push_fixed<64>(kernels, "avx512/k64", "avx2/k64"); break;
+        case 128: push_fixed<128>(kernels, "avx512/k128", "avx2/k128"); break;
+        case 256: push_fixed<256>(kernels, "avx512/k256", "avx2/k256"); break;
+        default: break;
+    }
+#endif
+    for (const auto& entry : available()) {
+        kernels.push_back(entry);
+    }
+    return kernels;
+}
+
+inline const Entry& best() {
+    static const Entry entry = available().front();
+    return entry;
+}
+
+inline Entry best(size_t k) { return available(k).front(); }
+
+}  // namespace minhash_kernels
+
+#endif  // DEDUP_MINHASH_KERNELS_H_
@@ -0,0 +1,177 @@
+#ifndef DEDUP_NUMA_H_
+#define DEDUP_NUMA_H_
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// NUMA topology and placement through the kernel interfaces directly, so no
+// libnuma is needed: nodes and their CPUs from sysfs, thread affinity, and
+// the memory policy of the calling thread.  On a single node, or off Linux,
+// every call is a harmless no-op.
+namespace numa {
+
+struct Node {
+    unsigned id;                 // kernel node number
+    std::vector<unsigned> cpus;  // of those, the ones this process may run on
+};
+
+struct Topology {
+    std::vector<Node> nodes;
+
+    size_t cpus() const {
+        size_t n = 0;
+        for (const Node& node : nodes) {
+            n += node.cpus.size();
+        }
+        return n;
+    }
+
+    // The first n nodes only
+    Topology first(size_t n) const { return {{nodes.begin(), nodes.begin() + std::min(n, nodes.size())}}; }
+};
+
+// CPUs of a sysfs list such as "0-3,8,10-11"
+inline std::vector<unsigned> parse_cpulist(const std::string& list) {
+    std::vector<unsigned> cpus;
+    size_t at = 0;
+    while (at < list.size()) {
+        size_t end = list.find(',', at);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        const std::string item = list.substr(at, end - at);
+        const size_t dash = item.find('-');
+        try {
+            const unsigned lo = static_cast<unsigned>(std::stoul(item.substr(0, dash)));
+            const unsigned hi = dash == std::string::npos ? lo : static_cast<unsigned>(std::stoul(item.substr(dash + 1)));
+            for (unsigned c = lo; c <= hi; ++c) {
+                cpus.emplace_back(c);
+            }
+        } catch (const std::exception&) {
+            // A blank or malformed item (a trailing newline) adds nothing
+        }
+        at = end + 1;
+    }
+    return cpus;
+}
+
+// Nodes with CPUs this process may run on, from /sys/devices/system/node;
+// a single node 0 of every allowed CPU if that is unavailable
+inline Topology detect() {
+    std::vector<unsigned> allowed;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &set)) {
+                allowed.emplace_back(c);
+            }
+        }
+    }
+#endif
+    if (allowed.empty()) {
+        for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); ++c) {
+            allowed.emplace_back(c);
+        }
+    }
+
+    Topology t;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (online && std::getline(online, list)) {
+        for (const unsigned id : parse_cpulist(list)) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string cpulist;
+            std::getline(in, cpulist);
+            Node node{id, {}};
+            for (const unsigned c : parse_cpulist(cpulist)) {
+                if (std::binary_search(allowed.begin(), allowed.end(), c)) {
+                    node.cpus.emplace_back(c);
+                }
+            }
+            if (!node.cpus.empty()) {
+                t.nodes.emplace_back(std::move(node));
+            }
+        }
+    }
+    if (t.nodes.empty()) {
+        t.nodes.push_back({0, allowed});
+    }
+    return t;
+}
+
+#if defined(__linux__)
+inline bool set_affinity(pthread_t thread, unsigned cpu) {
+    if (cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+#endif
+
+// Restrict thread t to cpu; false if that is not possible
+inline bool pin(std::thread& t, unsigned cpu) {
+#if defined(__linux__)
+    return set_affinity(t.native_handle(), cpu);
+#else
+    (void)t;
+    (void)cpu;
+    return false;
+#endif
+}
+
+// The same for the calling thread
+inline bool pin(unsigned cpu) {
+#if defined(__linux__)
+    return set_affinity(pthread_self(), cpu);
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Spread the pages the calling thread, and threads it starts afterwards,
+// allocate over the nodes of t page by page, so memory that every worker
+// reads at random is served by every node's memory controller instead of
+// one.  With one node this restores the default local allocation.  False
+// if the kernel refused.
+inline bool interleave(const Topology& t) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    constexpr int kMpolDefault = 0;
+    constexpr int kMpolInterleave = 3;
+    if (t.nodes.size() <= 1) {
+        return syscall(SYS_set_mempolicy, kMpolDefault, nullptr, 0) == 0;
+    }
+    std::vector<unsigned long> mask;
+    constexpr unsigned kBits = 8 * sizeof(unsigned long);
+    for (const Node& node : t.nodes) {
+        mask.resize(std::max<size_t>(mask.size(), node.id / kBits + 1));
+        mask[node.id / kBits] |= 1UL << (node.id % kBits);
+    }
+    return syscall(SYS_set_mempolicy, kMpolInterleave, mask.data(), mask.size() * kBits + 1) == 0;
+#else
+    (void)t;
+    return false;
+#endif
+}
+
+}  // namespace numa
+
+#endif  // DEDUP_NUMA_H_
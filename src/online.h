@@ -0,0 +1,216 @@
+#ifndef DEDUP_ONLINE_H_
+#define DEDUP_ONLINE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "./dedup.h"
+
+// Near-duplicate detection one document at a time, for callers that have to
+// answer "seen this before?" as documents arrive instead of clustering a batch.
+// Tokenization, signatures, bands, signature width, threshold and bucket limit
+// are those of a configured Deduplicator, which must outlive this object and
+// must not be changed while it is in use; its own documents are not consulted.
+//
+// Every table is allocated at its final size up front, so an insert never
+// rehashes or reallocates and its cost does not grow with the number of
+// documents already indexed; with a bucket limit the work per query is
+// bounded too.  Any number of threads may call insert_or_match() and match()
+// at once: bucket keys are claimed and bucket lists extended with atomic
+// compare-and-swap, and readers take no lock.  Two near-duplicates inserted
+// at the same moment may both miss each other and both be inserted.
+class OnlineDeduplicator {
+   public:
+    // Room for capacity documents
+    OnlineDeduplicator(const Deduplicator& config, size_t capacity)
+        : config_(config),
+          bands_(config.index().bands()),
+          rows_(config.index().rows()),
+          capacity_(capacity),
+          limit_(config.index().max_bucket()),
+          store_(config.hasher().num_hashes(), config.signatures().bits()),
+          need_(store_.min_matches(config.threshold())),
+          similarity_(config.cardinality_pruning() ? 1.0 - config.threshold() : 0.0) {
+        if (bands_ * rows_ > store_.num_hashes()) {
+            throw std::invalid_argument("OnlineDeduplicator: bands * rows exceeds signature length");
+        }
+        if (capacity == 0 || capacity > (UINT32_MAX - 1) / bands_) {
+            throw std::invalid_argument("OnlineDeduplicator: capacity * bands must fit in 32 bits");
+        }
+        // At most capacity keys per band, so linear probing stays at most 2/3 full
+        slots_ = 1;
+        while (slots_ < capacity + capacity / 2) {
+            slots_ *= 2;
+        }
+        // Value-initialized, so every page is touched here rather than on insert
+        keys_.reset(new std::atomic<uint64_t>[bands_ * slots_]());
+        heads_.reset(new std::atomic<uint32_t>[bands_ * slots_]());
+        next_.reset(new uint32_t[capacity * bands_]());
+        ids_.reset(new uint64_t[capacity]());
+        store_.append(capacity);
+    }
+
+    OnlineDeduplicator(const OnlineDeduplicator&) = delete;
+    OnlineDeduplicator& operator=(const OnlineDeduplicator&) = delete;
+
+    // If a near-duplicate of text was inserted before, return true and store
+    // its key in *match; otherwise insert text under key and return false.
+    // Throws std::length_error once capacity() documents are inserted.
+    bool insert_or_match(uint64_t key, const std::string_view text, uint64_t* match = nullptr) {
+        Local& local = prepare(text);
+        if (find(local, match)) {
+            return true;
+        }
+        size_t doc = size_.load(std::memory_order_relaxed);
+        do {
+            if (doc == capacity_) {
+                throw std::length_error("OnlineDeduplicator: capacity exhausted");
+            }
+        } while (!size_.compare_exchange_weak(doc, doc + 1, std::memory_order_relaxed));
+
+        // The row and key are written before the release below publishes the
+        // document, so a reader that finds it in a bucket also sees them
+        store_.set(doc, local.scratch.sig.data(), local.cardinality);
+        ids_[doc] = key;
+        for (size_t band = 0; band < bands_; ++band) {
+            std::atomic<uint32_t>& head = heads_[band * slots_ + claim(band, local.hashes[band])];
+            const auto node = static_cast<uint32_t>(doc * bands_ + band);
+            uint32_t first = head.load(std::memory_order_relaxed);
+            do {
+                next_[node] = first;
+            } while (!head.compare_exchange_weak(first, node + 1, std::memory_order_release,
+                                                 std::memory_order_relaxed));
+        }
+        return false;
+    }
+
+    // Like insert_or_match() without inserting
+    bool match(const std::string_view text, uint64_t* match = nullptr) const { return find(prepare(text), match); }
+
+    // Documents inserted, including any still being inserted by other threads
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+    size_t capacity() const { return capacity_; }
+
+   private:
+    // Per-thread buffers, rebuilt when the thread moves on to another instance
+    struct Local {
+        uint64_t owner = 0;
+        Deduplicator::Scratch scratch;
+        std::vector<uint8_t> row;       // packed signature of the current text
+        std::vector<uint64_t> hashes;   // its band hashes
+        std::vector<uint32_t> checked;  // candidate documents
+        uint32_t cardinality = 0;       // feature-set size of the current text
+    };
+
+    const Deduplicator& config_;
+    size_t bands_;
+    size_t rows_;
+    size_t capacity_;
+    size_t limit_;  // bucket members read per band, newest first (0 for all)
+    size_t slots_;  // bucket keys per band, a power of two
+    SignatureStore store_;
+    size_t need_;
+    double similarity_;  // below which feature-set sizes rule a pair out, 0 for no pruning
+    const uint64_t instance_ = next_instance();
+
+    // Band b's bucket keys and list heads are at [b * slots_, (b + 1) * slots_).
+    // A key is a band hash, 0 for a free slot; a head is 1 + the newest node
+    // in the bucket, 0 for none.  Node doc * bands_ + band links document doc
+    // into its bucket of that band, next_[node] being the head it replaced.
+    std::unique_ptr<std::atomic<uint64_t>[]> keys_;
+    std::unique_ptr<std::atomic<uint32_t>[]> heads_;
+    std::unique_ptr<uint32_t[]> next_;
+    std::unique_ptr<uint64_t[]> ids_;  // caller's key of each document
+    std::atomic<size_t> size_{0};
+
+    static uint64_t next_instance() {
+        static std::atomic<uint64_t> counter{0};
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Sign text into this thread's buffers and hash its bands
+    Local& prepare(const std::string_view text) const {
+        thread_local std::unique_ptr<Local> local;
+        if (!local || local->owner != instance_) {
+            local.reset(new Local{instance_, config_.make_scratch(), std::vector<uint8_t>(store_.row_bytes()),
+                                  std::vector<uint64_t>(bands_), {}});
+        }
+        local->cardinality = config_.sign(text, local->scratch, local->scratch.sig.data());
+        store_.pack(local->scratch.sig.data(), local->row.data());
+        const size_t bytes = rows_ * store_.value_bytes();
+        for (size_t band = 0; band < bands_; ++band) {
+            const uint64_t h = config_.index().band_hash(band, local->row.data() + band * bytes, bytes);
+            local->hashes[band] = h == 0 ? 1 : h;
+        }
+        return *local;
+    }
+
+    // The earliest inserted near-duplicate among the documents sharing a
+    // bucket with the prepared text
+    bool find(Local& local, uint64_t* match) const {
+        auto& checked = local.checked;
+        checked.clear();
+        for (size_t band = 0; band < bands_; ++band) {
+            const size_t slot = lookup(band, local.hashes[band]);
+            if (slot == slots_) {
+                continue;
+            }
+            uint32_t node = heads_[band * slots_ + slot].load(std::memory_order_acquire);
+            for (size_t n = 0; node != 0 && (limit_ == 0 || n < limit_); ++n) {
+                checked.emplace_back(static_cast<uint32_t>((node - 1) / bands_));
+                node = next_[node - 1];
+            }
+        }
+        std::sort(checked.begin(), checked.end());
+        checked.erase(std::unique(checked.begin(), checked.end()), checked.end());
+        for (const uint32_t doc : checked) {
+            if (!SignatureStore::may_reach_sizes(local.cardinality, store_.cardinality(doc), similarity_)) {
+                continue;
+            }
+            if (store_.matches(local.row.data(), doc, need_) >= need_) {
+                if (match != nullptr) {
+                    *match = ids_[doc];
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Slot of key in band's table, or slots_ if it has none
+    size_t lookup(size_t band, uint64_t key) const {
+        const size_t mask = slots_ - 1;
+        for (size_t i = static_cast<size_t>(key) & mask;; i = (i + 1) & mask) {
+            const uint64_t k = keys_[band * slots_ + i].load(std::memory_order_acquire);
+            if (k == key) {
+                return i;
+            }
+            if (k == 0) {
+                return slots_;
+            }
+        }
+    }
+
+    // Slot of key in band's table, claiming a free one if it has none
+    size_t claim(size_t band, uint64_t key) {
+        const size_t mask = slots_ - 1;
+        for (size_t i = static_cast<size_t>(key) & mask;; i = (i + 1) & mask) {
+            std::atomic<uint64_t>& slot = keys_[band * slots_ + i];
+            uint64_t k = slot.load(std::memory_order_acquire);
+            if (k == 0 && slot.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+                return i;
+            }
+            if (k == key) {
+                return i;
+            }
+        }
+    }
+};
+
+#endif  // DEDUP_ONLINE_H_
@@ -0,0 +1,84 @@
+#ifndef DEDUP_OPH_H_
+#define DEDUP_OPH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One permutation hashing (Li, Owen & Zhang 2012) with optimal densification
+// (Shrivastava 2017).  Each feature is hashed once; the hash picks one of k
+// bins and the bin keeps the smallest value that lands in it.  An empty bin
+// borrows the value of the first non-empty bin on a pseudo-random probe
+// sequence that depends only on the bin, so two documents probe identically
+// and agree on a borrowed lane exactly when they agree on its source.  The
+// collision probability of each lane remains the Jaccard similarity.
+//
+// Cost is O(n + k) per document instead of the O(n * k) of MinHasher.  The
+// lane values are not comparable with MinHasher's.
+class OnePermutationHasher {
+   public:
+    explicit OnePermutationHasher(size_t num_hashes, uint32_t seed = 1)
+        : num_hashes_(num_hashes), seed_(seed), filled_(num_hashes) {}
+
+    size_t num_hashes() const { return num_hashes_; }
+    uint32_t seed() const { return seed_; }
+
+    // Write the signature of n distinct features to sig[0, num_hashes()).  An
+    // empty set gets kEmpty in every lane.  Not thread-safe: each thread
+    // needs its own hasher.
+    void compute_signature(const uint32_t* features, size_t n, uint32_t* sig) {
+        const uint64_t k = num_hashes_;
+        for (size_t i = 0; i < num_hashes_; ++i) {
+            sig[i] = kEmpty;
+            filled_[i] = 0;
+        }
+        for (size_t j = 0; j < n; ++j) {
+            const uint64_t h = mix64(features[j] ^ (uint64_t{seed_} << 32));
+            // High half picks the bin (Lemire's multiply-shift range
+            // reduction), low half is the value
+            const size_t bin = static_cast<size_t>(((h >> 32) * k) >> 32);
+            const auto v = static_cast<uint32_t>(h);
+            sig[bin] = v < sig[bin] ? v : sig[bin];
+            filled_[bin] = 1;
+        }
+        if (n == 0) {
+            return;
+        }
+        for (size_t i = 0; i < num_hashes_; ++i) {
+            if (filled_[i]) {
+                continue;
+            }
+            for (uint64_t attempt = 1;; ++attempt) {
+                const uint64_t h = mix64((uint64_t{i} << 32 | attempt) ^ seed_);
+                const size_t src = static_cast<size_t>(((h >> 32) * k) >> 32);
+                if (filled_[src]) {
+                    sig[i] = sig[src];
+                    break;
+                }
+            }
+        }
+    }
+
+    std::vector<uint32_t> compute_signature(const std::vector<uint32_t>& features) {
+        std::vector<uint32_t> sig(num_hashes_);
+        compute_signature(features.data(), features.size(), sig.data());
+        return sig;
+    }
+
+    static constexpr uint32_t kEmpty = UINT32_MAX;
+
+   private:
+    size_t num_hashes_;
+    uint32_t seed_;
+    std::vector<uint8_t> filled_;  // per bin, whether a feature landed in it
+
+    // splitmix64 finalizer
+    static uint64_t mix64(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+};
+
+#endif  // DEDUP_OPH_H_
@@ -0,0 +1,168 @@
+#ifndef DEDUP_PIPELINE_H_
+#define DEDUP_PIPELINE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Occupancy of a queue between two stages, sampled after every push and pop.
+// A queue that is mostly full with long push waits has a slow consumer; one
+// that is mostly empty with long pop waits has a slow producer.
+struct QueueStats {
+    size_t capacity = 0;
+    size_t pushes = 0;
+    size_t max_occupancy = 0;
+    double mean_occupancy = 0;
+    double push_wait_seconds = 0;  // producers blocked on a full queue
+    double pop_wait_seconds = 0;   // consumers blocked on an empty queue
+};
+
+// Bounded FIFO connecting pipeline stages.  Producers block while it is full,
+// which is what bounds the memory of the whole pipeline.  Items are batches of
+// thousands of documents, so a mutex is not a measurable cost here.
+template <typename T>
+class BoundedQueue {
+   public:
+    explicit BoundedQueue(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+    // Blocks while the queue is full; false if the queue was cancelled
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wait(lock, not_full_, push_wait_, [this] { return items_.size() < capacity_ || cancelled_; });
+        if (cancelled_) {
+            return false;
+        }
+        items_.emplace_back(std::move(item));
+        ++pushes_;
+        sample();
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty; false once it is closed and drained, or
+    // cancelled
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wait(lock, not_empty_, pop_wait_, [this] { return !items_.empty() || closed_ || cancelled_; });
+        if (cancelled_ || items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        sample();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // No more pushes; consumers drain what is left
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+    }
+
+    // Drop everything and release every blocked producer and consumer
+    void cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled_ = true;
+            items_.clear();
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    QueueStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        QueueStats s;
+        s.capacity = capacity_;
+        s.pushes = pushes_;
+        s.max_occupancy = max_;
+        s.mean_occupancy = samples_ == 0 ? 0.0 : static_cast<double>(total_) / samples_;
+        s.push_wait_seconds = push_wait_;
+        s.pop_wait_seconds = pop_wait_;
+        return s;
+    }
+
+   private:
+    const size_t capacity_;
+    mutable std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    bool cancelled_ = false;
+
+    size_t pushes_ = 0;
+    size_t samples_ = 0;
+    size_t total_ = 0;
+    size_t max_ = 0;
+    double push_wait_ = 0;
+    double pop_wait_ = 0;
+
+    void sample() {
+        ++samples_;
+        total_ += items_.size();
+        max_ = std::max(max_, items_.size());
+    }
+
+    // cv.wait(lock, ready), adding the time spent blocked to waited
+    template <typename Ready>
+    static void wait(std::unique_lock<std::mutex>& lock, std::condition_variable& cv, double& waited, Ready ready) {
+        if (ready()) {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        cv.wait(lock, ready);
+        waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+// What a pipelined run spent its time on.  Busy times exclude waiting on the
+// queues; the signature stage's is summed over its workers.
+struct PipelineStats {
+    size_t docs = 0;
+    size_t batches = 0;
+    size_t signers = 0;
+    double seconds = 0;
+    double read_seconds = 0;
+    double sign_seconds = 0;
+    double index_seconds = 0;
+    QueueStats read_queue;  // reader -> signers
+    QueueStats sign_queue;  // signers -> indexer
+
+    void describe(std::ostream& os) const {
+        const auto flags = os.flags();
+        const auto precision = os.precision();
+        os << std::fixed << std::setprecision(3) << "pipeline: " << docs << " docs in " << batches << " batches, "
+           << seconds << " s\n"
+           << "  stage busy: read " << read_seconds << " s, sign " << sign_seconds << " s over " << signers
+           << " workers, index " << index_seconds << " s\n";
+        queue(os, "read -> sign", read_queue);
+        queue(os, "sign -> index", sign_queue);
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+   private:
+    static void queue(std::ostream& os, const char* name, const QueueStats& q) {
+        os << "  queue " << name << ": mean " << std::setprecision(2) << q.mean_occupancy << " / max "
+           << q.max_occupancy << " of " << q.capacity << ", producers waited " << std::setprecision(3)
+           << q.push_wait_seconds << " s, consumers waited " << q.pop_wait_seconds << " s\n";
+    }
+};
+
+#endif  // DEDUP_PIPELINE_H_
@@ -0,0 +1,114 @@
+#ifndef DEDUP_REPORT_H_
+#define DEDUP_REPORT_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Minimal streaming JSON writer for the run report: nested objects of numbers,
+// strings and booleans, indented by two spaces.  Keys and values are written
+// in call order; nothing checks that keys are unique.
+class JsonWriter {
+   public:
+    explicit JsonWriter(std::ostream& os) : os_(os) {}
+
+    ~JsonWriter() {
+        while (!first_.empty()) {
+            end();
+        }
+        os_ << '\n';
+    }
+
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    // Open an object, as the value of key inside another object or as the
+    // top-level value when key is empty
+    JsonWriter& begin(std::string_view key = {}) {
+        if (!first_.empty()) {
+            next(key);
+        }
+        os_ << '{';
+        first_.push_back(true);
+        return *this;
+    }
+
+    JsonWriter& end() {
+        const bool empty = first_.back();
+        first_.pop_back();
+        if (!empty) {
+            os_ << '\n' << std::string(2 * first_.size(), ' ');
+        }
+        os_ << '}';
+        return *this;
+    }
+
+    JsonWriter& field(std::string_view key, std::string_view value) {
+        next(key);
+        string(value);
+        return *this;
+    }
+    JsonWriter& field(std::string_view key, const char* value) { return field(key, std::string_view(value)); }
+    JsonWriter& field(std::string_view key, const std::string& value) { return field(key, std::string_view(value)); }
+
+    JsonWriter& field(std::string_view key, bool value) {
+        next(key);
+        os_ << (value ? "true" : "false");
+        return *this;
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+    JsonWriter& field(std::string_view key, T value) {
+        next(key);
+        if constexpr (std::is_floating_point_v<T>) {
+            if (!std::isfinite(value)) {
+                os_ << "null";
+            } else {
+                char buf[32];
+                std::snprintf(buf, sizeof(buf), "%.6g", static_cast<double>(value));
+                os_ << buf;
+            }
+        } else {
+            os_ << +value;
+        }
+        return *this;
+    }
+
+   private:
+    std::ostream& os_;
+    std::vector<bool> first_;  // per open object, whether it is still empty
+
+    void next(std::string_view key) {
+        if (!first_.back()) {
+            os_ << ',';
+        }
+        first_.back() = false;
+        os_ << '\n' << std::string(2 * first_.size(), ' ');
+        string(key);
+        os_ << ": ";
+    }
+
+    void string(std::string_view s) {
+        os_ << '"';
+        for (const char c : s) {
+            const auto u = static_cast<unsigned char>(c);
+            if (c == '"' || c == '\\') {
+                os_ << '\\' << c;
+            } else if (u < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", u);
+                os_ << buf;
+            } else {
+                os_ << c;
+            }
+        }
+        os_ << '"';
+    }
+};
+
+#endif  // DEDUP_REPORT_H_
@@ -0,0 +1,283 @@
+#ifndef DEDUP_RESULT_SINK_H_
+#define DEDUP_RESULT_SINK_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "./arrow_ipc.h"
+#include "./lsh.h"
+#include "./pipeline.h"
+
+// How a ResultSink encodes duplicate pairs
+enum class ResultFormat {
+    kText,    // "Duplicate pair (Jaccard: score): a b" lines, as the command line tool prints
+    kTsv,     // an "id_a<TAB>id_b<TAB>score" header line, then one such line per pair
+    kBinary,  // result_sink::Header, then one result_sink::Record per pair
+    kArrow,   // Arrow IPC stream with columns id_a, id_b (uint32) and score (float64)
+};
+
+namespace result_sink {
+
+constexpr char kMagic[8] = {'D', 'E', 'D', 'U', 'P', 'P', 'R', 'S'};
+constexpr uint32_t kVersion = 1;
+
+// Start of a binary file.  All integers are little-endian host order.
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_bytes;  // sizeof(Record)
+};
+
+struct Record {
+    DocId a;
+    DocId b;
+    double score;
+};
+
+static_assert(sizeof(Header) == 16 && sizeof(Record) == 16, "binary layout");
+
+}  // namespace result_sink
+
+// Destination of the duplicate pairs found by worker threads.  Each worker
+// adds pairs to a buffer of its own, which takes no lock; a full buffer is
+// handed whole to a background thread that encodes it and writes it with one
+// write(2), then returned for reuse.  Workers only wait for the writer when
+// it falls kQueued buffers behind, which bounds the memory held in flight.
+// The order of pairs in the output is that of the hand-offs, so it follows
+// the order of add() calls only for a single worker.
+class ResultSink {
+   public:
+    using Record = result_sink::Record;
+
+    // Pairs per buffer, and full buffers waiting for the writer at most
+    static constexpr size_t kBatch = size_t{1} << 15;
+    static constexpr size_t kQueued = 8;
+
+    // On a cache line of its own, as each is appended to by another worker
+    class alignas(64) Buffer {
+       public:
+        void add(DocId a, DocId b, double score) {
+            records_.push_back({a, b, score});
+            if (records_.size() == kBatch) {
+                sink_->submit(records_);
+            }
+        }
+
+       private:
+        friend class ResultSink;
+        ResultSink* sink_ = nullptr;
+        std::vector<Record> records_;
+    };
+
+    // Writes to fd, which is left open, with a buffer for each of workers
+    ResultSink(int fd, ResultFormat format, size_t workers) : fd_(fd), format_(format), buffers_(workers) {
+        start();
+    }
+
+    // Creates or truncates path
+    ResultSink(const std::string& path, ResultFormat format, size_t workers)
+        : fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+          owned_(true),
+          format_(format),
+          buffers_(workers) {
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        start();
+    }
+
+    // Without close() whatever is still buffered is dropped
+    ~ResultSink() {
+        if (writer_.joinable()) {
+            queue_.cancel();
+            writer_.join();
+        }
+        if (owned_) {
+            ::close(fd_);
+        }
+    }
+
+    ResultSink(const ResultSink&) = delete;
+    ResultSink& operator=(const ResultSink&) = delete;
+
+    // Worker w's buffer; one thread at a time may add to it
+    Buffer& buffer(size_t w) { return buffers_[w]; }
+    size_t workers() const { return buffers_.size(); }
+
+    // Write out every buffer and wait for the writer; no add() may run
+    // concurrently or follow.  Throws if a write failed.
+    void close() {
+        for (Buffer& b : buffers_) {
+            if (!b.records_.empty()) {
+                submit(b.records_);
+            }
+        }
+        queue_.close();
+        writer_.join();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+    // Pairs and bytes written so far
+    uint64_t results() const { return results_; }
+    uint64_t bytes() const { return bytes_; }
+
+   private:
+    int fd_;
+    bool owned_ = false;
+    ResultFormat format_;
+    std::vector<Buffer> buffers_;
+    BoundedQueue<std::vector<Record>> queue_{kQueued};
+    std::thread writer_;
+    std::exception_ptr error_;  // set by the writer before it cancels queue_
+    std::atomic<uint64_t> results_{0};
+    std::atomic<uint64_t> bytes_{0};
+
+    std::mutex free_mutex_;
+    std::vector<std::vector<Record>> free_;  // emptied buffers, capacity kBatch
+
+    void start() {
+        for (Buffer& b : buffers_) {
+            b.sink_ = this;
+            b.records_.reserve(kBatch);
+        }
+        writer_ = std::thread([this] { write_loop(); });
+    }
+
+    // Hand records to the writer and replace them with an empty buffer
+    void submit(std::vector<Record>& records) {
+        std::vector<Record> next;
+        {
+            std::lock_guard<std::mutex> lock(free_mutex_);
+            if (!free_.empty()) {
+                next = std::move(free_.back());
+                free_.pop_back();
+            }
+        }
+        if (next.capacity() == 0) {
+            next.reserve(kBatch);
+        }
+        std::swap(records, next);
+        if (!queue_.push(std::move(next))) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+    void write_loop() {
+        try {
+            std::string out;
+            begin(out);
+            write(out);
+            std::vector<Record> records;
+            while (queue_.pop(records)) {
+                out.clear();
+                encode(records, out);
+                write(out);
+                results_ += records.size();
+                records.clear();
+                std::lock_guard<std::mutex> lock(free_mutex_);
+                free_.emplace_back(std::move(records));
+            }
+            out.clear();
+            if (format_ == ResultFormat::kArrow) {
+                arrow_ipc::write_end(out);
+            }
+            write(out);
+        } catch (...) {
+            error_ = std::current_exception();
+            queue_.cancel();
+        }
+    }
+
+    static const std::vector<arrow_ipc::Column>& columns() {
+        static const std::vector<arrow_ipc::Column> kColumns = {
+            {"id_a", arrow_ipc::Type::kUint32}, {"id_b", arrow_ipc::Type::kUint32}, {"score", arrow_ipc::Type::kFloat64}};
+        return kColumns;
+    }
+
+    // What precedes the first pair
+    void begin(std::string& out) const {
+        switch (format_) {
+            case ResultFormat::kText: break;
+            case ResultFormat::kTsv: out += "id_a\tid_b\tscore\n"; break;
+            case ResultFormat::kBinary: {
+                result_sink::Header h{};
+                std::copy(result_sink::kMagic, result_sink::kMagic + 8, h.magic);
+                h.version = result_sink::kVersion;
+                h.record_bytes = sizeof(Record);
+                out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+                break;
+            }
+            case ResultFormat::kArrow: arrow_ipc::write_schema(columns(), out); break;
+        }
+    }
+
+    void encode(const std::vector<Record>& records, std::string& out) const {
+        // %g is what an ostream prints a double as by default
+        char line[96];
+        switch (format_) {
+            case ResultFormat::kText:
+                for (const Record& r : records) {
+                    out.append(line, static_cast<size_t>(std::snprintf(line, sizeof(line),
+                                                                       "Duplicate pair (Jaccard: %g): %u %u\n",
+                                                                       r.score, r.a, r.b)));
+                }
+                break;
+            case ResultFormat::kTsv:
+                for (const Record& r : records) {
+                    out.append(line, static_cast<size_t>(std::snprintf(line, sizeof(line), "%u\t%u\t%g\n", r.a,
+                                                                       r.b, r.score)));
+                }
+                break;
+            case ResultFormat::kBinary:
+                out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+                break;
+            case ResultFormat::kArrow: {
+                std::vector<DocId> a(records.size()), b(records.size());
+                std::vector<double> score(records.size());
+                for (size_t i = 0; i < records.size(); ++i) {
+                    a[i] = records[i].a;
+                    b[i] = records[i].b;
+                    score[i] = records[i].score;
+                }
+                arrow_ipc::write_batch(columns(), {a.data(), b.data(), score.data()}, records.size(), out);
+                break;
+            }
+        }
+    }
+
+    void write(const std::string& out) {
+        const char* p = out.data();
+        size_t left = out.size();
+        while (left != 0) {
+            const ssize_t w = ::write(fd_, p, left);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                throw std::system_error(errno, std::generic_category(), "write results");
+            }
+            p += w;
+            left -= static_cast<size_t>(w);
+        }
+        bytes_ += out.size();
+    }
+};
+
+#endif  // DEDUP_RESULT_SINK_H_
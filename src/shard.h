@@ -0,0 +1,419 @@
+#ifndef DEDUP_SHARD_H_
+#define DEDUP_SHARD_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "./index_file.h"
+#include "./lsh.h"
+#include "./signature_store.h"
+#include "./thread_pool.h"
+#include "./union_find.h"
+
+// Deduplication of a corpus split into N partitions, run by N nodes that only
+// share a directory.  Each step reads the files the previous one wrote:
+//
+//   sign   node s signs partition s and saves it as an ordinary index file,
+//          part-s.idx.  Band tables in it are sorted by hash, which is all
+//          the shuffle the next step needs.
+//   join   node o owns the o-th of N equal slices of the band hash range.  It
+//          maps every part, reads only its slice of each band table, merges
+//          the slices into buckets, verifies the candidates against the
+//          parts' signatures and writes its duplicate forest, edges-o.bin.
+//   merge  one process unites the forests into roots.bin.
+//   label  node s cuts the cluster ids of its documents out of roots.bin.
+//
+// Documents are numbered by concatenating the partitions in shard order, so
+// the clusters are exactly those of a single run over the concatenated
+// input.  sign, join and label each touch about 1/N of the data per node;
+// merge only sees documents that have a duplicate, one edge each.
+//
+// Limits: a partition holds at most Deduplicator::kMaxDocs documents, which
+// sign checks as it reads, so an oversized partition fails there and not
+// hours later.  Global ids and merge are 64-bit throughout, so merge is only
+// bound by the memory of its one node: about 56 bytes per edge it reads (the
+// edges, their ids, the sets and the forest written).
+namespace shard {
+
+using GlobalId = uint64_t;
+
+// A document and the smallest id in its cluster
+struct Edge {
+    GlobalId doc;
+    GlobalId root;
+};
+
+inline std::string part_path(const std::string& dir, size_t shard) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/part-%05zu.idx", shard);
+    return dir + name;
+}
+
+inline std::string edges_path(const std::string& dir, size_t owner) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/edges-%05zu.bin", owner);
+    return dir + name;
+}
+
+inline std::string roots_path(const std::string& dir) { return dir + "/roots.bin"; }
+
+// First band hash owned by owner; the last owner's slice runs to 2^64 - 1
+inline uint64_t slice_start(size_t owner, size_t owners) { return owner == 0 ? 0 : UINT64_MAX / owners * owner; }
+
+// Forest files: a header, then Edge[count] sorted by doc with doc > root
+namespace forest_file {
+
+constexpr char kMagic[8] = {'D', 'E', 'D', 'U', 'P', 'F', 'S', 'T'};
+constexpr uint32_t kVersion = 1;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t count;
+};
+
+}  // namespace forest_file
+
+// Replace an edge list by a forest with the same connected components: one
+// edge per non-root document, to the smallest id of its component, sorted by
+// document.  Ids are compacted to 64-bit indices first, so the sets take 8
+// bytes per document that appears in edges and the ids 16 bytes per edge.
+inline std::vector<Edge> spanning_forest(const std::vector<std::pair<GlobalId, GlobalId>>& edges) {
+    std::vector<GlobalId> ids;
+    ids.reserve(2 * edges.size());
+    for (const auto& [a, b] : edges) {
+        ids.emplace_back(a);
+        ids.emplace_back(b);
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    const auto index = [&](GlobalId id) {
+        return static_cast<uint64_t>(std::lower_bound(ids.begin(), ids.end(), id) - ids.begin());
+    };
+    BasicConcurrentUnionFind<uint64_t> sets(ids.size());
+    for (const auto& [a, b] : edges) {
+        sets.unite(index(a), index(b));
+    }
+    std::vector<Edge> forest;
+    for (uint64_t k = 0; k < ids.size(); ++k) {
+        const uint64_t root = sets.find(k);
+        if (root != k) {
+            forest.push_back({ids[k], ids[root]});
+        }
+    }
+    return forest;
+}
+
+inline void write_forest(const std::string& path, const std::vector<Edge>& forest) {
+    forest_file::Header header{};
+    std::memcpy(header.magic, forest_file::kMagic, sizeof(header.magic));
+    header.version = forest_file::kVersion;
+    header.byte_order = index_file::kByteOrder;
+    header.count = forest.size();
+
+    index_file::Writer out(path);
+    out.write(&header, sizeof(header));
+    out.write(forest.data(), forest.size() * sizeof(Edge));
+    out.commit();
+}
+
+// A read-only mapping of a forest file
+class MappedForest {
+   public:
+    explicit MappedForest(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            const int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), "fstat " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ < sizeof(forest_file::Header)) {
+            ::close(fd);
+            throw std::runtime_error(path + ": not a dedup forest (too short)");
+        }
+        void* p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        const int err = errno;
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            throw std::system_error(err, std::generic_category(), "mmap " + path);
+        }
+        base_ = static_cast<const uint8_t*>(p);
+
+        forest_file::Header header;
+        std::memcpy(&header, base_, sizeof(header));
+        if (std::memcmp(header.magic, forest_file::kMagic, sizeof(header.magic)) != 0 ||
+            header.byte_order != index_file::kByteOrder || header.version != forest_file::kVersion) {
+            unmap();
+            throw std::runtime_error(path + ": not a dedup forest of this version and byte order");
+        }
+        if (sizeof(header) + header.count * sizeof(Edge) > size_) {
+            unmap();
+            throw std::runtime_error(path + ": truncated forest");
+        }
+        edges_ = reinterpret_cast<const Edge*>(base_ + sizeof(header));
+        count_ = header.count;
+    }
+
+    MappedForest(const MappedForest&) = delete;
+    MappedForest& operator=(const MappedForest&) = delete;
+
+    ~MappedForest() { unmap(); }
+
+    const Edge* begin() const { return edges_; }
+    const Edge* end() const { return edges_ + count_; }
+    size_t size() const { return count_; }
+
+   private:
+    const uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    const Edge* edges_ = nullptr;
+    size_t count_ = 0;
+
+    void unmap() {
+        if (base_ != nullptr) {
+            ::munmap(const_cast<uint8_t*>(base_), size_);
+            base_ = nullptr;
+        }
+    }
+};
+
+// Every part-s.idx of a run, mapped, with the global id of each part's first
+// document.  All parts must have been built with the same parameters.
+class Parts {
+   public:
+    Parts(const std::string& dir, size_t shards) {
+        if (shards == 0) {
+            throw std::invalid_argument("Parts: no shards");
+        }
+        GlobalId offset = 0;
+        for (size_t s = 0; s < shards; ++s) {
+            const std::string path = part_path(dir, s);
+            auto part = std::make_unique<MappedIndex>(path);
+            if (s != 0 && part->params() != parts_[0]->params()) {
+                throw std::runtime_error(path + ": part was built with different parameters");
+            }
+            SignatureStore store(part->params().num_hashes, part->params().bits);
+            store.attach(part->signatures(), part->cardinalities(), part->num_docs());
+            offsets_.emplace_back(offset);
+            offset += part->num_docs();
+            stores_.emplace_back(std::move(store));
+            parts_.emplace_back(std::move(part));
+        }
+        offsets_.emplace_back(offset);
+    }
+
+    size_t size() const { return parts_.size(); }
+    const IndexParams& params() const { return parts_[0]->params(); }
+
+    // Global id of the first document of shard, or the total for size()
+    GlobalId offset(size_t shard) const { return offsets_[shard]; }
+    size_t num_docs(size_t shard) const { return parts_[shard]->num_docs(); }
+
+    const LSHIndex::FrozenBand& band(size_t shard, size_t band) const { return parts_[shard]->bands()[band]; }
+    const SignatureStore& signatures(size_t shard) const { return stores_[shard]; }
+
+    const uint8_t* row(GlobalId id) const {
+        const size_t s = shard_of(id);
+        return stores_[s].row(id - offsets_[s]);
+    }
+
+    uint32_t cardinality(GlobalId id) const {
+        const size_t s = shard_of(id);
+        return stores_[s].cardinality(id - offsets_[s]);
+    }
+
+   private:
+    std::vector<std::unique_ptr<MappedIndex>> parts_;
+    std::vector<SignatureStore> stores_;
+    std::vector<GlobalId> offsets_;
+
+    size_t shard_of(GlobalId id) const {
+        return std::upper_bound(offsets_.begin(), offsets_.end(), id) - offsets_.begin() - 1;
+    }
+};
+
+struct JoinStats {
+    size_t candidates = 0;  // distinct candidate pairs in the slice
+    size_t duplicates = 0;  // of those, verified
+    size_t edges = 0;       // written to the forest
+    LSHIndex::OversizedBuckets oversized;
+};
+
+// The join step for owner: buckets of its hash slice in every band, merged
+// across parts, verified at Jaccard distance below threshold on the workers
+// of pool.  Buckets above max_bucket are chained as by
+// LSHIndex::set_max_bucket, and with cardinality_pruning pairs are first
+// checked as by Deduplicator's.  A pair colliding in several bands belongs
+// to the owner of the first band whose bucket expands to all pairs, as in
+// external::candidates(), so each pair is verified by one owner only.
+// Writes the duplicate forest to edges_path(dir, owner).
+inline JoinStats join(const Parts& parts, const std::string& dir, size_t owner, size_t owners, double threshold,
+                      WorkStealingPool& pool, size_t max_bucket = 0, bool cardinality_pruning = true) {
+    if (owner >= owners) {
+        throw std::invalid_argument("shard::join: owner out of range");
+    }
+    const uint64_t first = slice_start(owner, owners);
+    const bool last = owner + 1 == owners;
+    const uint64_t next = last ? 0 : slice_start(owner + 1, owners);
+
+    // One sorted run of (hash, doc) entries per part
+    struct Cursor {
+        const uint64_t* hash;
+        const uint64_t* end;
+        const DocId* doc;
+        GlobalId offset;
+    };
+    JoinStats stats;
+    std::vector<std::pair<GlobalId, GlobalId>> pairs;
+    std::vector<Cursor> cursors;
+    std::vector<GlobalId> members;
+    const LSHIndex lsh(parts.params().bands, parts.params().rows);
+    const size_t bytes = parts.params().rows * parts.signatures(0).value_bytes();
+
+    // Members of band's bucket hash across every part
+    const auto bucket_size = [&](size_t band, uint64_t hash) {
+        size_t n = 0;
+        for (size_t s = 0; s < parts.size(); ++s) {
+            const auto& frozen = parts.band(s, band);
+            const auto range = std::equal_range(frozen.hashes, frozen.hashes + frozen.size, hash);
+            n += static_cast<size_t>(range.second - range.first);
+        }
+        return n;
+    };
+    // True if docs i and j were paired by a band before band, whichever
+    // owner's slice it fell in: they share its rows and its bucket was not
+    // chained
+    const auto paired = [&](size_t band, GlobalId i, GlobalId j) {
+        const uint8_t* a = parts.row(i);
+        const uint8_t* c = parts.row(j);
+        for (size_t e = 0; e < band; ++e) {
+            if (std::memcmp(a + e * bytes, c + e * bytes, bytes) == 0 &&
+                (max_bucket == 0 || bucket_size(e, lsh.band_hash(e, a + e * bytes, bytes)) <= max_bucket)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (size_t b = 0; b < parts.params().bands; ++b) {
+        cursors.clear();
+        for (size_t s = 0; s < parts.size(); ++s) {
+            const auto& band = parts.band(s, b);
+            const uint64_t* lo = std::lower_bound(band.hashes, band.hashes + band.size, first);
+            const uint64_t* hi = last ? band.hashes + band.size : std::lower_bound(lo, band.hashes + band.size, next);
+            if (lo != hi) {
+                cursors.push_back({lo, hi, band.docs + (lo - band.hashes), parts.offset(s)});
+            }
+        }
+        while (!cursors.empty()) {
+            uint64_t hash = *cursors[0].hash;
+            for (const Cursor& c : cursors) {
+                hash = std::min(hash, *c.hash);
+            }
+            // Parts are visited in shard order and each run is sorted by
+            // doc, so members come out sorted by global id
+            members.clear();
+            for (Cursor& c : cursors) {
+                for (; c.hash != c.end && *c.hash == hash; ++c.hash, ++c.doc) {
+                    members.emplace_back(c.offset + *c.doc);
+                }
+            }
+            cursors.erase(std::remove_if(cursors.begin(), cursors.end(),
+                                         [](const Cursor& c) { return c.hash == c.end; }),
+                          cursors.end());
+            LSHIndex::bucket_pairs<GlobalId>(members, 0, max_bucket, stats.oversized, [&](GlobalId i, GlobalId j) {
+                if (!paired(b, i, j)) {
+                    pairs.emplace_back(i, j);
+                }
+            });
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    stats.candidates = pairs.size();
+    const SignatureStore& reference = parts.signatures(0);
+    const size_t need = reference.min_matches(threshold);
+    const auto kernel = match_kernels::best(reference.bits());
+    const double similarity = cardinality_pruning ? 1.0 - threshold : 0.0;
+    // Each worker collects its own; concatenated in worker order, which the
+    // spanning forest does not depend on
+    std::vector<std::vector<std::pair<GlobalId, GlobalId>>> found(pool.size());
+    pool.parallel_for(pairs.size(), 4096, [&](size_t begin, size_t end, size_t worker) {
+        for (size_t p = begin; p < end; ++p) {
+            const auto [i, j] = pairs[p];
+            if (!SignatureStore::may_reach_sizes(parts.cardinality(i), parts.cardinality(j), similarity)) {
+                continue;
+            }
+            if (kernel.fn(parts.row(i), parts.row(j), reference.num_hashes(), need) >= need) {
+                found[worker].emplace_back(i, j);
+            }
+        }
+    });
+    std::vector<std::pair<GlobalId, GlobalId>> duplicates;
+    for (const auto& f : found) {
+        duplicates.insert(duplicates.end(), f.begin(), f.end());
+    }
+    stats.duplicates = duplicates.size();
+
+    const auto forest = spanning_forest(duplicates);
+    stats.edges = forest.size();
+    write_forest(edges_path(dir, owner), forest);
+    return stats;
+}
+
+// The merge step: unite the forests of all owners into roots.bin; returns
+// the number of documents that are not their cluster's root
+inline size_t merge(const std::string& dir, size_t owners) {
+    std::vector<std::pair<GlobalId, GlobalId>> edges;
+    for (size_t o = 0; o < owners; ++o) {
+        const MappedForest forest(edges_path(dir, o));
+        for (const Edge& e : forest) {
+            edges.emplace_back(e.doc, e.root);
+        }
+    }
+    const auto roots = spanning_forest(edges);
+    write_forest(roots_path(dir), roots);
+    return roots.size();
+}
+
+// The label step: cluster id (a global id) of every document of shard
+inline std::vector<GlobalId> labels(const Parts& parts, const MappedForest& roots, size_t shard) {
+    const GlobalId first = parts.offset(shard);
+    const GlobalId end = parts.offset(shard + 1);
+    std::vector<GlobalId> result(parts.num_docs(shard));
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = first + i;
+    }
+    const auto by_doc = [](const Edge& e, GlobalId id) { return e.doc < id; };
+    for (const Edge* e = std::lower_bound(roots.begin(), roots.end(), first, by_doc); e != roots.end() && e->doc < end;
+         ++e) {
+        result[e->doc - first] = e->root;
+    }
+    return result;
+}
+
+}  // namespace shard
+
+#endif  // DEDUP_SHARD_H_
@@ -0,0 +1,235 @@
+#ifndef DEDUP_SIGNATURE_STORE_H_
+#define DEDUP_SIGNATURE_STORE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "./match_kernels.h"
+
+// All signatures of a run in one row-major allocation: row i holds the
+// num_hashes values of document i.  Values can be truncated to their low 16 or
+// 8 bits (b-bit MinHash, Li & König 2010) to halve or quarter the footprint;
+// similarity() corrects for the chance collisions this introduces.
+//
+// Next to each signature the store keeps the cardinality of the feature set
+// it was computed from, which bounds the Jaccard similarity of a pair without
+// reading either signature (see may_reach()).
+//
+// A store may also sit on top of read-only rows that live elsewhere (a mapped
+// index file, see attach()); appended rows then go to the owned buffer.
+class SignatureStore {
+   public:
+    explicit SignatureStore(size_t num_hashes, unsigned bits = 32) : num_hashes_(num_hashes), bits_(bits) {
+        if (bits != 32 && bits != 16 && bits != 8) {
+            throw std::invalid_argument("SignatureStore: bits must be 8, 16 or 32");
+        }
+        width_ = bits / 8;
+        kernel_ = match_kernels::best(bits);
+    }
+
+    size_t size() const { return size_; }
+    size_t num_hashes() const { return num_hashes_; }
+    unsigned bits() const { return bits_; }
+    size_t value_bytes() const { return width_; }
+    size_t row_bytes() const { return num_hashes_ * width_; }
+
+    // Append count zeroed rows and return the index of the first
+    size_t append(size_t count) {
+        const size_t first = size_;
+        size_ += count;
+        data_.resize((size_ - base_rows_) * row_bytes());
+        cardinality_.resize(size_ - base_rows_);
+        return first;
+    }
+
+    void reserve(size_t rows) {
+        data_.reserve(rows * row_bytes());
+        cardinality_.reserve(rows);
+    }
+
+    void clear() {
+        data_.clear();
+        cardinality_.clear();
+        base_ = nullptr;
+        base_cardinality_ = nullptr;
+        base_rows_ = 0;
+        size_ = 0;
+    }
+
+    // Use rows and their cardinalities stored elsewhere as rows [0, rows) of
+    // an empty store.  The memory is not copied and must outlive the store.
+    void attach(const uint8_t* base, const uint32_t* cardinality, size_t rows) {
+        if (size_ != 0) {
+            throw std::logic_error("SignatureStore: attach to a non-empty store");
+        }
+        base_ = base;
+        base_cardinality_ = cardinality;
+        base_rows_ = rows;
+        size_ = rows;
+    }
+
+    // Rows before this index are read-only
+    size_t attached_rows() const { return base_rows_; }
+
+    // Store a full-width signature of a set of cardinality elements as row i,
+    // truncating it to bits()
+    void set(size_t i, const uint32_t* sig, uint32_t cardinality) {
+        pack(sig, data_.data() + (i - base_rows_) * row_bytes());
+        cardinality_[i - base_rows_] = cardinality;
+    }
+
+    // Set row i to a row already packed, as row() returns it
+    void set_row(size_t i, const uint8_t* row, uint32_t cardinality) {
+        std::memcpy(data_.data() + (i - base_rows_) * row_bytes(), row, row_bytes());
+        cardinality_[i - base_rows_] = cardinality;
+    }
+
+    // Write the row_bytes() a full-width signature is stored as to dst
+    void pack(const uint32_t* sig, uint8_t* dst) const {
+        switch (width_) {
+            case 4: std::memcpy(dst, sig, row_bytes()); break;
+            case 2: truncate<uint16_t>(sig, dst); break;
+            default: truncate<uint8_t>(sig, dst); break;
+        }
+    }
+
+    // Make row dst (not an attached one) a copy of row src
+    void copy(size_t dst, size_t src) {
+        std::memcpy(data_.data() + (dst - base_rows_) * row_bytes(), row(src), row_bytes());
+        cardinality_[dst - base_rows_] = cardinality(src);
+    }
+
+    const uint8_t* row(size_t i) const {
+        return i < base_rows_ ? base_ + i * row_bytes() : data_.data() + (i - base_rows_) * row_bytes();
+    }
+
+    // Feature-set size row i was computed from
+    uint32_t cardinality(size_t i) const {
+        return i < base_rows_ ? base_cardinality_[i] : cardinality_[i - base_rows_];
+    }
+
+    // False if rows i and j cannot have Jaccard similarity similarity: that of
+    // two sets is at most min(|A|, |B|) / max(|A|, |B|)
+    bool may_reach(size_t i, size_t j, double similarity) const {
+        return may_reach_sizes(cardinality(i), cardinality(j), similarity);
+    }
+
+    // The same for sets of a and b elements
+    static bool may_reach_sizes(uint32_t a, uint32_t b, double similarity) {
+        return std::min(a, b) >= similarity * std::max(a, b);
+    }
+
+    uint32_t value(size_t i, size_t h) const {
+        const uint8_t* p = row(i) + h * width_;
+        switch (width_) {
+            case 4: return load<uint32_t>(p);
+            case 2: return load<uint16_t>(p);
+            default: return *p;
+        }
+    }
+
+    size_t matches(size_t i, size_t j) const { return kernel_.fn(row(i), row(j), num_hashes_, 0); }
+
+    // Like matches(i, j), but gives up once fewer than need matches remain
+    // possible; the result is exact only if it is >= need
+    size_t matches(size_t i, size_t j, size_t need) const { return kernel_.fn(row(i), row(j), num_hashes_, need); }
+
+    // matches(i, j, need) against a row packed by pack() instead of row i
+    size_t matches(const uint8_t* a, size_t j, size_t need) const { return kernel_.fn(a, row(j), num_hashes_, need); }
+
+    // matches(i, js[t], need) for t < n.  Row i stays in cache across the
+    // batch, which is how candidate verification walks the pairs anyway.
+    void matches(size_t i, const uint32_t* js, size_t n, size_t need, size_t* out) const {
+        const uint8_t* a = row(i);
+        for (size_t t = 0; t < n; ++t) {
+            out[t] = kernel_.fn(a, row(js[t]), num_hashes_, need);
+        }
+    }
+
+    // Fewest matches for which 1 - estimate() falls below distance, or
+    // num_hashes() + 1 if no count does
+    size_t min_matches(double distance) const {
+        for (size_t m = 0; m <= num_hashes_; ++m) {
+            if (1.0 - estimate(m) < distance) {
+                return m;
+            }
+        }
+        return num_hashes_ + 1;
+    }
+
+    // Name of the comparison kernel picked for this CPU
+    const char* match_kernel_name() const { return kernel_.name; }
+
+    void set_match_kernel(const match_kernels::Entry& kernel) { kernel_ = kernel; }
+
+    // Estimated Jaccard similarity of documents i and j.  With b-bit values
+    // two rows also agree by chance with probability 2^-b, so the raw match
+    // rate m becomes (m - 2^-b) / (1 - 2^-b).
+    double similarity(size_t i, size_t j) const { return estimate(matches(i, j)); }
+
+    double estimate(size_t matches) const {
+        const double m = static_cast<double>(matches) / num_hashes_;
+        if (bits_ == 32) {
+            return m;
+        }
+        const double c = 1.0 / static_cast<double>(uint32_t{1} << bits_);
+        return m <= c ? 0.0 : (m - c) / (1.0 - c);
+    }
+
+    // Strided column-major view of one band: rows [band * rows, (band + 1) *
+    // rows) of every document, so LSH can bucket band by band without copying
+    class BandView {
+       public:
+        BandView(const SignatureStore& store, size_t band, size_t rows)
+            : store_(store), offset_(band * rows * store.value_bytes()), bytes_(rows * store.value_bytes()) {}
+
+        size_t size() const { return store_.size(); }
+        size_t bytes() const { return bytes_; }
+        const uint8_t* operator[](size_t doc) const { return store_.row(doc) + offset_; }
+
+       private:
+        const SignatureStore& store_;
+        size_t offset_;
+        size_t bytes_;
+    };
+
+    BandView band(size_t band, size_t rows) const {
+        if ((band + 1) * rows > num_hashes_) {
+            throw std::out_of_range("SignatureStore: band beyond signature");
+        }
+        return BandView(*this, band, rows);
+    }
+
+   private:
+    size_t num_hashes_;
+    unsigned bits_;
+    size_t width_;
+    size_t size_ = 0;
+    std::vector<uint8_t> data_;
+    std::vector<uint32_t> cardinality_;  // of the owned rows
+    const uint8_t* base_ = nullptr;
+    const uint32_t* base_cardinality_ = nullptr;
+    size_t base_rows_ = 0;
+    match_kernels::Entry kernel_;
+
+    template <typename T>
+    void truncate(const uint32_t* sig, uint8_t* dst) const {
+        for (size_t h = 0; h < num_hashes_; ++h) {
+            const T v = static_cast<T>(sig[h]);
+            std::memcpy(dst + h * sizeof(T), &v, sizeof(T));
+        }
+    }
+
+    template <typename T>
+    static T load(const uint8_t* p) {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+};
+
+#endif  // DEDUP_SIGNATURE_STORE_H_
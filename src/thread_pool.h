@@ -0,0 +1,223 @@
+#ifndef DEDUP_THREAD_POOL_H_
+#define DEDUP_THREAD_POOL_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "./numa.h"
+
+// Fixed set of workers executing parallel_for jobs.  The index range is cut
+// into chunks and every worker is seeded with a contiguous run of them; a
+// worker that drains its own queue steals from the back of a victim's.  This
+// keeps cores busy when per-item cost is heavily skewed (tweets next to books)
+// without giving up locality in the common case.
+class WorkStealingPool {
+   public:
+    // 0 threads means one per hardware thread.  The calling thread is one of
+    // the workers, so a pool of size 1 runs everything inline.
+    explicit WorkStealingPool(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        queues_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            queues_.emplace_back(std::make_unique<Queue>());
+        }
+        for (size_t self = 0; self < threads; ++self) {
+            victims_.emplace_back();
+            for (size_t k = 1; k < threads; ++k) {
+                victims_.back().emplace_back((self + k) % threads);
+            }
+        }
+        for (size_t i = 1; i < threads; ++i) {
+            workers_.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& t : workers_) {
+            t.join();
+        }
+    }
+
+    size_t size() const { return queues_.size(); }
+
+    // Spread the workers over the nodes of topology in contiguous blocks,
+    // each pinned to a CPU of its node, and have an idle worker steal from
+    // workers of its own node before crossing to another.  Call it between
+    // jobs.  The calling thread, worker 0, stays unpinned, since threads it
+    // starts inherit its affinity; a thread standing in for worker w can take
+    // its place with place(w).
+    void set_placement(const numa::Topology& topology) {
+        const size_t n = size();
+        const size_t nodes = std::min(topology.nodes.size(), n);
+        node_.assign(n, 0);
+        cpu_.assign(n, 0);
+        for (size_t w = 0; w < n; ++w) {
+            node_[w] = w * nodes / n;
+            const size_t rank = w - (node_[w] * n + nodes - 1) / nodes;  // among the workers of its node
+            const auto& cpus = topology.nodes[node_[w]].cpus;
+            cpu_[w] = cpus[rank % cpus.size()];
+        }
+        for (size_t w = 1; w < n; ++w) {
+            numa::pin(workers_[w - 1], cpu_[w]);
+        }
+        for (size_t self = 0; self < n; ++self) {
+            std::stable_partition(victims_[self].begin(), victims_[self].end(),
+                                  [&](size_t v) { return node_[v] == node_[self]; });
+        }
+        nodes_ = nodes;
+    }
+
+    // Pin the calling thread to worker w's CPU, if workers are placed
+    void place(size_t w) const {
+        if (!cpu_.empty()) {
+            numa::pin(cpu_[w]);
+        }
+    }
+
+    // Nodes the workers were spread over (1 if not placed), and worker w's
+    // among them
+    size_t nodes() const { return nodes_; }
+    size_t node(size_t w) const { return node_.empty() ? 0 : node_[w]; }
+    unsigned cpu(size_t w) const { return cpu_.empty() ? 0 : cpu_[w]; }
+
+    // Call fn(begin, end, worker) over [0, n) in chunks of at most grain items;
+    // worker is in [0, size()) and unique among concurrent calls.  Blocks until
+    // every chunk has run and rethrows the first exception thrown by fn.
+    void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t, size_t)>& fn) {
+        if (n == 0) {
+            return;
+        }
+        grain = std::max<size_t>(grain, 1);
+        if (size() == 1 || n <= grain) {
+            fn(0, n, 0);
+            return;
+        }
+
+        const size_t chunks = (n + grain - 1) / grain;
+        const size_t per_worker = (chunks + size() - 1) / size();
+        for (size_t c = 0; c < chunks; ++c) {
+            auto& q = *queues_[c / per_worker];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.chunks.emplace_back(c * grain, std::min(n, (c + 1) * grain));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &fn;
+            error_ = nullptr;
+            finished_ = 0;
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        run(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return finished_ == workers_.size(); });
+        job_ = nullptr;
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+   private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::pair<size_t, size_t>> chunks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::vector<std::vector<size_t>> victims_;  // per worker, in the order it steals from them
+    std::vector<size_t> node_;                  // empty unless placed
+    std::vector<unsigned> cpu_;
+    size_t nodes_ = 1;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(size_t, size_t, size_t)>* job_ = nullptr;
+    std::exception_ptr error_;
+    size_t generation_ = 0;
+    size_t finished_ = 0;
+    bool stop_ = false;
+
+    void worker_loop(size_t self) {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) {
+                    return;
+                }
+                seen = generation_;
+            }
+            run(self);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++finished_;
+            }
+            done_.notify_one();
+        }
+    }
+
+    bool pop(size_t self, std::pair<size_t, size_t>& chunk) {
+        auto& q = *queues_[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.chunks.empty()) {
+            return false;
+        }
+        chunk = q.chunks.front();
+        q.chunks.pop_front();
+        return true;
+    }
+
+    bool steal(size_t self, std::pair<size_t, size_t>& chunk) {
+        for (const size_t v : victims_[self]) {
+            auto& q = *queues_[v];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.chunks.empty()) {
+                chunk = q.chunks.back();
+                q.chunks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        std::pair<size_t, size_t> chunk;
+        while (pop(self, chunk) || steal(self, chunk)) {
+            try {
+                (*job_)(chunk.first, chunk.second, self);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+            }
+        }
+    }
+};
+
+#endif  // DEDUP_THREAD_POOL_H_
@@ -0,0 +1,185 @@
+#ifndef DEDUP_TOKENIZER_H_
+#define DEDUP_TOKENIZER_H_
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEDUP_X86_TOKENIZER 1
+#endif
+
+// Membership table for the bytes that separate tokens.  Besides the plain
+// 256-entry table it keeps the set in the nibble layout of Muła's "SIMD byte
+// lookup": for low nibble l, bit h of rows_[l] (or of rows_[16 + l] for
+// h >= 8) says whether byte 16 * h + l is in the set.  That classifies 16 or
+// 32 bytes per shuffle and works for any set, not just character ranges.
+class CharClass {
+   public:
+    explicit CharClass(std::string_view delimiters) {
+        for (const char c : delimiters) {
+            add(static_cast<unsigned char>(c));
+        }
+        select_kernel();
+    }
+
+    // Every byte that is not alphanumeric in the C locale
+    static CharClass non_alnum() {
+        CharClass cc;
+        for (int c = 0; c < 256; ++c) {
+            if (!std::isalnum(c)) {
+                cc.add(static_cast<unsigned char>(c));
+            }
+        }
+        cc.select_kernel();
+        return cc;
+    }
+
+    bool contains(unsigned char c) const { return table_[c] != 0; }
+
+    // Bit i is set iff p[i] is a delimiter, for i < n <= 64
+    uint64_t mask(const char* p, size_t n) const {
+        if (n < 64) {
+            char block[64] = {};
+            std::memcpy(block, p, n);
+            return kernel_(*this, block) & ((uint64_t{1} << n) - 1);
+        }
+        return kernel_(*this, p);
+    }
+
+    // Name of the kernel picked for this CPU
+    const char* kernel_name() const { return kernel_name_; }
+
+   private:
+    using Kernel = uint64_t (*)(const CharClass& cc, const char* p);
+
+    std::array<uint8_t, 256> table_{};
+    alignas(16) uint8_t rows_[32] = {};
+    Kernel kernel_ = scalar_mask;
+    const char* kernel_name_ = "scalar";
+
+    CharClass() = default;
+
+    void add(unsigned char c) {
+        table_[c] = 1;
+        rows_[(c >> 7) * 16 + (c & 15)] |= static_cast<uint8_t>(1u << ((c >> 4) & 7));
+    }
+
+    void select_kernel() {
+#ifdef DEDUP_X86_TOKENIZER
+        if (__builtin_cpu_supports("avx2")) {
+            kernel_ = avx2_mask;
+            kernel_name_ = "avx2";
+        } else if (__builtin_cpu_supports("sse4.1")) {
+            kernel_ = sse41_mask;
+            kernel_name_ = "sse4.1";
+        }
+#endif
+    }
+
+    static uint64_t scalar_mask(const CharClass& cc, const char* p) {
+        uint64_t m = 0;
+        for (size_t i = 0; i < 64; ++i) {
+            m |= static_cast<uint64_t>(cc.table_[static_cast<unsigned char>(p[i])]) << i;
+        }
+        return m;
+    }
+
+#ifdef DEDUP_X86_TOKENIZER
+    __attribute__((target("sse4.1"))) static uint64_t sse41_mask(const CharClass& cc, const char* p) {
+        const __m128i lo_rows = _mm_load_si128(reinterpret_cast<const __m128i*>(cc.rows_));
+        const __m128i hi_rows = _mm_load_si128(reinterpret_cast<const __m128i*>(cc.rows_ + 16));
+        const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        uint64_t m = 0;
+        for (int k = 0; k < 4; ++k) {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * k));
+            const __m128i lo = _mm_and_si128(x, nibble);
+            const __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x07));
+            // blendv picks by the top bit of x, i.e. h >= 8
+            const __m128i row = _mm_blendv_epi8(_mm_shuffle_epi8(lo_rows, lo), _mm_shuffle_epi8(hi_rows, lo), x);
+            const __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(row, _mm_shuffle_epi8(bit, hi)), _mm_setzero_si128());
+            m |= static_cast<uint64_t>(~_mm_movemask_epi8(miss) & 0xFFFF) << (16 * k);
+        }
+        return m;
+    }
+
+    __attribute__((target("avx2"))) static uint64_t avx2_mask(const CharClass& cc, const char* p) {
+        const __m256i lo_rows = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(cc.rows_)));
+        const __m256i hi_rows =
+            _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(cc.rows_ + 16)));
+        const __m256i bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8,
+                                             16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        uint64_t m = 0;
+        for (int k = 0; k < 2; ++k) {
+            const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * k));
+            const __m256i lo = _mm256_and_si256(x, nibble);
+            const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi8(0x07));
+            const __m256i row =
+                _mm256_blendv_epi8(_mm256_shuffle_epi8(lo_rows, lo), _mm256_shuffle_epi8(hi_rows, lo), x);
+            const __m256i miss =
+                _mm256_cmpeq_epi8(_mm256_and_si256(row, _mm256_shuffle_epi8(bit, hi)), _mm256_setzero_si256());
+            m |= static_cast<uint64_t>(~static_cast<uint32_t>(_mm256_movemask_epi8(miss))) << (32 * k);
+        }
+        return m;
+    }
+#endif  // DEDUP_X86_TOKENIZER
+};
+
+// Splits text into maximal runs of non-delimiter bytes.  The delimiter mask of
+// each 64-byte block is computed once and token boundaries are read off it
+// with bit scans.
+//
+// Like the original find_first_of loop this yields one empty token when the
+// text ends in two or more delimiters (or has nothing but delimiters); the
+// concat shingle mode depends on it.
+class TokenGen {
+   public:
+    TokenGen(const std::string_view sv, const CharClass& delimiters) : sv_(sv), cc_(&delimiters) {}
+
+    operator bool() const { return pos_ < sv_.size(); }
+
+    std::string_view operator()() {
+        const size_t start = scan(pos_, false);
+        if (start == sv_.size()) {
+            pos_ = start;
+            return {};
+        }
+        const size_t end = scan(start, true);
+        pos_ = end == sv_.size() ? end : end + 1;
+        return sv_.substr(start, end - start);
+    }
+
+   private:
+    std::string_view sv_;
+    const CharClass* cc_;
+    size_t pos_ = 0;
+    size_t block_ = SIZE_MAX;  // offset of the block mask_ describes
+    uint64_t mask_ = 0;
+
+    // First index >= i whose byte is (delim) or is not (!delim) a delimiter
+    size_t scan(size_t i, bool delim) {
+        while (i < sv_.size()) {
+            const size_t block = i & ~size_t{63};
+            if (block != block_) {
+                block_ = block;
+                mask_ = cc_->mask(sv_.data() + block, std::min<size_t>(64, sv_.size() - block));
+            }
+            uint64_t m = delim ? mask_ : ~mask_;
+            m &= ~uint64_t{0} << (i - block);
+            if (m != 0) {
+                return std::min(sv_.size(), block + __builtin_ctzll(m));
+            }
+            i = block + 64;
+        }
+        return sv_.size();
+    }
+};
+
+#endif  // DEDUP_TOKENIZER_H_
@@ -0,0 +1,172 @@
+#ifndef DEDUP_TUNER_H_
+#define DEDUP_TUNER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./corpus.h"
+#include "./dedup.h"
+#include "./lsh.h"
+
+// Choice of LSH banding for a similarity threshold.  A pair becomes a
+// candidate with probability 1 - (1 - s^rows)^bands; the error rates are the
+// areas of the S-curve that LSHIndex::describe() prints, above the curve
+// right of the threshold (duplicates missed) and below it left of the
+// threshold (pairs verified for nothing).  Every band costs rows hashes per
+// document, so the tuner looks for the shortest signature within both
+// targets, or, given a sample of the corpus, the quickest to run.
+namespace tuner {
+
+struct Banding {
+    size_t bands = 0;
+    size_t rows = 0;
+    double fp = 0;  // false positive area
+    double fn = 0;  // false negative area
+
+    // From a sample, -1 without: candidate pairs expected in the whole corpus
+    // and seconds expected for signing and matching it
+    double candidates = -1;
+    double seconds = -1;
+
+    size_t hashes() const { return bands * rows; }
+};
+
+struct Targets {
+    double similarity = 0.7;  // Jaccard similarity a duplicate must reach
+    size_t max_hashes = 128;  // longest signature considered
+    double max_fn = 0.01;
+    double max_fp = 0.1;
+};
+
+// For each row count, the fewest bands that keep the false negative area
+// within target, if their false positive area is within target too; fewest
+// hashes first.  The false negative area only falls and the false positive
+// area only grows with more bands, so no other banding of those rows can do
+// better on both.  Empty if no banding meets both targets.
+inline std::vector<Banding> frontier(const Targets& t) {
+    std::vector<Banding> options;
+    for (size_t rows = 1; rows <= t.max_hashes; ++rows) {
+        for (size_t bands = 1; bands * rows <= t.max_hashes; ++bands) {
+            const auto [fp, fn] = LSHIndex::error_rates(t.similarity, bands, rows);
+            if (fn <= t.max_fn) {
+                if (fp <= t.max_fp) {
+                    options.push_back({bands, rows, fp, fn});
+                }
+                break;
+            }
+        }
+    }
+    std::stable_sort(options.begin(), options.end(),
+                     [](const Banding& a, const Banding& b) { return a.hashes() < b.hashes(); });
+    return options;
+}
+
+// The banding within max_hashes that misses the targets by the smallest
+// factor, for when frontier() is empty
+inline Banding closest(const Targets& t) {
+    Banding best;
+    double best_excess = 0;
+    for (size_t rows = 1; rows <= t.max_hashes; ++rows) {
+        for (size_t bands = 1; bands * rows <= t.max_hashes; ++bands) {
+            const auto [fp, fn] = LSHIndex::error_rates(t.similarity, bands, rows);
+            const double excess = std::max(fp / t.max_fp, fn / t.max_fn);
+            if (best.bands == 0 || excess < best_excess) {
+                best = {bands, rows, fp, fn};
+                best_excess = excess;
+            }
+        }
+    }
+    return best;
+}
+
+// Documents picked from a corpus, and the number of documents in it
+struct Sample {
+    std::vector<std::string> docs;
+    uint64_t corpus_docs = 0;
+};
+
+// size documents of path picked uniformly at random, by reservoir sampling
+// with a fixed seed so that every run picks the same
+inline Sample sample(const std::string& path, CorpusFormat format, const std::string& field, size_t size,
+                     uint32_t seed = 1) {
+    Sample s;
+    std::mt19937_64 rng(seed);
+    CorpusReader reader(path, format, field);
+    std::vector<std::string_view> docs;
+    while (reader.next_batch(docs)) {
+        for (const std::string_view doc : docs) {
+            const uint64_t seen = s.corpus_docs++;
+            if (s.docs.size() < size) {
+                s.docs.emplace_back(doc);
+            } else {
+                const uint64_t slot = std::uniform_int_distribution<uint64_t>(0, seen)(rng);
+                if (slot < size) {
+                    s.docs[slot] = std::string(doc);
+                }
+            }
+        }
+    }
+    return s;
+}
+
+// Fill in candidates and seconds of every option by running it on the
+// sample with a deduplicator from make(hashes, bands, rows), which must keep
+// its buckets in memory.  Signing and bucketing scale with the corpus, and
+// candidate pairs and their verification with its square, since a pair is in
+// a uniform sample of n of N documents with probability (n / N)^2.
+inline void estimate(std::vector<Banding>& options, const Sample& s,
+                     const std::function<std::unique_ptr<Deduplicator>(size_t, size_t, size_t)>& make) {
+    using clock = std::chrono::steady_clock;
+    const auto seconds_since = [](clock::time_point t) {
+        return std::chrono::duration<double>(clock::now() - t).count();
+    };
+    const std::vector<std::string_view> docs(s.docs.begin(), s.docs.end());
+    const double scale = docs.empty() ? 0.0 : static_cast<double>(s.corpus_docs) / docs.size();
+    for (Banding& b : options) {
+        auto dedup = make(b.hashes(), b.bands, b.rows);
+        auto start = clock::now();
+        dedup->add(docs);
+        const double sign = seconds_since(start);
+        start = clock::now();
+        const double pairs = static_cast<double>(dedup->index().candidates(0).size());
+        const double generate = seconds_since(start);
+        start = clock::now();
+        dedup->duplicates(0);
+        // duplicates() generates the candidates again before verifying them
+        const double verify = std::max(0.0, seconds_since(start) - generate);
+        b.candidates = pairs * scale * scale;
+        b.seconds = (sign + generate) * scale + verify * scale * scale;
+    }
+}
+
+// The option to use: the quickest if estimated, else the shortest
+inline Banding choose(const std::vector<Banding>& options) {
+    if (options.front().seconds >= 0) {
+        return *std::min_element(options.begin(), options.end(),
+                                 [](const Banding& a, const Banding& b) { return a.seconds < b.seconds; });
+    }
+    return options.front();
+}
+
+inline void describe(std::ostream& os, const std::vector<Banding>& options) {
+    for (const Banding& b : options) {
+        os << "  " << b.bands << " x " << b.rows << " (" << b.hashes() << " hashes): fp " << b.fp << ", fn " << b.fn;
+        if (b.seconds >= 0) {
+            os << ", ~" << static_cast<uint64_t>(b.candidates) << " candidates, ~" << b.seconds << " s";
+        }
+        os << "\n";
+    }
+}
+
+}  // namespace tuner
+
+#endif  // DEDUP_TUNER_H_
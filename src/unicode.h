@@ -0,0 +1,509 @@
+#ifndef DEDUP_UNICODE_H_
+#define DEDUP_UNICODE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "./tokenizer.h"
+
+// Just enough Unicode for tokenizing web text: a validating UTF-8 decoder,
+// a coarse classification of code points, simple case folding and a few
+// compatibility mappings.  None of it needs tables beyond the ranges below.
+namespace utf8 {
+
+constexpr uint32_t kReplacement = 0xFFFD;
+
+// Decode the code point at p[0, n), n >= 1, and its length.  Overlong,
+// surrogate, out-of-range and truncated sequences decode as U+FFFD of
+// length 1, so decoding always makes progress.
+inline uint32_t decode(const char* text, size_t n, size_t& len) {
+    const auto* p = reinterpret_cast<const unsigned char*>(text);
+    const uint32_t c = p[0];
+    len = 1;
+    if (c < 0x80) {
+        return c;
+    }
+    const auto cont = [&](size_t i) { return i < n && (p[i] & 0xC0) == 0x80; };
+    if (c >= 0xC2 && c < 0xE0 && cont(1)) {
+        len = 2;
+        return (c & 0x1F) << 6 | (p[1] & 0x3F);
+    }
+    if (c >= 0xE0 && c < 0xF0 && cont(1) && cont(2)) {
+        const uint32_t cp = (c & 0x0F) << 12 | (p[1] & 0x3Fu) << 6 | (p[2] & 0x3F);
+        if (cp >= 0x800 && (cp < 0xD800 || cp > 0xDFFF)) {
+            len = 3;
+            return cp;
+        }
+    } else if (c >= 0xF0 && c < 0xF5 && cont(1) && cont(2) && cont(3)) {
+        const uint32_t cp = (c & 0x07) << 18 | (p[1] & 0x3Fu) << 12 | (p[2] & 0x3Fu) << 6 | (p[3] & 0x3F);
+        if (cp >= 0x10000 && cp <= 0x10FFFF) {
+            len = 4;
+            return cp;
+        }
+    }
+    return kReplacement;
+}
+
+inline void encode(uint32_t cp, std::string& out) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | cp >> 6);
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | cp >> 12);
+        out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | cp >> 18);
+        out += static_cast<char>(0x80 | (cp >> 12 & 0x3F));
+        out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+enum class Kind : uint8_t {
+    kSeparator,  // spaces, punctuation, symbols, emoji, U+FFFD
+    kWord,       // letters, digits and combining marks of scripts written with spaces
+    kIsolated,   // a character of a script written without spaces (Han, kana, Thai, ...)
+    kIgnorable,  // invisible inside words: soft hyphen, zero width, variation selectors, BOM
+};
+
+inline bool in(uint32_t cp, uint32_t lo, uint32_t hi) { return cp - lo <= hi - lo; }
+
+inline Kind classify(uint32_t cp) {
+    if (cp < 0x80) {
+        return in(cp, '0', '9') || in(cp | 0x20, 'a', 'z') ? Kind::kWord : Kind::kSeparator;
+    }
+    if (cp < 0x100) {
+        // Latin-1: letters from U+00C0 and a few letter-like signs below
+        if (cp == 0xAD) {
+            return Kind::kIgnorable;
+        }
+        const bool letter = cp >= 0xC0 ? cp != 0xD7 && cp != 0xF7
+                                       : cp == 0xAA || cp == 0xB2 || cp == 0xB3 || cp == 0xB5 || cp == 0xB9 || cp == 0xBA;
+        return letter ? Kind::kWord : Kind::kSeparator;
+    }
+    if (cp < 0x2000) {
+        if (cp == 0x37E || cp == 0x387 || cp == 0x589 || cp == 0x60C || cp == 0x61B || cp == 0x61F ||
+            cp == 0x6D4 || in(cp, 0x964, 0x965)) {
+            return Kind::kSeparator;
+        }
+        if (in(cp, 0xE00, 0xEFF) || in(cp, 0x1000, 0x109F) || in(cp, 0x1780, 0x17FF)) {
+            return Kind::kIsolated;  // Thai, Lao, Myanmar, Khmer
+        }
+        return Kind::kWord;
+    }
+    if (cp < 0x3000) {
+        if (in(cp, 0x200B, 0x200D) || in(cp, 0x2060, 0x2064)) {
+            return Kind::kIgnorable;
+        }
+        // General punctuation, currency, arrows, maths, box drawing, dingbats,
+        // supplemental punctuation; letter-like symbols and number forms stay
+        // words
+        return in(cp, 0x2070, 0x209F) || in(cp, 0x2100, 0x218F) || in(cp, 0x2C00, 0x2DFF) ? Kind::kWord
+                                                                                            : Kind::kSeparator;
+    }
+    if (cp < 0xA000) {
+        if (cp < 0x3040) {
+            return in(cp, 0x3005, 0x3007) ? Kind::kIsolated : Kind::kSeparator;  // CJK punctuation
+        }
+        // Kana, CJK strokes and Han; Hangul Compatibility Jamo and the like
+        // are written with spaces and stay words
+        return in(cp, 0x3040, 0x30FF) || in(cp, 0x31F0, 0x31FF) || cp >= 0x3400 ? Kind::kIsolated : Kind::kWord;
+    }
+    if (cp < 0xFE00) {
+        return in(cp, 0xF900, 0xFAFF) ? Kind::kIsolated : Kind::kWord;
+    }
+    if (cp < 0x10000) {
+        if (cp <= 0xFE0F || cp == 0xFEFF) {
+            return Kind::kIgnorable;
+        }
+        if (in(cp, 0xFF10, 0xFF19) || in(cp, 0xFF21, 0xFF3A) || in(cp, 0xFF41, 0xFF5A) || in(cp, 0xFFA0, 0xFFDC) ||
+            in(cp, 0xFB00, 0xFDFF) || in(cp, 0xFE70, 0xFEFE)) {
+            return Kind::kWord;  // fullwidth alphanumerics, halfwidth Hangul, presentation forms
+        }
+        return in(cp, 0xFF66, 0xFF9F) ? Kind::kIsolated : Kind::kSeparator;
+    }
+    if (in(cp, 0x1F000, 0x1FAFF)) {
+        return Kind::kSeparator;  // emoji and other pictographs
+    }
+    if (in(cp, 0xE0000, 0xE0FFF)) {
+        return Kind::kIgnorable;  // tags and variation selectors supplement
+    }
+    return in(cp, 0x20000, 0x3FFFF) ? Kind::kIsolated : Kind::kWord;
+}
+
+// Simple (one to one) case folding for Latin, Greek, Cyrillic and Armenian
+inline uint32_t fold(uint32_t cp) {
+    const auto even_up = [cp](uint32_t lo, uint32_t hi) { return in(cp, lo, hi) && cp % 2 == 0; };
+    const auto odd_up = [cp](uint32_t lo, uint32_t hi) { return in(cp, lo, hi) && cp % 2 == 1; };
+    if (cp < 0x80) {
+        return in(cp, 'A', 'Z') ? cp + 32 : cp;
+    }
+    if (in(cp, 0xC0, 0xDE) && cp != 0xD7) {
+        return cp + 32;
+    }
+    if (cp < 0x100) {
+        return cp;
+    }
+    if (even_up(0x100, 0x12F) || even_up(0x132, 0x137) || odd_up(0x139, 0x148) || even_up(0x14A, 0x177) ||
+        odd_up(0x179, 0x17E) || odd_up(0x1CD, 0x1DC) || even_up(0x1DE, 0x1EF) || even_up(0x1F8, 0x21F) ||
+        even_up(0x222, 0x233) || even_up(0x460, 0x481) || even_up(0x48A, 0x4BF) || odd_up(0x4C1, 0x4CE) ||
+        even_up(0x4D0, 0x52F) || even_up(0x1E00, 0x1E95) || even_up(0x1EA0, 0x1EFF)) {
+        return cp + 1;
+    }
+    switch (cp) {
+        case 0x178: return 0xFF;
+        case 0x17F: return 's';
+        case 0x386: return 0x3AC;
+        case 0x38C: return 0x3CC;
+        case 0x3C2: return 0x3C3;
+        case 0x4C0: return 0x4CF;
+        default: break;
+    }
+    if (in(cp, 0x388, 0x38A)) {
+        return cp + 37;
+    }
+    if (in(cp, 0x38E, 0x38F)) {
+        return cp + 63;
+    }
+    if (in(cp, 0x391, 0x3AB) && cp != 0x3A2) {
+        return cp + 32;
+    }
+    if (in(cp, 0x400, 0x40F)) {
+        return cp + 80;
+    }
+    if (in(cp, 0x410, 0x42F)) {
+        return cp + 32;
+    }
+    if (in(cp, 0x531, 0x556)) {
+        return cp + 48;
+    }
+    if (in(cp, 0xFF21, 0xFF3A)) {
+        return cp + 32;
+    }
+    return cp;
+}
+
+// "NFKC-lite": the compatibility mappings that matter in scraped text
+// (fullwidth forms, ideographic space, Latin ligatures, super- and subscript
+// digits, a few letter-like signs).  Writes one to three code points to out
+// and returns how many.  There is no canonical composition, so a letter
+// followed by a combining accent stays two code points.
+inline size_t normalize(uint32_t cp, uint32_t out[3]) {
+    out[0] = cp;
+    if (cp < 0xA0) {
+        return 1;
+    }
+    if (in(cp, 0xFF01, 0xFF5E)) {
+        out[0] = cp - 0xFEE0;
+        return 1;
+    }
+    if (in(cp, 0x2080, 0x2089)) {
+        out[0] = '0' + (cp - 0x2080);
+        return 1;
+    }
+    if (in(cp, 0x2074, 0x2079)) {
+        out[0] = '0' + (cp - 0x2070);
+        return 1;
+    }
+    const auto two = [out](uint32_t a, uint32_t b) {
+        out[0] = a;
+        out[1] = b;
+        return size_t{2};
+    };
+    switch (cp) {
+        case 0xA0:
+        case 0x3000: out[0] = ' '; break;
+        case 0xAA: out[0] = 'a'; break;
+        case 0xB2: out[0] = '2'; break;
+        case 0xB3: out[0] = '3'; break;
+        case 0xB5: out[0] = 0x3BC; break;
+        case 0xB9: out[0] = '1'; break;
+        case 0xBA: out[0] = 'o'; break;
+        case 0x132: return two('I', 'J');
+        case 0x133: return two('i', 'j');
+        case 0x17F: out[0] = 's'; break;
+        case 0x2070: out[0] = '0'; break;
+        case 0x2126: out[0] = 0x3A9; break;
+        case 0x212A: out[0] = 'K'; break;
+        case 0x212B: out[0] = 0xC5; break;
+        case 0xFB00: return two('f', 'f');
+        case 0xFB01: return two('f', 'i');
+        case 0xFB02: return two('f', 'l');
+        case 0xFB03: out[2] = 'i'; two('f', 'f'); return 3;
+        case 0xFB04: out[2] = 'l'; two('f', 'f'); return 3;
+        case 0xFB05:
+        case 0xFB06: return two('s', 't');
+        default: break;
+    }
+    return 1;
+}
+
+// Bit i is set iff p[i] >= 0x80 (high_mask) or is in 'A'..'Z' (upper_mask),
+// for i < n <= 64.  On mostly-ASCII text the high mask is the whole
+// validation cost of a block: only set bits are decoded.
+inline uint64_t high_mask(const char* p, size_t n);
+inline uint64_t upper_mask(const char* p, size_t n);
+
+namespace detail {
+
+// Calls block(p + 16 * k) for the four 16-byte quarters of a zero-padded
+// 64-byte block; block returns the 16-bit mask of its quarter
+template <typename Quarter>
+uint64_t mask64(const char* p, size_t n, Quarter quarter) {
+    char padded[64];
+    if (n < 64) {
+        std::memset(padded, 0, sizeof(padded));
+        std::memcpy(padded, p, n);
+        p = padded;
+    }
+    uint64_t m = 0;
+    for (int k = 0; k < 4; ++k) {
+        m |= static_cast<uint64_t>(quarter(p + 16 * k)) << (16 * k);
+    }
+    return m;
+}
+
+}  // namespace detail
+
+inline uint64_t high_mask(const char* p, size_t n) {
+    return detail::mask64(p, n, [](const char* q) {
+#ifdef DEDUP_X86_TOKENIZER
+        return static_cast<uint16_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(q))));
+#else
+        uint32_t m = 0;
+        for (int i = 0; i < 16; ++i) {
+            m |= static_cast<uint32_t>(static_cast<unsigned char>(q[i]) >> 7) << i;
+        }
+        return static_cast<uint16_t>(m);
+#endif
+    });
+}
+
+inline uint64_t upper_mask(const char* p, size_t n) {
+    return detail::mask64(p, n, [](const char* q) {
+#ifdef DEDUP_X86_TOKENIZER
+        // x - 'A' <= 25 as unsigned bytes
+        const __m128i t = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(q)), _mm_set1_epi8('A'));
+        return static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(25)), t)));
+#else
+        uint32_t m = 0;
+        for (int i = 0; i < 16; ++i) {
+            m |= static_cast<uint32_t>(in(static_cast<unsigned char>(q[i]), 'A', 'Z')) << i;
+        }
+        return static_cast<uint16_t>(m);
+#endif
+    });
+}
+
+}  // namespace utf8
+
+struct Utf8Options {
+    bool chars = false;      // every letter or digit is its own token
+    bool fold_case = false;  // utf8::fold every code point
+    bool normalize = false;  // utf8::normalize every code point
+};
+
+// Splits UTF-8 text into words: maximal runs of utf8::Kind::kWord code
+// points, with ignorable code points dropped.  A character of a script
+// written without spaces is a token by itself, so word shingles over such
+// text are character shingles.  With Utf8Options::chars every word
+// character is a token.  Unlike TokenGen no empty tokens are produced.
+//
+// ASCII runs are found 64 bytes at a time from two masks, the delimiter mask
+// of stops (CharClass::non_alnum(), which contains every byte >= 0x80) and
+// utf8::high_mask; only the bytes of non-ASCII characters go through the
+// decoder.  Tokens that pass through normalization and folding unchanged are
+// views into the text; others are built in buf, which the next token
+// overwrites.
+class Utf8TokenGen {
+   public:
+    Utf8TokenGen(const std::string_view sv, const CharClass& stops, const Utf8Options& options, std::string& buf)
+        : sv_(sv), stops_(&stops), opt_(options), buf_(&buf) {}
+
+    operator bool() {
+        if (!at_token_) {
+            pos_ = skip(pos_);
+            at_token_ = true;
+        }
+        return pos_ < sv_.size();
+    }
+
+    std::string_view operator()() {
+        if (!*this) {
+            return {};
+        }
+        at_token_ = false;
+        const size_t start = pos_;
+        copied_ = false;
+        size_t i = start;
+        if (opt_.chars) {
+            i = append_char(start, start);
+        } else {
+            while (i < sv_.size()) {
+                const auto c = static_cast<unsigned char>(sv_[i]);
+                if (c < 0x80) {
+                    if (stops_->contains(c)) {
+                        break;
+                    }
+                    i = append_ascii(start, i, scan(i, kStop));
+                    continue;
+                }
+                size_t len;
+                uint32_t cps[3];
+                const uint32_t cp = utf8::decode(sv_.data() + i, sv_.size() - i, len);
+                const size_t n = transform(cp, cps);
+                const auto kind = utf8::classify(cps[0]);
+                if (kind == utf8::Kind::kIgnorable) {
+                    copy(start, i);
+                    i += len;
+                    continue;
+                }
+                if (kind == utf8::Kind::kIsolated && i == start) {
+                    i = append(start, i, len, cp, cps, n);
+                }
+                if (kind != utf8::Kind::kWord) {
+                    break;
+                }
+                i = append(start, i, len, cp, cps, n);
+            }
+        }
+        pos_ = i;
+        return copied_ ? std::string_view(*buf_) : sv_.substr(start, i - start);
+    }
+
+   private:
+    enum Want { kStop, kStart };
+
+    std::string_view sv_;
+    const CharClass* stops_;
+    Utf8Options opt_;
+    std::string* buf_;
+    size_t pos_ = 0;
+    bool at_token_ = false;  // pos_ is the start of a token, or the end
+    bool copied_ = false;  // whether the current token lives in buf_
+    size_t block_ = SIZE_MAX;
+    uint64_t stop_ = 0;  // ASCII delimiters and bytes >= 0x80
+    uint64_t high_ = 0;   // bytes >= 0x80
+    uint64_t upper_ = 0;  // 'A'..'Z' when folding case
+
+    // First index >= i that is a possible end of an ASCII run (kStop), or a
+    // possible token start: an ASCII letter or digit or a byte >= 0x80
+    // (kStart)
+    size_t scan(size_t i, Want want) {
+        while (i < sv_.size()) {
+            const size_t block = i & ~size_t{63};
+            if (block != block_) {
+                block_ = block;
+                const size_t n = std::min<size_t>(64, sv_.size() - block);
+                stop_ = stops_->mask(sv_.data() + block, n);
+                high_ = utf8::high_mask(sv_.data() + block, n);
+                upper_ = opt_.fold_case ? utf8::upper_mask(sv_.data() + block, n) : 0;
+            }
+            uint64_t m = want == kStop ? stop_ : ~stop_ | high_;
+            m &= ~uint64_t{0} << (i - block);
+            if (m != 0) {
+                return std::min(sv_.size(), block + __builtin_ctzll(m));
+            }
+            i = block + 64;
+        }
+        return sv_.size();
+    }
+
+    // Start of the next token at or after i
+    size_t skip(size_t i) {
+        while ((i = scan(i, kStart)) < sv_.size()) {
+            if (static_cast<unsigned char>(sv_[i]) < 0x80) {
+                return i;
+            }
+            size_t len;
+            uint32_t cps[3];
+            transform(utf8::decode(sv_.data() + i, sv_.size() - i, len), cps);
+            const auto kind = utf8::classify(cps[0]);
+            if (kind == utf8::Kind::kWord || kind == utf8::Kind::kIsolated) {
+                return i;
+            }
+            i += len;
+        }
+        return i;
+    }
+
+    size_t transform(uint32_t cp, uint32_t out[3]) const {
+        size_t n = 1;
+        out[0] = cp;
+        if (opt_.normalize) {
+            n = utf8::normalize(cp, out);
+        }
+        if (opt_.fold_case) {
+            for (size_t k = 0; k < n; ++k) {
+                out[k] = utf8::fold(out[k]);
+            }
+        }
+        return n;
+    }
+
+    // Move the token [start, i) so far into buf_, from where it continues
+    void copy(size_t start, size_t i) {
+        if (!copied_) {
+            copied_ = true;
+            buf_->assign(sv_.data() + start, i - start);
+        }
+    }
+
+    // Add the ASCII letters and digits [i, end) to the token
+    size_t append_ascii(size_t start, size_t i, size_t end) {
+        if (!copied_ && i >= block_ && end - block_ <= 64) {
+            // The run is inside the cached block, so its upper-case letters
+            // can be read off upper_
+            const uint64_t run = (end - i == 64 ? ~uint64_t{0} : (uint64_t{1} << (end - i)) - 1) << (i - block_);
+            const uint64_t upper = upper_ & run;
+            if (upper == 0) {
+                return end;
+            }
+            i = block_ + __builtin_ctzll(upper);
+        }
+        for (size_t k = i; k < end; ++k) {
+            const char c = sv_[k];
+            const bool upper = opt_.fold_case && utf8::in(static_cast<unsigned char>(c), 'A', 'Z');
+            if (upper) {
+                copy(start, k);
+            }
+            if (copied_) {
+                *buf_ += upper ? static_cast<char>(c + 32) : c;
+            }
+        }
+        return end;
+    }
+
+    // Add the character cp at [i, i + len), which transformed to cps[0, n)
+    size_t append(size_t start, size_t i, size_t len, uint32_t cp, const uint32_t* cps, size_t n) {
+        if (n != 1 || cps[0] != cp) {
+            copy(start, i);
+            for (size_t k = 0; k < n; ++k) {
+                utf8::encode(cps[k], *buf_);
+            }
+        } else if (copied_) {
+            buf_->append(sv_.data() + i, len);
+        }
+        return i + len;
+    }
+
+    // The single character at i as the whole token
+    size_t append_char(size_t start, size_t i) {
+        if (static_cast<unsigned char>(sv_[i]) < 0x80) {
+            return append_ascii(start, i, i + 1);
+        }
+        size_t len;
+        uint32_t cps[3];
+        const uint32_t cp = utf8::decode(sv_.data() + i, sv_.size() - i, len);
+        return append(start, i, len, cp, cps, transform(cp, cps));
+    }
+};
+
+#endif  // DEDUP_UNICODE_H_
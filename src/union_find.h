@@ -0,0 +1,66 @@
+#ifndef DEDUP_UNION_FIND_H_
+#define DEDUP_UNION_FIND_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Lock-free disjoint sets over [0, n) in the style of Anderson & Woll.  Roots
+// are only ever linked below smaller roots, so the representative of a set is
+// always its smallest member no matter in which order or on which threads the
+// unions happen.  That keeps cluster ids reproducible across thread counts.
+// Index is the element type: uint32_t for DocIds, uint64_t past 2^32 elements.
+template <typename Index>
+class BasicConcurrentUnionFind {
+   public:
+    explicit BasicConcurrentUnionFind(size_t n) : parent_(new std::atomic<Index>[n]), size_(n) {
+        for (size_t i = 0; i < n; ++i) {
+            parent_[i].store(static_cast<Index>(i), std::memory_order_relaxed);
+        }
+    }
+
+    size_t size() const { return size_; }
+
+    // Representative of x; halves the path on the way up
+    Index find(Index x) {
+        while (true) {
+            Index p = parent_[x].load(std::memory_order_relaxed);
+            if (p == x) {
+                return x;
+            }
+            const Index gp = parent_[p].load(std::memory_order_relaxed);
+            if (gp != p) {
+                // Only ever moves x closer to a root, so losing the race is fine
+                parent_[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+            }
+            x = gp;
+        }
+    }
+
+    void unite(Index a, Index b) {
+        while (true) {
+            a = find(a);
+            b = find(b);
+            if (a == b) {
+                return;
+            }
+            if (a > b) {
+                std::swap(a, b);
+            }
+            Index expected = b;
+            if (parent_[b].compare_exchange_strong(expected, a, std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+    }
+
+   private:
+    std::unique_ptr<std::atomic<Index>[]> parent_;
+    size_t size_;
+};
+
+using ConcurrentUnionFind = BasicConcurrentUnionFind<uint32_t>;
+
+#endif  // DEDUP_UNION_FIND_H_